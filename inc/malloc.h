@@ -0,0 +1,26 @@
+#ifndef INC_MALLOC_H
+#define INC_MALLOC_H
+#include <inc/types.h>
+
+/*
+ * The heap of a program, in lib/malloc.c.  Small blocks come in size
+ * classes of powers of two, taken from the heap (sbrk()) and kept on a
+ * free list per class; every thread caches a few of each class in its
+ * struct tls, so most calls take no lock.  Big blocks are mmap()ed one
+ * by one and munmap()ed by free().
+ */
+
+#define MALLOC_CLASSES	8	// 16 .. 2048 bytes, with the header
+
+// Blocks a thread keeps for itself, see inc/tls.h
+struct malloc_cache {
+	void *free[MALLOC_CLASSES];
+	uint32_t count[MALLOC_CLASSES];
+};
+
+void *malloc(size_t size);
+void *calloc(size_t n, size_t size);
+void *realloc(void *p, size_t size);
+void free(void *p);
+
+#endif
@@ -16,7 +16,9 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_TSS0   0x28     // Task segment selector (each CPU has its own GDT)
+#define GD_PERCPU 0x30     // Per-CPU data, %gs in the kernel
+#define GD_TLS    0x38     // Thread local storage, %gs in user mode
 
 /*
  * Virtual memory map:                                Permissions
@@ -51,7 +53,8 @@
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ * UTOP,UENVS, ----->  +------------------------------+ 0xeec00000
+ *   UVCLOCK
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
@@ -114,6 +117,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only clock data for clock_gettime() (struct vclock in inc/time.h)
+#define UVCLOCK		UENVS
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -131,6 +136,20 @@
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
+// Max size of the user image loaded at boot
+#define UIMAGE_SIZE	(64*PGSIZE)
+
+// The heap grows from UHEAP with sbrk(), up to UMMAP at most
+#define UHEAP		0x10000000
+
+// mmap() and shm_map() place regions in [UMMAP, UMMAP_TOP), which
+// keeps their addresses positive as return values
+#define UMMAP		0x40000000
+#define UMMAP_TOP	0x80000000
+
+// Thread local page of the first thread of a program, %gs points at it
+// (see clone()).  A guard page below the stack keeps them apart.
+#define UTLS		(USTACKTOP - USR_STACK_SIZE - 2*PGSIZE)
 
 // Used for temporary page mappings.  Typed 'void*' for convenience
 #define UTEMP		((void*) PTSIZE)
@@ -187,6 +206,10 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// PP_HUGE on the first page of a 4MB page, which holds its
+	// reference count (see page_alloc_huge())
+	uint16_t pp_flags;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -15,7 +15,8 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_TSS0   0x28     // Task segment selector (each CPU has its own GDT)
+#define GD_PERCPU 0x30     // Per-CPU data, %gs in the kernel
 
 /*
  *
@@ -84,6 +85,8 @@
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
+// Address in a page directory entry of a 4MB page (PTE_PS)
+#define PDE_PS_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
 
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
@@ -99,6 +102,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -0,0 +1,48 @@
+#ifndef INC_RING_H
+#define INC_RING_H
+#include <inc/types.h>
+
+/*
+ * A queue of fixed size messages from one producer to one consumer, in
+ * memory both can reach, e.g. a segment of shm_map() or the memory of
+ * threads.  In lib/ring.c.  As long as it is neither empty nor full
+ * both sides only load and store, a side enters the kernel to sleep
+ * with futex_wait() or to wake the other one if it sleeps.
+ *
+ * Each side writes its own cache line only, and keeps the last index
+ * it read of the other side to touch the other line less often.
+ */
+
+#define RING_LINE	64
+
+struct ring {
+	// The producer's
+	volatile uint32_t head;		// Messages sent
+	volatile uint32_t prod_waiting;	// Asleep on tail, or about to be
+	uint32_t tail_cache;
+	char pad0[RING_LINE - 12];
+	// The consumer's
+	volatile uint32_t tail;		// Messages received
+	volatile uint32_t cons_waiting;	// Asleep on head, or about to be
+	uint32_t head_cache;
+	char pad1[RING_LINE - 12];
+	// Set once by ring_init()
+	uint32_t mask;			// Slots - 1
+	uint32_t msgsize;
+	char pad2[RING_LINE - 8];
+	char data[];
+};
+
+// A ring with as many msgsize slots as fit into memsize bytes at mem,
+// a power of two, or NULL if not even two do
+struct ring *ring_init(void *mem, size_t memsize, size_t msgsize);
+// Copy msg into the ring, false if it is full
+bool ring_trysend(struct ring *r, const void *msg);
+// The same, sleeps while it is full
+void ring_send(struct ring *r, const void *msg);
+// Copy the oldest message into msg, false if it is empty
+bool ring_tryrecv(struct ring *r, void *msg);
+// The same, sleeps while it is empty
+void ring_recv(struct ring *r, void *msg);
+
+#endif
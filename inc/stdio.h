@@ -15,11 +15,14 @@
 /* Device error codes */
 #define STATUS_OK			0		/* no error */
 #define STATUS_ENOENT		2		/* No such file or directory */
+#define STATUS_EINTR		4		/* Interrupted system call */
 #define STATUS_EIO		 	5		/* I/O error */
 #define STATUS_ENXIO		6		/* No such device or address */
+#define STATUS_ENOEXEC		8		/* Exec format error */
 #define STATUS_EBADF		9		/* Bad file number */
 #define STATUS_EAGIAN		11		/* Try again */
 #define STATUS_ENOMEM		12		/* no memory */
+#define STATUS_EFAULT		14		/* Bad address */
 #define STATUS_EBUSY		16		/* Device or resource busy */
 #define STATUS_EEXIST		17		/* File exists */
 #define STATUS_EXDEV		18		/* Cross-device link */
@@ -29,8 +32,10 @@
 #define STATUS_EINVAL		22		/* Invalid argument */
 #define STATUS_ENOSPC		28		/* No space left on device */
 #define STATUS_EROFS		30		/* Read-only file system */
+#define STATUS_EPIPE		32		/* Broken pipe */
 #define STATUS_ENOSYS		38		/* Function not implemented */
 #define STATUS_ENOTEMPTY	39		/* Directory not empty */
+#define STATUS_ETIMEDOUT	110		/* Connection timed out */
 
 /* Operation flags */
 #define O_RDONLY		0x0000000
@@ -0,0 +1,51 @@
+#ifndef INC_SYNC_H
+#define INC_SYNC_H
+#include <inc/types.h>
+
+/*
+ * Locks for the threads of a program (see clone()) or tasks sharing
+ * memory, in lib/sync.c.  They are words of user memory changed with
+ * atomic instructions, a task only enters the kernel to sleep on a
+ * contended one with futex_wait() or to wake a sleeper.  All of them
+ * may start out zeroed.
+ */
+
+// 0 unlocked, 1 locked, 2 locked and maybe somebody sleeps on it
+struct mutex {
+	volatile uint32_t val;
+};
+
+// Bumped by every signal, waiters sleep while it stays the same
+struct cond {
+	volatile uint32_t seq;
+};
+
+struct sem {
+	volatile uint32_t count;
+	volatile uint32_t waiters;	// Asleep or about to be
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0 }
+#define SEM_INITIALIZER(n)	{ (n), 0 }
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+bool mutex_trylock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+void cond_init(struct cond *c);
+void cond_wait(struct cond *c, struct mutex *m);
+// -STATUS_ETIMEDOUT if not signalled within ticks, m is held again
+int cond_timedwait(struct cond *c, struct mutex *m, int32_t ticks);
+void cond_signal(struct cond *c);
+void cond_broadcast(struct cond *c);
+
+void sem_init(struct sem *s, uint32_t count);
+void sem_wait(struct sem *s);
+// -STATUS_ETIMEDOUT if the count stayed 0 for ticks
+int sem_timedwait(struct sem *s, int32_t ticks);
+bool sem_trywait(struct sem *s);
+void sem_post(struct sem *s);
+
+#endif
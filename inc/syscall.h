@@ -23,6 +23,31 @@ enum {
 	SYS_lseek,
 	SYS_unlink,
 	SYS_readdir,
+	SYS_lockstat,
+	SYS_yield,
+	SYS_clock_gettime,
+	SYS_prof,
+	SYS_perf_read,
+	SYS_ktrace,
+	SYS_task_stat,
+	SYS_cpu_stat,
+	SYS_sched_setscheduler,
+	SYS_exec,
+	SYS_spawn,
+	SYS_vfork,
+	SYS_clone,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_pipe,
+	SYS_dup2,
+	SYS_splice,
+	SYS_vmsplice,
+	SYS_shm_create,
+	SYS_shm_map,
+	SYS_shm_remove,
+	SYS_sbrk,
+	SYS_mmap,
+	SYS_munmap,
 	NSYSCALLS
 };
 
@@ -40,6 +65,194 @@ uint32_t sleep(uint32_t ticks);
 void settextcolor(unsigned char forecolor, unsigned char backcolor);
 int32_t cls(void);
 
+/* Select sysenter (enable > 0) or the int gate (enable == 0) for system
+ * calls, enable < 0 only queries.  Returns the previous setting. */
+int fast_syscall(int enable);
+
+/* Kernel spinlock statistics, times are in TSC cycles */
+struct lockstat {
+	char name[16];
+	uint32_t acquisitions;
+	uint32_t contended;
+	uint64_t spin_cycles;
+	uint64_t max_hold;
+};
+
+/* Fill up to n entries and return how many, reset clears the counters
+ * afterwards. */
+int lockstat(struct lockstat *st, int n, bool reset);
+
+/* Give the CPU to the next runnable task, if there is one */
+int32_t yield(void);
+
+/* Sampling profiler, one sample per timer interrupt and CPU, or every
+ * n cycles with PROF_START n > 0 if the CPU has a PMU */
+struct prof_sample {
+	uint32_t eip;		// Interrupted instruction
+	int16_t pid;		// -1 in the kernel idle loop
+	uint8_t cpu;
+	uint8_t user;		// Interrupted in user mode
+};
+
+enum {
+	PROF_START,		// Clear the buffers and start sampling
+	PROF_STOP,
+	PROF_DRAIN,		// Move up to n samples into buf, returns count
+	PROF_DROPPED,		// Samples lost to full buffers
+};
+
+int prof(int op, struct prof_sample *buf, int n);
+
+/* Hardware performance counters, counted per task */
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_NEVENTS
+};
+
+struct perf_counts {
+	uint64_t count[PERF_NEVENTS];
+	uint32_t valid;		// Bit mask of the events the CPU counts
+};
+
+/* Counts of task pid (0 for the caller) since it was created */
+int perf_read(int pid, struct perf_counts *pc);
+
+/* Kernel tracepoints */
+enum {
+	EV_SCHED_SWITCH,	// a0 previous pid, a1 next pid (-1 idle)
+	EV_WAKEUP,		// a0 pid, a1 its CPU
+	EV_SYSCALL_ENTER,	// a0 number, a1 first argument
+	EV_SYSCALL_EXIT,	// a0 number, a1 return value
+	EV_PAGE_ALLOC,		// a0 physical address, a1 flags
+	EV_PAGE_FREE,		// a0 physical address
+	EV_DISK_ISSUE,		// a0 sector, a1 count, bit 8 set for writes
+	EV_DISK_DONE,		// a0 sector, a1 error
+	EV_NR
+};
+
+struct trace_event {
+	uint64_t tsc;
+	uint8_t ev;
+	uint8_t cpu;
+	int16_t pid;		// -1 in the kernel idle loop
+	uint32_t a0;
+	uint32_t a1;
+};
+
+enum {
+	TRACE_START,		// Clear the buffers, enable the events in mask n
+	TRACE_STOP,
+	TRACE_DRAIN,		// Move up to n events into buf, returns count
+	TRACE_DROPPED,		// Events lost to full buffers
+};
+
+int ktrace(int op, struct trace_event *buf, int n);
+
+/* Scheduler statistics, times are in TSC cycles */
+struct task_stat {
+	int pid;
+	int ppid;
+	int state;		// TaskState of kernel/task.h
+	int cpu;		// CPU it last ran on
+	int policy;		// Scheduling class and priority, see below
+	int prio;
+	uint64_t utime;		// Running in user mode
+	uint64_t stime;		// Running in the kernel
+	uint64_t wait;		// Runnable, waiting for a CPU
+	uint32_t nvcsw;		// Voluntary context switches (blocked)
+	uint32_t nivcsw;	// Involuntary ones (preempted, yield)
+	uint32_t nsyscalls;
+	uint32_t npgfaults;
+	char name[16];		// Of a kernel thread, else empty
+};
+
+struct cpu_stat {
+	uint64_t idle;		// In the kernel idle loop
+	uint64_t tsc;		// TSC when this was taken
+};
+
+/* Fill up to n entries for the live tasks, or the CPUs, return count */
+int task_stat(struct task_stat *buf, int n);
+int cpu_stat(struct cpu_stat *buf, int n);
+
+/* Scheduling classes */
+enum {
+	SCHED_NORMAL,		// Fair share by nice level
+	SCHED_FIFO,		// Real time, runs until it blocks or yields
+	SCHED_IDLE,		// Only when nothing else wants the CPU
+};
+
+#define NICE_MIN	-20
+#define NICE_MAX	19
+#define RT_PRIO_MIN	1
+#define RT_PRIO_MAX	99
+
+/* Move task pid (0 for the caller) to class policy, prio is the nice
+ * level of SCHED_NORMAL and SCHED_IDLE, the priority of SCHED_FIFO. */
+int sched_setscheduler(int pid, int policy, int prio);
+
+/* Replace the caller's program by the ELF file path, which is started
+ * as _start(argc, argv).  Only returns on an error. */
+int exec(const char *path, char *const argv[]);
+
+/* Start the ELF file path with argv in a new task, without copying the
+ * caller.  Returns the pid of the child. */
+int spawn(const char *path, char *const argv[]);
+
+/* Like fork(), but the child runs on the caller's memory, which waits
+ * until the child calls exec() or exits.  Until then the child must
+ * not return from the function which called vfork(). */
+int32_t vfork(void);
+
+/* Run fn(arg) in a new thread, which shares the caller's memory, on the
+ * stack ending at stack, with %gs based at tls, a zeroed struct tls (see
+ * inc/tls.h) or NULL if the thread does not call malloc().  The thread
+ * is gone when fn returns.  Returns its pid. */
+int clone(int (*fn)(void *), void *arg, void *stack, void *tls);
+
+/* Sleep while *addr is val, -STATUS_EAGIAN if it is not.  Wakes up on
+ * futex_wake() of addr by a task sharing its memory, or returns
+ * -STATUS_ETIMEDOUT after timeout ticks unless timeout is 0.  See
+ * inc/sync.h for locks built on it. */
+int futex_wait(volatile uint32_t *addr, uint32_t val, int32_t timeout);
+/* Wake up to n tasks waiting on addr, returns how many */
+int futex_wake(volatile uint32_t *addr, int n);
+
+#define SHM_HUGE	0x1	// Of 4MB pages, size rounded up to them
+
+/* A new zeroed shared memory segment of size bytes, returns its id.
+ * shm_map() maps it into the caller and returns the address, or the
+ * negative error as a pointer.  The mapping is shared with children
+ * forked afterwards too.  After shm_remove() the id is gone, and the
+ * memory with the last mapping.
+ * See inc/ring.h for a message queue in such a segment. */
+int shm_create(size_t size, int flags);
+void *shm_map(int id);
+int shm_remove(int id);
+
+/* Move the end of the heap, which starts out empty at UHEAP, by incr
+ * bytes.  Returns the old end, or the negative error as a pointer.  Its
+ * pages are zeroed on the first touch.  See inc/malloc.h. */
+void *sbrk(intptr_t incr);
+
+#define PROT_READ	0x1
+#define PROT_WRITE	0x2
+#define MAP_FIXED	0x10	// At addr, which must be free
+#define MAP_ANON	0x20	// Zeroed memory, the only kind so far
+#define MAP_HUGE	0x40	// In 4MB pages, not with MAP_FIXED
+
+/* len bytes of memory with MAP_ANON, zeroed on the first touch, at addr
+ * with MAP_FIXED, otherwise wherever there is room.  Returns the
+ * address, or the negative error as a pointer.  With MAP_HUGE the
+ * region is aligned and rounded up to 4MB, fewer TLB misses for large
+ * arrays; munmap() of it takes whole 4MB pages. */
+void *mmap(void *addr, size_t len, int prot, int flags);
+/* Unmap the pages of [addr, addr + len), anything mapped */
+int munmap(void *addr, size_t len);
+
 /*********** Lab7 ************/
 int open(const char *file, int flags, int mode);
 int close(int d);
@@ -49,4 +262,23 @@ off_t lseek(int fd, off_t offset, int whence);
 int unlink(const char *pathname);
 int readdir(const char *pathname);
 
+/* The standard input and output for read() and write(), the console
+ * unless a file or a pipe was given with dup2().  Reading the console
+ * this way is not supported, see getc(). */
+#define STDIN_FILENO	0x100
+#define STDOUT_FILENO	0x101
+
+/* A pipe, read it from fds[0] and write it to fds[1].  Pipe ends are
+ * closed with close() and with the last task using them. */
+int pipe(int *fds);
+/* Make fd (-1 for the console) the standard input or output std of the
+ * caller and the tasks it creates from now on */
+int dup2(int fd, int std);
+/* Move up to len bytes from a file into a pipe or from a pipe into a
+ * file, as whole pages without copying.  Returns the bytes moved. */
+int splice(int in, int out, size_t len);
+/* Write buf into the pipe fd, whole pages are handed over copy on write
+ * instead of being copied */
+int vmsplice(int fd, const void *buf, size_t len);
+
 #endif
@@ -0,0 +1,54 @@
+#ifndef INC_TIME_H
+#define INC_TIME_H
+#include <inc/types.h>
+#include <inc/x86.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+
+/* Clock ids of clock_gettime() */
+#define CLOCK_MONOTONIC	1	// Nanoseconds since boot
+
+struct timespec {
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+};
+
+/*
+ * Clock data the kernel shares read-only with every task at UVCLOCK,
+ * so clock_gettime() does not need a system call.  CPU 0 moves the
+ * base forward on every timer tick, which keeps (tsc - tsc_base) small
+ * enough for the 64-bit multiply.
+ */
+struct vclock {
+	volatile uint32_t seq;	// Odd while the kernel updates it
+	uint32_t mult;		// ns = (tsc - tsc_base) * mult >> shift
+	uint32_t shift;
+	uint32_t tsc_khz;	// 0 if the TSC could not be calibrated
+	uint64_t tsc_base;
+	uint64_t ns_base;
+};
+
+// Nanoseconds since boot, the TSCs of all CPUs are assumed to be in sync
+static inline uint64_t
+vclock_read(const volatile struct vclock *vc)
+{
+	uint32_t seq;
+	uint64_t tsc, ns;
+
+	do {
+		while ((seq = vc->seq) & 1)
+			asm volatile("pause");
+		asm volatile("" ::: "memory");
+		tsc = read_tsc();
+		ns = vc->ns_base;
+		if (tsc > vc->tsc_base)
+			ns += ((tsc - vc->tsc_base) * vc->mult) >> vc->shift;
+		asm volatile("" ::: "memory");
+	} while (vc->seq != seq);
+	return ns;
+}
+
+int clock_gettime(int clk, struct timespec *tp);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef INC_TLS_H
+#define INC_TLS_H
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/malloc.h>
+
+/*
+ * Thread local storage, where %gs points in user mode: the zeroed page
+ * UTLS in the first thread of a program, the tls of clone() in the
+ * others.  A thread started without one may not call malloc().
+ */
+struct tls {
+	struct tls *self;	// Set by clone(), 0 in the first thread
+	struct malloc_cache mcache;
+};
+
+static __inline struct tls *
+tls_get(void)
+{
+	struct tls *t;
+
+	asm volatile("movl %%gs:0, %0" : "=r" (t));
+	return t ? t : (struct tls *)UTLS;
+}
+
+#endif
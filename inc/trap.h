@@ -38,6 +38,8 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20	// IPI: run the scheduler
+#define IRQ_TLB         21	// IPI: TLB shootdown
 
 #ifndef __ASSEMBLER__
 
@@ -57,6 +59,10 @@ struct PushRegs {
 
 struct Trapframe {
 	struct PushRegs tf_regs;
+	uint16_t tf_gs;
+	uint16_t tf_padding_gs;
+	uint16_t tf_fs;
+	uint16_t tf_padding_fs;
 	uint16_t tf_es;
 	uint16_t tf_padding1;
 	uint16_t tf_ds;
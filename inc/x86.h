@@ -37,6 +37,20 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint32_t xadd(volatile uint32_t *addr, uint32_t val) __attribute__((always_inline));
+static __inline uint32_t cmpxchg(volatile uint32_t *addr, uint32_t old, uint32_t newval) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+
+// CPUID.01H:EDX feature flags
+#define CPUID_FEAT_PSE		(1 << 3)	// 4MB pages
+#define CPUID_FEAT_SEP		(1 << 11)	// SYSENTER and SYSEXIT
+#define CPUID_FEAT_PGE		(1 << 13)	// Global pages
+
+// Model specific registers
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
 
 static __inline void
 breakpoint(void)
@@ -283,6 +297,20 @@ read_tsc(void)
 	return tsc;
 }
 
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -296,4 +324,29 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add val to *addr, returns the old value
+static __inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t val)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (val), "+m" (*addr) :
+			:
+			"memory", "cc");
+	return val;
+}
+
+// Atomically set *addr to newval if it equals old, returns the value
+// found at *addr
+static __inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t old, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (old) :
+			"memory", "cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
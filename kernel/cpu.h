@@ -4,6 +4,7 @@
 #include <inc/types.h>
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
+#include <inc/x86.h>
 #include <kernel/task.h>
 
 // Maximum number of CPUs
@@ -24,6 +25,18 @@ struct CpuInfo {
 	// Runqueue cpu_rq;        // cpu runqueue
 	struct tss_struct cpu_tss;        // Used by x86 to find stack for interrupt
 	struct Trapframe *last_tf;
+	struct Context *cpu_context;    // Context of the per-CPU boot stack
+	struct CpuInfo *cpu_self;       // Points to itself, read through %gs
+	pde_t *cpu_pgdir;               // Loaded page directory, for TLB shootdown
+	uint64_t cpu_idle;              // TSC cycles spent in the idle loop
+	uint64_t cpu_idle_ts;           // When it last entered the idle loop
+	uint64_t cpu_min_vruntime;      // Where woken tasks start, see sched.c
+	volatile int cpu_resched;       // A task woken here may preempt
+	// sysenter loads %esp with &cpu_sysenter_esp0, a copy of
+	// cpu_tss.ts_esp0.  An NMI that hits before sysenter_entry
+	// switched stacks runs on cpu_nmi_stack below it.
+	uint32_t cpu_nmi_stack[256];
+	uintptr_t cpu_sysenter_esp0;
 };
 
 // Initialized in mpconfig.c
@@ -35,13 +48,46 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// The GD_PERCPU segment loaded in %gs by gdt_init_percpu() is based at
+// this CPU's struct CpuInfo, so finding it is a single load instead
+// of reading the local APIC ID.  volatile, since a task may resume on
+// another CPU after a context switch.
+static inline struct CpuInfo *
+mycpu(void)
+{
+	struct CpuInfo *c;
+	asm volatile("movl %%gs:%c1, %0"
+		: "=r" (c) : "i" (offsetof(struct CpuInfo, cpu_self)));
+	return c;
+}
+
+static inline int
+cpunum(void)
+{
+	uint8_t id;
+	asm volatile("movb %%gs:%c1, %0"
+		: "=q" (id) : "i" (offsetof(struct CpuInfo, cpu_id)));
+	return id;
+}
+
+#define thiscpu (mycpu())
+
+// Switch this CPU to pgdir, recorded so tlb_shootdown() knows which
+// CPUs may cache its translations.
+static inline void
+cpu_load_pgdir(pde_t *pgdir)
+{
+	thiscpu->cpu_pgdir = pgdir;
+	lcr3(PADDR(pgdir));
+}
 
 void mp_init(void);
 void lapic_init(void);
+int lapic_id(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_pcint_nmi(void);
 
 #endif
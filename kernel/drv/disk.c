@@ -5,6 +5,7 @@
 #include "disk.h"
 #include <inc/x86.h>
 #include <inc/mmu.h>
+#include <kernel/trace.h>
 
 #define FALSE 0
 #define TRUE 1
@@ -94,7 +95,9 @@ int ide_read_sectors(unsigned char drive, unsigned char numsects, unsigned int l
 		unsigned char err;
 		if (ide_devices[drive].Type == IDE_ATA)
 		{
+			trace(EV_DISK_ISSUE, lba, numsects);
 			err = ide_ata_access(ATA_READ, drive, lba, numsects, GD_KD, edi);
+			trace(EV_DISK_DONE, lba, err);
 		}
 		else if (ide_devices[drive].Type == IDE_ATAPI)
 			panic("ATAPI not supported!");
@@ -122,7 +125,12 @@ int ide_write_sectors(unsigned char drive, unsigned char numsects, unsigned int
 	else {
 		unsigned char err;
 		if (ide_devices[drive].Type == IDE_ATA)
+		{
+			// Writes are marked in bit 8 of the sector count
+			trace(EV_DISK_ISSUE, lba, numsects | 0x100);
 			err = ide_ata_access(ATA_WRITE, drive, lba, numsects, GD_KD, edi);
+			trace(EV_DISK_DONE, lba, err);
+		}
 		else if (ide_devices[drive].Type == IDE_ATAPI)
 			err = 4; // Write-Protected.
 		ide_status = ide_print_error(drive, err);
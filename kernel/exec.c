@@ -0,0 +1,312 @@
+/*
+ * exec(): replace the image of the calling task by an ELF program from
+ * the file system.  The PT_LOAD segments are not read here, they become
+ * VMA_FILE regions of the page cache and are faulted in a page at a
+ * time (see vm_fault()), so starting a program costs the pages it
+ * touches, not its size.
+ *
+ * spawn() loads a program the same way into a new task.
+ */
+#include <inc/elf.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/pcache.h>
+#include <kernel/vm.h>
+
+#define EXEC_MAXARG	32
+#define EXEC_PATH_MAX	64
+
+/*
+ * Check the header and the loadable segments, all in the first page
+ * of the file.  A segment needs two regions, one for the file and one
+ * for the zeroed rest, so segments may not share a page.
+ */
+static int
+exec_check(struct Elf *elf, uint32_t size)
+{
+	struct Proghdr *ph, *q;
+	int i, j, nload = 0;
+
+	if (size < sizeof(*elf) || elf->e_magic != ELF_MAGIC)
+		return -STATUS_ENOEXEC;
+	if (elf->e_phoff > PGSIZE ||
+	    elf->e_phnum > (PGSIZE - elf->e_phoff) / sizeof(*ph) ||
+	    elf->e_phoff + elf->e_phnum * sizeof(*ph) > size)
+		return -STATUS_ENOEXEC;
+	ph = (struct Proghdr *)((uint8_t *)elf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++) {
+		if (ph[i].p_type != ELF_PROG_LOAD || ph[i].p_memsz == 0)
+			continue;
+		if (ph[i].p_filesz > ph[i].p_memsz ||
+		    ph[i].p_va % PGSIZE != ph[i].p_offset % PGSIZE ||
+		    ph[i].p_offset + ph[i].p_filesz < ph[i].p_offset ||
+		    ph[i].p_offset + ph[i].p_filesz > size ||
+		    ph[i].p_va < PGSIZE ||
+		    ph[i].p_va + ph[i].p_memsz < ph[i].p_va ||
+		    ph[i].p_va + ph[i].p_memsz > USTACKTOP - USR_STACK_SIZE)
+			return -STATUS_ENOEXEC;
+		for (j = 0; j < i; j++) {
+			q = &ph[j];
+			if (q->p_type == ELF_PROG_LOAD && q->p_memsz &&
+			    ROUNDDOWN(ph[i].p_va, PGSIZE) < ROUNDUP(q->p_va + q->p_memsz, PGSIZE) &&
+			    ROUNDDOWN(q->p_va, PGSIZE) < ROUNDUP(ph[i].p_va + ph[i].p_memsz, PGSIZE))
+				return -STATUS_ENOEXEC;
+		}
+		nload++;
+	}
+	// And one for the stack
+	if (nload == 0 || 2 * nload > NVMA - 1)
+		return -STATUS_ENOEXEC;
+	return 0;
+}
+
+static int
+exec_map(struct mm *mm, struct Proghdr *ph, struct pc_file *f)
+{
+	uintptr_t va = ROUNDDOWN(ph->p_va, PGSIZE);
+	uintptr_t fend = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+	uintptr_t end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+	int perm = PTE_U | (ph->p_flags & ELF_PROG_FLAG_WRITE ? PTE_W : 0);
+	int err;
+
+	if (ph->p_filesz) {
+		err = vm_map(mm, va, fend - va, VMA_FILE, perm, f,
+			     ROUNDDOWN(ph->p_offset, PGSIZE),
+			     ph->p_va + ph->p_filesz - va);
+		if (err < 0)
+			return err;
+		va = fend;
+	}
+	if (va < end)
+		return vm_map(mm, va, end - va, VMA_ANON, perm, NULL, 0, 0);
+	return 0;
+}
+
+/*
+ * Push the argument strings, argv[], argc and a return address onto
+ * the new user stack of mm, as if _start(argc, argv) was called.  The
+ * stack pointer goes to *spp.
+ */
+static int
+exec_push_args(struct mm *mm, char **args, int argc, uintptr_t *spp)
+{
+	char *uargs[EXEC_MAXARG + 1];
+	uint32_t frame[3];
+	uintptr_t sp = USTACKTOP;
+	int i, n, err;
+
+	for (i = argc - 1; i >= 0; i--) {
+		n = strlen(args[i]) + 1;
+		sp -= n;
+		if ((err = vm_copyout(mm, sp, args[i], n)) < 0)
+			return err;
+		uargs[i] = (char *)sp;
+	}
+	uargs[argc] = NULL;
+	sp = ROUNDDOWN(sp, 4) - (argc + 1) * sizeof(char *);
+	if ((err = vm_copyout(mm, sp, uargs, (argc + 1) * sizeof(char *))) < 0)
+		return err;
+	frame[0] = 0;
+	frame[1] = argc;
+	frame[2] = sp;
+	sp -= sizeof(frame);
+	if ((err = vm_copyout(mm, sp, frame, sizeof(frame))) < 0)
+		return err;
+	*spp = sp;
+	return 0;
+}
+
+/*
+ * Copy the path and the NULL terminated arguments argv of the caller
+ * into the page buf, their pointers into args.  Returns argc.
+ */
+static int
+exec_copyin(const char *path, char *const argv[], char *buf, char **args)
+{
+	char *arg;
+	int argc, len, err;
+
+	if ((err = vm_copyin_str(buf, path, EXEC_PATH_MAX)) < 0)
+		return err;
+	len = err + 1;
+	for (argc = 0; argv; argc++) {
+		if ((err = vm_prefault(&argv[argc], sizeof(argv[0]), false)) < 0)
+			return err;
+		if ((err = copyin(&arg, &argv[argc], sizeof(arg))) < 0)
+			return err;
+		if (arg == NULL)
+			break;
+		if (argc == EXEC_MAXARG)
+			return -STATUS_EINVAL;
+		if ((err = vm_copyin_str(buf + len, arg, PGSIZE - len)) < 0)
+			return err;
+		args[argc] = buf + len;
+		len += err + 1;
+	}
+	return argc;
+}
+
+// Open the program at path, with its checked headers in *hpp
+static int
+exec_open(const char *path, struct pc_file **fp, struct PageInfo **hpp)
+{
+	int err;
+
+	if ((err = pcache_open(path, fp)) < 0)
+		return err;
+	spin_lock(&vm_lock);
+	err = pcache_get(*fp, 0, hpp);
+	spin_unlock(&vm_lock);
+	if (err >= 0 && (err = exec_check(page2kva(*hpp), (*fp)->size)) < 0) {
+		spin_lock(&vm_lock);
+		page_decref(*hpp);
+		spin_unlock(&vm_lock);
+	}
+	if (err < 0)
+		pcache_close(*fp);
+	return err < 0 ? err : 0;
+}
+
+static void
+exec_close(struct pc_file *f, struct PageInfo *hp)
+{
+	spin_lock(&vm_lock);
+	page_decref(hp);
+	spin_unlock(&vm_lock);
+	pcache_close(f);
+}
+
+/*
+ * Map the program f with the headers elf into ts, which has no user
+ * memory, and point its registers at the entry with the arguments on
+ * the stack.  Only the pages of the arguments are touched.
+ */
+static int
+exec_load(struct Task *ts, struct Elf *elf, struct pc_file *f,
+	  char **args, int argc)
+{
+	struct Trapframe *tf = ts->tf;
+	struct Proghdr *ph;
+	uintptr_t sp;
+	int i, err = 0;
+
+	ph = (struct Proghdr *)((uint8_t *)elf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum && err == 0; i++)
+		if (ph[i].p_type == ELF_PROG_LOAD && ph[i].p_memsz)
+			err = exec_map(ts->mm, &ph[i], f);
+	if (err == 0)
+		err = vm_map(ts->mm, USTACKTOP - USR_STACK_SIZE, USR_STACK_SIZE,
+			     VMA_ANON, PTE_U | PTE_W, NULL, 0, 0);
+	if (err == 0)
+		err = vm_map(ts->mm, UTLS, PGSIZE, VMA_ANON, PTE_U | PTE_W,
+			     NULL, 0, 0);
+	if (err == 0)
+		err = exec_push_args(ts->mm, args, argc, &sp);
+	if (err < 0)
+		return err;
+	memset(&tf->tf_regs, 0, sizeof(tf->tf_regs));
+	ts->tls = UTLS;
+	tf->tf_eip = elf->e_entry;
+	tf->tf_esp = sp;
+	tf->tf_eflags = FL_IF;
+	return 0;
+}
+
+/*
+ * Load the program at path with the NULL terminated arguments argv.
+ * Returns an error if the file can not be used, once the old image is
+ * gone a failure kills the task.  The memory of a task shared with
+ * other threads or a vfork() parent stays theirs, it gets its own.
+ */
+int
+sys_exec(const char *path, char *const argv[])
+{
+	struct Task *cur = thiscpu->cpu_task;
+	struct PageInfo *scratch, *hp;
+	struct pc_file *f;
+	struct mm *mm = NULL, *old;
+	char *buf, *args[EXEC_MAXARG];
+	int argc, err;
+	bool gone = false;
+
+	// The path and the arguments live in the image about to go
+	if ((scratch = page_alloc(0)) == NULL)
+		return -STATUS_ENOMEM;
+	buf = page2kva(scratch);
+	if ((err = argc = exec_copyin(path, argv, buf, args)) < 0)
+		goto out;
+	if ((err = exec_open(buf, &f, &hp)) < 0)
+		goto out;
+	// Only we can add users to it if there are none
+	if (cur->mm->ref > 1 && (mm = mm_alloc()) == NULL) {
+		exec_close(f, hp);
+		err = -STATUS_ENOMEM;
+		goto out;
+	}
+
+	// No way back from here
+	if (mm) {
+		old = cur->mm;
+		spin_lock(&tasks_lock);
+		cur->mm = mm;
+		cpu_load_pgdir(mm->pgdir);
+		if (cur->vfork)
+			vfork_release(cur);
+		spin_unlock(&tasks_lock);
+		mm_put(old);
+	} else
+		vm_free(cur->mm);
+	gone = true;
+	err = exec_load(cur, page2kva(hp), f, args, argc);
+	exec_close(f, hp);
+	if (err == 0)
+		task_load_tls(cur);
+out:
+	if (err < 0 && gone)
+		cprintf("exec %s: error %d, killed\n", buf, err);
+	page_free(scratch);
+	if (err < 0 && gone)
+		sys_kill(0);
+	return err;
+}
+
+/*
+ * Start the program at path with the arguments argv in a new task,
+ * without copying or sharing anything of the caller: fork() and exec()
+ * in one step, for the price of the page tables of the arguments.
+ * Returns the pid of the child.
+ */
+int
+sys_spawn(const char *path, char *const argv[])
+{
+	struct PageInfo *scratch, *hp;
+	struct pc_file *f;
+	char *buf, *args[EXEC_MAXARG];
+	int argc, pid, err;
+
+	if ((scratch = page_alloc(0)) == NULL)
+		return -STATUS_ENOMEM;
+	buf = page2kva(scratch);
+	if ((err = argc = exec_copyin(path, argv, buf, args)) < 0)
+		goto out;
+	if ((err = exec_open(buf, &f, &hp)) < 0)
+		goto out;
+
+	if ((pid = task_alloc()) < 0)
+		err = -STATUS_EAGIAN;
+	else if ((err = exec_load(&tasks[pid], page2kva(hp), f, args, argc)) < 0) {
+		spin_lock(&tasks_lock);
+		task_free(pid);
+		spin_unlock(&tasks_lock);
+	} else {
+		task_start(&tasks[pid]);
+		err = pid;
+	}
+	exec_close(f, hp);
+out:
+	page_free(scratch);
+	return err;
+}
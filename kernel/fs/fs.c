@@ -4,15 +4,19 @@
 #include "fat/ff.h"
 #include <inc/string.h>
 #include <inc/stdio.h>
+#include <kernel/spinlock.h>
+#include <kernel/task.h>
+#include <kernel/pipe.h>
 
 /* Static file objects */
-FIL file_objs[FS_FD_MAX];
+FIL file_objs[FS_FD_MAX + FS_KFD_MAX];
 
 /* Static file system object */
 FATFS fat;
 
-/* It file object table */
-struct fs_fd fd_table[FS_FD_MAX];
+/* It file object table, the user descriptors first.  The last
+ * FS_KFD_MAX ones are the kernel's, fd_get() does not know them. */
+struct fs_fd fd_table[FS_FD_MAX + FS_KFD_MAX];
 
 /* File system operator, define in fs_ops.c */
 extern struct fs_ops elmfat_ops; //We use only one file system...
@@ -24,6 +28,39 @@ struct fs_dev fat_fs = {
     .ops = &elmfat_ops,
     .data = &fat
 };
+
+/* Mount table, every path lookup reads it so it is protected by a
+ * reader-writer lock; only fs_mount() writes. */
+static struct fs_dev *mount_table[FS_MOUNT_MAX];
+static struct rwlock mount_lock;
+
+/* The FAT module is not reentrant, every file operation holds fs_lock.
+ * The disk driver polls for milliseconds, so the others sleep instead
+ * of spinning: fs_busy is the lock, fs_lock protects it and fs_wait.
+ * It must not be taken with a spinlock held, buffers are kernel memory
+ * (see file_rw_user() of sys_read()).  The reference counts of the fd
+ * table are under fd_lock, which is taken last. */
+static struct spinlock fs_lock;
+static bool fs_busy;
+static struct wait_queue fs_wait;
+static struct spinlock fd_lock;
+
+static void fs_acquire(void)
+{
+	spin_lock(&fs_lock);
+	while (fs_busy)
+		wq_sleep(&fs_wait, &fs_lock);
+	fs_busy = true;
+	spin_unlock(&fs_lock);
+}
+
+static void fs_release(void)
+{
+	spin_lock(&fs_lock);
+	fs_busy = false;
+	wq_wake_one(&fs_wait);
+	spin_unlock(&fs_lock);
+}
     
 /*TODO: Lab7, VFS level file API.
  *  This is a virtualize layer. Please use the function pointer
@@ -61,9 +98,14 @@ struct fs_dev fat_fs = {
 int fs_init()
 {
     int res, i;
+
+    rw_initlock(&mount_lock);
+    spin_initlock(&fs_lock);
+    wq_init(&fs_wait);
+    spin_initlock(&fd_lock);
     
     /* Initial fd_tables */
-    for (i = 0; i < FS_FD_MAX; i++)
+    for (i = 0; i < FS_FD_MAX + FS_KFD_MAX; i++)
     {
         fd_table[i].flags = 0;
         fd_table[i].size = 0;
@@ -94,66 +136,173 @@ int fs_init()
 */
 int fs_mount(const char* device_name, const char* path, const void* data)
 {
-    if (strcmp(fat_fs.ops->dev_name, device_name) == 0) {
-        if (fat_fs.ops->mount == 0)
-            return -STATUS_ENOSYS;
-        return fat_fs.ops->mount(&fat_fs, NULL);
-    }
-    else
+    int res, i, slot = -1;
+
+    if (strcmp(fat_fs.ops->dev_name, device_name) != 0)
         return -STATUS_EIO;
+    if (fat_fs.ops->mount == 0)
+        return -STATUS_ENOSYS;
+
+    write_lock(&mount_lock);
+    for (i = 0; i < FS_MOUNT_MAX; i++) {
+        if (mount_table[i] == &fat_fs) {
+            /* Remount */
+            slot = i;
+            break;
+        }
+        if (mount_table[i] == NULL && slot < 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        write_unlock(&mount_lock);
+        return -STATUS_ENOSPC;
+    }
+    strlcpy(fat_fs.path, path, sizeof(fat_fs.path));
+    res = fat_fs.ops->mount(&fat_fs, NULL);
+    mount_table[slot] = (res == 0) ? &fat_fs : NULL;
+    write_unlock(&mount_lock);
+    return res;
 } 
 
+/* Find the file system mounted at the longest prefix of path.
+ * Relative paths are below the root "/".
+ */
+struct fs_dev *fs_lookup(const char *path)
+{
+    struct fs_dev *fs = NULL;
+    size_t len, best = 0;
+    int i;
+
+    read_lock(&mount_lock);
+    for (i = 0; i < FS_MOUNT_MAX; i++) {
+        if (mount_table[i] == NULL)
+            continue;
+        len = strlen(mount_table[i]->path);
+        if (strcmp(mount_table[i]->path, "/") == 0) {
+            /* Matches everything, with the lowest priority */
+            if (fs == NULL)
+                fs = mount_table[i];
+            continue;
+        }
+        if (len > best && strncmp(path, mount_table[i]->path, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/')) {
+            fs = mount_table[i];
+            best = len;
+        }
+    }
+    read_unlock(&mount_lock);
+    return fs;
+}
+
 /* Note: Before call ops->open() you may copy the path and flags parameters into fd object structure */
 int file_open(struct fs_fd* fd, const char *path, int flags)
 {
+    int ret;
+
+    if ((fd->fs = fs_lookup(path)) == NULL)
+        return -STATUS_ENODEV;
     strcpy(fd->path, path);
     fd->flags = flags;
     if (fd->fs->ops->open == 0)
         return -STATUS_ENOSYS;
-    return fd->fs->ops->open(fd);
+    fs_acquire();
+    ret = fd->fs->ops->open(fd);
+    fs_release();
+    return ret;
 }
 
 int file_read(struct fs_fd* fd, void *buf, size_t len)
 {
+    int ret;
+
     if (fd->fs->ops->read == 0)
         return 0; // Not read
-    return fd->fs->ops->read(fd, buf, len);
+    fs_acquire();
+    ret = fd->fs->ops->read(fd, buf, len);
+    fs_release();
+    return ret;
+}
+
+/* Read at off without moving the position seen by anyone else */
+int file_pread(struct fs_fd* fd, void *buf, size_t len, off_t off)
+{
+    int ret;
+
+    if (fd->fs->ops->read == 0 || fd->fs->ops->lseek == 0)
+        return -STATUS_ENOSYS;
+    fs_acquire();
+    ret = fd->fs->ops->lseek(fd, off);
+    if (ret == 0)
+        ret = fd->fs->ops->read(fd, buf, len);
+    fs_release();
+    return ret;
 }
 
 int file_write(struct fs_fd* fd, const void *buf, size_t len)
 {
+    int ret;
+
     if (fd->fs->ops->write == 0)
         return 0; // Not write
-    return fd->fs->ops->write(fd, buf, len);
+    fs_acquire();
+    ret = fd->fs->ops->write(fd, buf, len);
+    fs_release();
+    return ret;
 }
 
 int file_close(struct fs_fd* fd)
 {
+    int ret;
+
     if (fd->fs->ops->close == 0)
         return -STATUS_ENOSYS;
-    return fd->fs->ops->close(fd);
+    fs_acquire();
+    ret = fd->fs->ops->close(fd);
+    fs_release();
+    return ret;
 }
 
 int file_lseek(struct fs_fd* fd, off_t offset)
 {
+    int ret;
+
     if (fd->fs->ops->lseek == 0)
         return -STATUS_ENOSYS;
-    return fd->fs->ops->lseek(fd, offset);
+    fs_acquire();
+    ret = fd->fs->ops->lseek(fd, offset);
+    fs_release();
+    return ret;
 }
 
 int file_unlink(const char *path)
 {
-    if (fat_fs.ops->unlink == 0)
+    struct fs_dev *fs = fs_lookup(path);
+    int ret;
+
+    if (fs == NULL)
+        return -STATUS_ENODEV;
+    if (fs->ops->unlink == 0)
         return -STATUS_ENOSYS;
-    return fat_fs.ops->unlink(NULL, path);
+    fs_acquire();
+    ret = fs->ops->unlink(NULL, path);
+    fs_release();
+    return ret;
 }
 
 int file_readdir(const char *path)
 {
-    if (fat_fs.ops->readdir == 0)
+    struct fs_dev *fs = fs_lookup(path);
+    int ret;
+
+    if (fs == NULL)
+        return -STATUS_ENODEV;
+    if (fs->ops->readdir == 0)
         return -STATUS_ENOSYS;
     // Current directory always is root '/'
-    return fat_fs.ops->readdir(NULL, path);
+    fs_acquire();
+    ret = fs->ops->readdir(NULL, path);
+    fs_release();
+    return ret;
 }
 
 
@@ -168,6 +317,7 @@ int fd_new(void)
 	struct fs_fd* d;
 	int idx;
 
+	spin_lock(&fd_lock);
 	/* find an empty fd entry */
 	for (idx = 0; idx < FS_FD_MAX && fd_table[idx].ref_count > 0; idx++);
 
@@ -183,9 +333,27 @@ int fd_new(void)
 	d->ref_count = 1;
 
 __result:
+	spin_unlock(&fd_lock);
 	return idx;
 }
 
+/* A descriptor with one reference for a file the kernel keeps open,
+ * e.g. in the page cache.  User code can not name it, so it can not
+ * close it under the kernel.  NULL if there is none free. */
+struct fs_fd* fd_new_kernel(void)
+{
+	struct fs_fd* d, *end = fd_table + FS_FD_MAX + FS_KFD_MAX;
+
+	spin_lock(&fd_lock);
+	for (d = fd_table + FS_FD_MAX; d < end; d++)
+		if (d->ref_count == 0) {
+			d->ref_count = 1;
+			break;
+		}
+	spin_unlock(&fd_lock);
+	return d < end ? d : NULL;
+}
+
 /**
  * @ingroup Fd
  *
@@ -199,16 +367,26 @@ struct fs_fd* fd_get(int fd)
 {
 	struct fs_fd* d;
 
-	if ( fd < 0 || fd > FS_FD_MAX ) return NULL;
+	if ( fd < 0 || fd >= FS_FD_MAX ) return NULL;
 
 	d = &fd_table[fd];
 
 	/* increase the reference count */
+	spin_lock(&fd_lock);
 	d->ref_count ++;
+	spin_unlock(&fd_lock);
 
 	return d;
 }
 
+/* Another reference to fd, e.g. of a task using it as standard input or output */
+void fd_dup(struct fs_fd* fd)
+{
+	spin_lock(&fd_lock);
+	fd->ref_count ++;
+	spin_unlock(&fd_lock);
+}
+
 /**
  * @ingroup Fd
  *
@@ -216,7 +394,10 @@ struct fs_fd* fd_get(int fd)
  */
 void fd_put(struct fs_fd* fd)
 {
+	struct pipe *pipe = NULL;
+	bool write = false;
 
+	spin_lock(&fd_lock);
 	fd->ref_count --;
 
 	/* clear this fd entry */
@@ -224,5 +405,15 @@ void fd_put(struct fs_fd* fd)
 	{
 		//memset(fd, 0, sizeof(struct fs_fd));
 		memset(fd->data, 0, sizeof(FIL));
+		if (fd->type == FD_PIPE) {
+			pipe = fd->pipe;
+			write = fd->flags & O_WRONLY;
+			fd->type = FD_FILE;
+			fd->pipe = NULL;
+		}
 	}
+	spin_unlock(&fd_lock);
+	/* Wakes up the other end, which takes tasks_lock */
+	if (pipe)
+		pipe_close(pipe, write);
 };
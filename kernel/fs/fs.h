@@ -3,6 +3,14 @@
 #include <inc/types.h>
 
 #define FS_FD_MAX 10
+#define FS_KFD_MAX 8		/* Descriptors of the kernel, see fd_new_kernel() */
+#define FS_MOUNT_MAX 4
+
+/* fs_fd types */
+#define FD_FILE 0
+#define FD_PIPE 1			/* An end of a pipe, see kernel/pipe.c */
+
+struct pipe;
 
 /* Mounted file system */
 struct fs_dev
@@ -29,6 +37,7 @@ struct fs_fd
     off_t  	pos;			/* Current file position */
 
     void *data;					/* Specific file system data */
+    struct pipe *pipe;			/* FD_PIPE, flags tell the end */
 };
 
 /* It's low level disk operators */
@@ -61,10 +70,12 @@ struct fs_ops
 
 int fs_init();
 int fs_mount(const char* device_name, const char* path, const void* data);
+struct fs_dev *fs_lookup(const char *path);
 
 int file_open(struct fs_fd* fd, const char *path, int flags);
 int file_close(struct fs_fd* fd);
 int file_read(struct fs_fd* fd, void *buf, size_t len);
+int file_pread(struct fs_fd* fd, void *buf, size_t len, off_t off);
 int file_write(struct fs_fd* fd, const void *buf, size_t len);
 
 int file_lseek(struct fs_fd* fd, off_t offset);
@@ -72,7 +83,9 @@ int file_unlink(const char *path);
 int file_readdir(const char *path);
 
 struct fs_fd* fd_get(int fd);
+void fd_dup(struct fs_fd* fd);
 void fd_put(struct fs_fd* fd);
 int fd_new(void);
+struct fs_fd* fd_new_kernel(void);
 
 #endif
@@ -4,6 +4,11 @@
 // It's handel the file system APIs 
 #include <inc/stdio.h>
 #include <inc/syscall.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/pcache.h>
+#include <kernel/pipe.h>
+#include <kernel/vm.h>
 #include "fs.h"
 
 /*TODO: Lab7, file I/O system call interface.*/
@@ -45,16 +50,86 @@
  *        └──────────────┘
  */
 
+/* The FAT module never touches user memory: a page of a mapped file
+ * would be read through it again under fs_lock, and another thread may
+ * unmap the buffer.  Paths are copied into the kernel, file data goes
+ * through a kernel page with copyin() and copyout(). */
+
+/* Descriptor fd with a reference, STDIN_FILENO and STDOUT_FILENO are the
+ * ones the task was given with dup2().  NULL for the console. */
+static struct fs_fd *fd_lookup(int fd)
+{
+	struct fs_fd *p;
+
+	if (fd == STDIN_FILENO || fd == STDOUT_FILENO) {
+		p = thiscpu->cpu_task->stdio[fd - STDIN_FILENO];
+		if (p)
+			fd_dup(p);
+		return p;
+	}
+	return fd_get(fd);
+}
+
+/* The pipe of p if it is the end for writing (or reading) */
+static struct pipe *fd_pipe(struct fs_fd *p, bool write)
+{
+	if (p->type != FD_PIPE || !(p->flags & O_WRONLY) != !write)
+		return NULL;
+	return p->pipe;
+}
+
+/* file_read() or file_write() of up to len bytes at user buf, a page
+ * at a time.  Returns the bytes moved if any, else the error. */
+static int file_rw_user(struct fs_fd *p, void *buf, size_t len, bool write)
+{
+	struct PageInfo *pp;
+	char *kva;
+	size_t done = 0, n;
+	int ret = 0, err;
+
+	if ((pp = page_alloc(0)) == NULL)
+		return -STATUS_ENOMEM;
+	pp->pp_ref++;
+	kva = page2kva(pp);
+	while (done < len) {
+		n = MIN(len - done, PGSIZE);
+		if (write) {
+			if ((ret = copyin(kva, (char *)buf + done, n)) < 0)
+				break;
+			ret = file_write(p, kva, n);
+		} else if ((ret = file_read(p, kva, n)) > 0 &&
+			   (err = copyout((char *)buf + done, kva, ret)) < 0) {
+			ret = err;
+			break;
+		}
+		if (ret <= 0)
+			break;
+		done += ret;
+		if (ret < n)
+			break;
+	}
+	page_decref(pp);
+	return done ? done : ret;
+}
+
 // Below is POSIX like I/O system call 
 int sys_open(const char *file, int flags, int mode)
 {
+	char path[64];
+	int err = vm_copyin_str(path, file, sizeof(path));
+	if (err < 0)
+		return err;
+	// The page cache must not keep the old contents
+	if (flags & (O_WRONLY | O_RDWR | O_TRUNC))
+		pcache_invalidate(path);
+
 	//We dont care the mode.
 	int fd = fd_new();
 	if (fd == -1)
 		return -STATUS_ENOSPC;
 
 	struct fs_fd *p = fd_get(fd);
-	int err = file_open(p, file, flags);
+	err = file_open(p, path, flags);
 
 	fd_put(p);
 	if (err < 0) {
@@ -69,7 +144,8 @@ int sys_close(int fd)
 	struct fs_fd *p = fd_get(fd);
 	if (!p)
 		return -STATUS_EINVAL;
-	int err = file_close(p);
+	// The last reference closes the pipe end, see fd_put()
+	int err = p->type == FD_PIPE ? 0 : file_close(p);
 
 	fd_put(p);
 	if (err < 0)
@@ -80,26 +156,64 @@ int sys_close(int fd)
 
 int sys_read(int fd, void *buf, size_t len)
 {
-	struct fs_fd *p = fd_get(fd);
+	struct fs_fd *p = fd_lookup(fd);
 	if (!p)
 		return -STATUS_EBADF;
-	if (!buf || len <= 0)
+	if (!buf || len == 0) {
+		fd_put(p);
 		return -STATUS_EINVAL;
-	if (len > p->size)
+	}
+	if (p->type == FD_FILE && len > p->size)
 		len = p->size;
-	int ret = file_read(p, buf, len);
+	int ret = vm_prefault(buf, len, true);
+	if (ret < 0) {
+		fd_put(p);
+		return ret;
+	}
+	if (p->type == FD_PIPE)
+		ret = fd_pipe(p, false) ? pipe_read(p->pipe, buf, len) : -STATUS_EBADF;
+	else
+		ret = file_rw_user(p, buf, len, false);
 	fd_put(p);
 	return ret;
 }
 
 int sys_write(int fd, const void *buf, size_t len)
 {
-	struct fs_fd *p = fd_get(fd);
+	struct fs_fd *p = fd_lookup(fd);
+	int ret;
+
+	if (!p && fd == STDOUT_FILENO) {
+		char kbuf[128];
+		size_t done, n;
+
+		if ((ret = vm_prefault(buf, len, false)) < 0)
+			return ret;
+		for (done = 0; done < len; done += n) {
+			n = MIN(len - done, sizeof(kbuf));
+			if ((ret = copyin(kbuf, (const char *)buf + done, n)) < 0)
+				return done ? done : ret;
+			cprintf("%.*s", n, kbuf);
+		}
+		return len;
+	}
 	if (!p)
 		return -STATUS_EBADF;
-        if (!buf || len <= 0)
-                return -STATUS_EINVAL;
-	int ret = file_write(p, buf, len);
+	if (!buf || len == 0) {
+		fd_put(p);
+		return -STATUS_EINVAL;
+	}
+	ret = vm_prefault(buf, len, false);
+	if (ret < 0) {
+		fd_put(p);
+		return ret;
+	}
+	if (p->type == FD_PIPE)
+		ret = fd_pipe(p, true) ? pipe_write(p->pipe, buf, len) : -STATUS_EBADF;
+	else {
+		pcache_invalidate(p->path);
+		ret = file_rw_user(p, (void *)buf, len, true);
+	}
 	fd_put(p);
 	return ret;
 }
@@ -110,12 +224,18 @@ off_t sys_lseek(int fd, off_t offset, int whence)
 	struct fs_fd *p = fd_get(fd);
 	if (!p)
 		return -STATUS_EBADF;
+	if (p->type == FD_PIPE) {
+		fd_put(p);
+		return -STATUS_EINVAL;
+	}
 	if (whence == SEEK_END)
 		offset += p->size;
 	else if (whence == SEEK_CUR)
 		offset += p->pos;
-	else if (whence != SEEK_SET)
+	else if (whence != SEEK_SET) {
+		fd_put(p);
 		return -STATUS_EINVAL;
+	}
 	int err = file_lseek(p, offset);
 	fd_put(p);
 	if (err < 0)
@@ -126,10 +246,122 @@ off_t sys_lseek(int fd, off_t offset, int whence)
 
 int sys_unlink(const char *pathname)
 {
-	return file_unlink(pathname);
+	char path[64];
+	int err = vm_copyin_str(path, pathname, sizeof(path));
+	if (err < 0)
+		return err;
+	pcache_invalidate(path);
+	return file_unlink(path);
 }
 
 int sys_readdir(const char *pathname)
 {
-	return file_readdir(pathname);
+	char path[64];
+	int err = vm_copyin_str(path, pathname, sizeof(path));
+	if (err < 0)
+		return err;
+	return file_readdir(path);
+}
+
+/* A new pipe, the descriptor to read it in fds[0], to write it in fds[1] */
+int sys_pipe(int *fds)
+{
+	struct fs_fd *r, *w;
+	struct pipe *pipe;
+	int rfd, wfd, err;
+
+	if ((err = vm_prefault(fds, 2 * sizeof(int), true)) < 0)
+		return err;
+	if ((pipe = pipe_alloc()) == NULL)
+		return -STATUS_ENOSPC;
+	if ((rfd = fd_new()) < 0) {
+		pipe_close(pipe, false);
+		pipe_close(pipe, true);
+		return -STATUS_ENOSPC;
+	}
+	r = fd_get(rfd);
+	r->type = FD_PIPE;
+	r->pipe = pipe;
+	r->flags = O_RDONLY;
+	r->path[0] = '\0';
+	r->size = r->pos = 0;
+	fd_put(r);
+	if ((wfd = fd_new()) < 0) {
+		// Closes the read end, and the pipe with the write end
+		fd_put(r);
+		pipe_close(pipe, true);
+		return -STATUS_ENOSPC;
+	}
+	w = fd_get(wfd);
+	w->type = FD_PIPE;
+	w->pipe = pipe;
+	w->flags = O_WRONLY;
+	w->path[0] = '\0';
+	w->size = w->pos = 0;
+	fd_put(w);
+	int kfds[2] = { rfd, wfd };
+	if ((err = copyout(fds, kfds, sizeof(kfds))) < 0) {
+		fd_put(r);
+		fd_put(w);
+	}
+	return err;
+}
+
+/* Make fd the standard input or output std of the caller, which the
+ * children it creates inherit.  fd -1 is the console. */
+int sys_dup2(int fd, int std)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	struct fs_fd *p = NULL, *old;
+
+	if (std != STDIN_FILENO && std != STDOUT_FILENO)
+		return -STATUS_EINVAL;
+	if (fd != -1 && (p = fd_lookup(fd)) == NULL)
+		return -STATUS_EBADF;
+	old = cur->stdio[std - STDIN_FILENO];
+	cur->stdio[std - STDIN_FILENO] = p;
+	if (old)
+		fd_put(old);
+	return 0;
+}
+
+/* Move up to len bytes from a file into a pipe or from a pipe into a
+ * file, without copying them through user memory. */
+int sys_splice(int in, int out, size_t len)
+{
+	struct fs_fd *pin = fd_lookup(in), *pout = fd_lookup(out);
+	struct pipe *pipe;
+	int ret = -STATUS_EINVAL;
+
+	if (!pin || !pout)
+		ret = -STATUS_EBADF;
+	else if (pin->type == FD_FILE && (pipe = fd_pipe(pout, true)))
+		ret = pipe_splice_in(pipe, pin, len);
+	else if ((pipe = fd_pipe(pin, false)) && pout->type == FD_FILE) {
+		pcache_invalidate(pout->path);
+		ret = pipe_splice_out(pipe, pout, len);
+	}
+	if (pin)
+		fd_put(pin);
+	if (pout)
+		fd_put(pout);
+	return ret;
+}
+
+/* Write buf into the pipe fd, its whole pages are handed over copy on
+ * write instead of being copied. */
+int sys_vmsplice(int fd, const void *buf, size_t len)
+{
+	struct fs_fd *p = fd_lookup(fd);
+	struct pipe *pipe;
+	int ret;
+
+	if (!p)
+		return -STATUS_EBADF;
+	if ((pipe = fd_pipe(p, true)) == NULL)
+		ret = -STATUS_EINVAL;
+	else
+		ret = pipe_vmsplice(pipe, buf, len);
+	fd_put(p);
+	return ret;
 }
@@ -0,0 +1,153 @@
+/*
+ * Futexes: a task sleeps in the kernel while a word of its memory has
+ * a value, until somebody wakes the word.  The word is named by its
+ * physical address, so the threads of a program (see clone()) and
+ * tasks sharing memory meet on the same word, and it is hashed to one
+ * of FUTEX_HASH wait queues, each with its own lock.
+ *
+ * Uncontended locks never get here, the user side (lib/sync.c) only
+ * calls in to sleep or to wake a sleeper.
+ */
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <kernel/futex.h>
+
+#define FUTEX_HASH	16	// A power of two
+
+// The lock is taken before tasks_lock and vm_lock, so a wakeup can not
+// slip in between the test of the word and going to sleep
+struct futex_bucket {
+	struct spinlock lock;
+	struct wait_queue wq;
+};
+
+static struct futex_bucket futex_hash[FUTEX_HASH];
+
+void
+futex_init(void)
+{
+	int i;
+
+	// One entry of lockstat for all buckets
+	__spin_initlock_array(&futex_hash[0].lock, FUTEX_HASH,
+			      sizeof(futex_hash[0]), "futex");
+	for (i = 0; i < FUTEX_HASH; i++)
+		wq_init(&futex_hash[i].wq);
+}
+
+static struct futex_bucket *
+futex_bucket(physaddr_t key)
+{
+	return &futex_hash[((key >> 2) ^ (key >> PGSHIFT)) & (FUTEX_HASH - 1)];
+}
+
+/*
+ * The physical address of the word at uaddr in *keyp.  It is written
+ * to first, so its page is our own and not one shared copy-on-write,
+ * which the next write would move.
+ */
+static int
+futex_key(volatile uint32_t *uaddr, physaddr_t *keyp)
+{
+	struct mm *mm = thiscpu->cpu_task->mm;
+	pte_t *pte;
+	int err;
+
+	if ((uintptr_t)uaddr % sizeof(*uaddr))
+		return -STATUS_EINVAL;
+	if ((err = vm_prefault((void *)uaddr, sizeof(*uaddr), true)) < 0)
+		return err;
+	spin_lock(&vm_lock);
+	pte = pgdir_walk(mm->pgdir, (void *)uaddr, 0);
+	if (pte && (*pte & PTE_P))
+		*keyp = pte_pa(*pte, (void *)uaddr);
+	else
+		err = -STATUS_EFAULT;
+	spin_unlock(&vm_lock);
+	return err;
+}
+
+/*
+ * The word at uaddr, through the kernel mapping of key.  vm_lock was
+ * dropped since futex_key(), a thread of ours may have unmapped or
+ * moved the page: then it is -STATUS_EAGIAN, for the caller to retry
+ * from futex_key().  Called with the bucket lock held.
+ */
+static int
+futex_read(volatile uint32_t *uaddr, physaddr_t key, uint32_t *valp)
+{
+	struct mm *mm = thiscpu->cpu_task->mm;
+	pte_t *pte;
+	int err = 0;
+
+	spin_lock(&vm_lock);
+	pte = pgdir_walk(mm->pgdir, (void *)uaddr, 0);
+	if (pte && (*pte & PTE_P) && pte_pa(*pte, (void *)uaddr) == key)
+		*valp = *(volatile uint32_t *)KADDR(key);
+	else
+		err = -STATUS_EAGIAN;
+	spin_unlock(&vm_lock);
+	return err;
+}
+
+/*
+ * Sleep while *uaddr is val, for at most timeout ticks unless it is 0.
+ * Returns 0 when woken up, -STATUS_EAGIAN if the word did not have the
+ * value or -STATUS_ETIMEDOUT.
+ */
+int
+sys_futex_wait(volatile uint32_t *uaddr, uint32_t val, int32_t timeout)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	struct futex_bucket *b;
+	physaddr_t key;
+	uint32_t cur_val;
+	int err;
+
+	if (timeout < 0)
+		return -STATUS_EINVAL;
+	if ((err = futex_key(uaddr, &key)) < 0)
+		return err;
+	b = futex_bucket(key);
+	spin_lock(&b->lock);
+	if ((err = futex_read(uaddr, key, &cur_val)) < 0 || cur_val != val) {
+		spin_unlock(&b->lock);
+		return -STATUS_EAGIAN;
+	}
+	cur->futex_key = key;
+	err = wq_sleep_timeout(&b->wq, &b->lock, timeout);
+	spin_unlock(&b->lock);
+	return err;
+}
+
+// Wake up to n tasks waiting on the word at uaddr, returns how many
+int
+sys_futex_wake(volatile uint32_t *uaddr, int n)
+{
+	struct Task *ts, *next;
+	struct futex_bucket *b;
+	physaddr_t key;
+	int woken = 0, err;
+
+	if ((err = futex_key(uaddr, &key)) < 0)
+		return err;
+	b = futex_bucket(key);
+	spin_lock(&b->lock);
+	spin_lock(&tasks_lock);
+	for (ts = b->wq.head; ts && woken < n; ts = next) {
+		next = ts->task_link;
+		if (ts->futex_key != key)
+			continue;
+		wq_remove(ts);
+		ts->state = TASK_RUNNABLE;
+		sched_kick(ts);
+		woken++;
+	}
+	spin_unlock(&tasks_lock);
+	spin_unlock(&b->lock);
+	return woken;
+}
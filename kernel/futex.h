@@ -0,0 +1,8 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+#include <inc/types.h>
+
+void futex_init(void);
+int sys_futex_wait(volatile uint32_t *uaddr, uint32_t val, int32_t timeout);
+int sys_futex_wake(volatile uint32_t *uaddr, int n);
+#endif
@@ -5,6 +5,8 @@
 #include <inc/kbd.h>
 #include <inc/trap.h>
 #include <kernel/picirq.h>
+#include <kernel/spinlock.h>
+#include <kernel/task.h>
 #include <inc/stdio.h>
 
 /***** Keyboard input code *****/
@@ -169,6 +171,8 @@ static struct {
 	uint8_t buf[CONSBUFSIZE];
 	uint32_t rpos;
 	uint32_t wpos;
+	struct spinlock lock;
+	struct wait_queue wq;	// Tasks blocked in getc()
 } cons;
 
 // called by device interrupt routines to feed input characters
@@ -188,6 +192,7 @@ cons_intr(int (*proc)(void))
 }
 
 // return the next input character from the console, or 0 if none waiting
+// called with cons.lock held
 int
 cons_getc(void)
 {
@@ -214,7 +219,11 @@ cons_getc(void)
 void
 kbd_intr(void)
 {
+	spin_lock(&cons.lock);
 	cons_intr(kbd_proc_data);
+	if (cons.rpos != cons.wpos)
+		wq_wake_all(&cons.wq);
+	spin_unlock(&cons.lock);
 }
 
 void kbd_init(void)
@@ -222,6 +231,8 @@ void kbd_init(void)
 	// Drain the kbd buffer so that Bochs generates interrupts.
 	cons.rpos = 0;
 	cons.wpos = 0;
+	spin_initlock(&cons.lock);
+	wq_init(&cons.wq);
 
 	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_KBD));
 }
@@ -231,8 +242,10 @@ int getc(void)
 {
 	int c;
 
-	// Our task is switched to user mode, so dont block at there
-	// while ((c = cons_getc()) == 0)
-	// 	/* do nothing */;
-	return cons_getc();
+	// Sleep until kbd_intr() has something for us
+	spin_lock(&cons.lock);
+	while ((c = cons_getc()) == 0)
+		wq_sleep(&cons.wq, &cons.lock);
+	spin_unlock(&cons.lock);
+	return c;
 }
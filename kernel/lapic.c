@@ -34,6 +34,7 @@
 	#define X1         0x0000000B   // divide counts by 1
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
+	#define DM_NMI     0x00000400   // Deliver as NMI
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
 #define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
@@ -88,7 +89,8 @@ lapic_init(void)
 	lapicw(LINT1, MASKED);//why?
 
 	// Disable performance counter overflow interrupts
-	// on machines that provide that interrupt entry.
+	// on machines that provide that interrupt entry,
+	// pmu_init_percpu() enables them if it can use them.
 	if (((lapic[VER]>>16) & 0xFF) >= 4)
 		lapicw(PCINT, MASKED);
 
@@ -112,8 +114,18 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// Deliver performance counter overflows as NMI.  Delivery sets the
+// mask bit again, so the NMI handler calls this too.
+void
+lapic_pcint_nmi(void)
+{
+	if (lapic && ((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, DM_NMI);
+}
+
+// Use cpunum() once gdt_init_percpu() has run on this CPU
 int
-cpunum(void)
+lapic_id(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
@@ -174,6 +186,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send vector to the CPU with the given local APIC ID
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | ASSERT | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
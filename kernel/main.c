@@ -6,8 +6,14 @@
 #include <kernel/cpu.h>
 #include <kernel/task.h>
 #include <kernel/timer.h>
+#include <kernel/prof.h>
+#include <kernel/pmu.h>
+#include <kernel/trace.h>
 #include <kernel/trap.h>
 #include <kernel/picirq.h>
+#include <kernel/workqueue.h>
+#include <kernel/futex.h>
+#include <kernel/pipe.h>
 
 bool booted = false;
 
@@ -21,6 +27,9 @@ void kernel_main(void)
 {
 	int *ptr;
 
+	// thiscpu is needed by everything, the BSP is cpus[0]
+	gdt_init_percpu(0);
+
 	// I am not sure about initialization sequence
 	init_video();
 
@@ -29,8 +38,14 @@ void kernel_main(void)
 	trap_init();
 	kbd_init();
 	timer_init();
+	sched_init();
+	prof_init();
+	trace_init();
 	mem_init();
+	vm_init();
 	task_init();
+	futex_init();
+	pipe_init();
 
 	disk_init();
 	disk_test();
@@ -45,7 +60,10 @@ void kernel_main(void)
 	// multiprocessor initialization
 	mp_init();
 	lapic_init();
+	pmu_init_percpu();
 	boot_aps();
+	// After the first task of every CPU, those are tasks[0 .. ncpu-1]
+	workqueue_init();
 
 	/* Test for page fault handler */
 	ptr = (int*)(0x12345678);
@@ -54,9 +72,8 @@ void kernel_main(void)
 	cprintf("used: %d, free: %d\n", get_num_used_page(), get_num_free_page());
 
 	booted = true;
-	/* Enable interrupt */
-	__asm __volatile("sti");
-	while(1);
+	/* Run tasks, interrupts are enabled while idle */
+	sched_idle();
 }
 
 // While boot_aps is booting a given CPU, it communicates the per-core
@@ -123,7 +140,7 @@ mp_main(void)
 	 *    A per-CPU task state segment (TSS) is also needed in order to
 	 *    specify where each CPU's kernel stack lives. The TSS for CPU i
 	 *    is stored in cpus[i].cpu_ts, and the corresponding TSS descriptor
-	 *    is defined in the GDT entry gdt[(GD_TSS0 >> 3) + i]. The global 
+	 *    is defined in GD_TSS0 of the GDT copy of CPU i. The global 
 	 *    tss variable defined in kern/task.c will no longer be useful.
 	 *
 	 * 3. Per-CPU current task pointer
@@ -162,12 +179,16 @@ mp_main(void)
 	 */
 	
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	tlb_init_percpu();
 	lcr3(PADDR(kern_pgdir));
+	// The MP table gave us APIC IDs 0..ncpu-1 in order
+	gdt_init_percpu(lapic_id());
 	cprintf("SMP: CPU %d starting\n", cpunum());
 	
 	// Your code here:
 	struct Elf *ehdr = (struct Elf *)0xf0000000;
 	lapic_init();
+	pmu_init_percpu();
 	task_init_percpu(ehdr);
 	lidt(&idt_pd);
 
@@ -178,7 +199,5 @@ mp_main(void)
 
 	// Waiting for cpu[0] boot
 	while (!booted);
-	// /* Enable interrupt */
-	__asm __volatile("sti");
-	while(1);
+	sched_idle();
 }
@@ -9,6 +9,9 @@
 #include <kernel/mem.h>
 #include <kernel/kclock.h>
 #include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/trace.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -17,9 +20,22 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-bool debug_page;		// Use to debug page leak
 static struct PageInfo *page_free_list;	// Free list of physical pages
 static size_t num_free_pages;
+// The CPUs map 4MB pages (CR4_PSE), see boot_map_region()
+static bool use_pse;
+// Protects the free list.  A leaf lock, page_alloc() and page_free()
+// are called with tasks_lock or vm_lock held.
+static struct spinlock page_lock;
+
+// Pending TLB shootdown, see tlb_shootdown()
+static struct {
+	pde_t *pgdir;
+	int n;				// n > TLB_BATCH flushes everything
+	uintptr_t va[TLB_BATCH];
+	volatile uint32_t pending;	// CPUs which have not flushed yet
+} tlb_req;
+static struct spinlock tlb_lock;
 
 // Debug usage
 static void dump_pp(struct PageInfo *pp)
@@ -130,11 +146,14 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
-	debug_page = false;
+	uint32_t cr0, edx;
+	spin_initlock(&tlb_lock);
+	spin_initlock(&page_lock);
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
+	cpuid(1, NULL, NULL, NULL, &edx);
+	use_pse = edx & CPUID_FEAT_PSE;
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
@@ -184,6 +203,10 @@ mem_init(void)
 	// Your code goes here:
 	boot_map_region(kern_pgdir, UPAGES, ROUNDUP((sizeof(struct PageInfo) * npages), PGSIZE), PADDR(pages), (PTE_U | PTE_P));
 
+	// Map the clock data read-only by the user at UVCLOCK, so user
+	// space reads the time without a system call
+	boot_map_region(kern_pgdir, UVCLOCK, PGSIZE, PADDR(&vclock_page), (PTE_U | PTE_P));
+
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -206,7 +229,11 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(0xFFFFFFFF - KERNBASE, PGSIZE), 0, (PTE_W | PTE_P));
+	// Kernel mappings are the same in every address space, mark them
+	// global so context switches don't flush them (see tlb_init_percpu).
+	// They are 4MB pages, which need no page tables and take far fewer
+	// TLB entries.
+	boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(0xFFFFFFFF - KERNBASE, PGSIZE), 0, (PTE_W | PTE_P | PTE_G));
 
 	//////////////////////////////////////////////////////////////////////
 	// Map VA range [IOPHYSMEM, EXTPHYSMEM) to PA range [IOPHYSMEM, EXTPHYSMEM)
@@ -225,6 +252,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	tlb_init_percpu();
 	lcr3(PADDR(kern_pgdir));
 
 	check_page_free_list(0);
@@ -241,7 +269,7 @@ mem_init(void)
 
 	// XXX: For test userprog
 	extern void readseg(uint32_t pa, uint32_t count, uint32_t offset);
-	readseg(KERNBASE, 64*PGSIZE, 5000*512);
+	readseg(KERNBASE, UIMAGE_SIZE, 5000*512);
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -268,7 +296,7 @@ mem_init_mp(void)
 	int i;
 	for (i = 0; i < NCPU; ++i) {
 		uint32_t ks = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
-		boot_map_region(kern_pgdir, ks - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+		boot_map_region(kern_pgdir, ks - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_G);
 	}
 }
 
@@ -357,15 +385,18 @@ page_alloc(int alloc_flags)
 {
 	struct PageInfo *ret;
 
-	if (!page_free_list)
+	spin_lock(&page_lock);
+	if (!page_free_list) {
+		spin_unlock(&page_lock);
 		return 0;
+	}
 
 	ret = page_free_list;
 	page_free_list = page_free_list->pp_link;	
 	ret->pp_link = 0;
 	num_free_pages--;
-	if (debug_page)
-		cprintf("Alloca page: %x\n", ret);
+	spin_unlock(&page_lock);
+	trace(EV_PAGE_ALLOC, page2pa(ret), alloc_flags);
 
 	if (alloc_flags & ALLOC_ZERO)
 		memset(page2kva(ret), 0, PGSIZE);
@@ -373,6 +404,58 @@ page_alloc(int alloc_flags)
 	return ret;
 }
 
+//
+// Allocates 4MB of physical memory aligned to 4MB, for a page directory
+// entry with PTE_PS.  The first page stands for all of them: it is
+// marked PP_HUGE, counts the references and frees the rest with it.
+// Returns NULL if the CPU has no 4MB pages or no such range is free.
+//
+// The free list is not ordered, a free range is found by counting the
+// free pages of every 4MB and then unlinking those of a full one.
+//
+struct PageInfo *
+page_alloc_huge(int alloc_flags)
+{
+	static uint16_t nfree[NPDENTRIES];
+	struct PageInfo *pp, **link;
+	size_t i, n;
+
+	if (!use_pse)
+		return NULL;
+	n = MIN(npages / NPTENTRIES, NPDENTRIES);
+	spin_lock(&page_lock);
+	memset(nfree, 0, sizeof(nfree));
+	for (pp = page_free_list; pp; pp = pp->pp_link)
+		if (PGNUM(page2pa(pp)) / NPTENTRIES < n)
+			nfree[PGNUM(page2pa(pp)) / NPTENTRIES]++;
+	// From the top, the low memory is the kernel's
+	for (i = n; i > 0; i--)
+		if (nfree[i - 1] == NPTENTRIES)
+			break;
+	if (i == 0) {
+		spin_unlock(&page_lock);
+		return NULL;
+	}
+	i--;
+	for (link = &page_free_list; *link; ) {
+		pp = *link;
+		if (PGNUM(page2pa(pp)) / NPTENTRIES == i) {
+			*link = pp->pp_link;
+			pp->pp_link = NULL;
+		} else
+			link = &pp->pp_link;
+	}
+	num_free_pages -= NPTENTRIES;
+	spin_unlock(&page_lock);
+
+	pp = &pages[i * NPTENTRIES];
+	pp->pp_flags |= PP_HUGE;
+	trace(EV_PAGE_ALLOC, page2pa(pp), alloc_flags);
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PTSIZE);
+	return pp;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -380,17 +463,21 @@ page_alloc(int alloc_flags)
 void
 page_free(struct PageInfo *pp)
 {
-	struct PageInfo *tmp;
+	// The rest of a 4MB page goes with its first one
+	int i, n = pp->pp_flags & PP_HUGE ? NPTENTRIES : 1;
 
 	if (pp->pp_ref)
 		panic("pp->pp_ref != 0, %d");
 
-	tmp = page_free_list;
-	page_free_list = pp;
-	pp->pp_link = tmp;
-	num_free_pages++;
-	if (debug_page)
-		cprintf("Free page: %x\n", page_free_list);
+	pp->pp_flags &= ~PP_HUGE;
+	spin_lock(&page_lock);
+	for (i = n - 1; i >= 0; i--) {
+		pp[i].pp_link = page_free_list;
+		page_free_list = &pp[i];
+	}
+	num_free_pages += n;
+	spin_unlock(&page_lock);
+	trace(EV_PAGE_FREE, page2pa(pp), 0);
 }
 
 //
@@ -426,12 +513,17 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// A 4MB page (PTE_PS) has no page table, its page directory entry is
+// returned as the PTE of every address in it.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	pde_t *pde = pgdir + PDX(va);
 	pte_t *ret;
 
+	if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return pde;
 	if (*pde & PTE_P) {
 		ret = (pte_t *)KADDR(PTE_ADDR(*pde));
 		return ret + PTX(va);
@@ -462,14 +554,26 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// Where va and pa are aligned to 4MB and the CPU supports it, a whole
+// 4MB is mapped with one page directory entry.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	size_t i;
 	for (i = 0; i < size; i += PGSIZE) {
+		if (use_pse && va % PTSIZE == 0 && pa % PTSIZE == 0 &&
+		    size - i >= PTSIZE) {
+			pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+			i += PTSIZE - PGSIZE;
+			va += PTSIZE;
+			pa += PTSIZE;
+			continue;
+		}
 		pte_t *pte = pgdir_walk(pgdir, (char *)va, 1);
 		*pte = pa | perm | PTE_P;
+		pgdir[PDX(va)] |= perm & PTE_U;
 		va += PGSIZE;
 		pa += PGSIZE;
 	}
@@ -525,6 +629,38 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Map the 4MB page pp (see page_alloc_huge()) at va, which is aligned
+// to 4MB, with a single page directory entry.  An empty page table left
+// there is freed, once no CPU can walk it from its paging-structure
+// caches.  Returns -E_INVAL if pages are still mapped by it.
+//
+int
+page_insert_huge(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	int i;
+
+	pp->pp_ref += 1;
+	if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		page_remove(pgdir, va);
+	else if (*pde & PTE_P) {
+		pt = KADDR(PTE_ADDR(*pde));
+		for (i = 0; i < NPTENTRIES; i++)
+			if (pt[i] & PTE_P) {
+				pp->pp_ref -= 1;
+				return -E_INVAL;
+			}
+		*pde = 0;
+		// Flushes everything, the cached PDE too
+		tlb_shootdown(pgdir, NULL, TLB_BATCH + 1);
+		page_decref(pa2page(PADDR(pt)));
+	}
+	*pde = page2pa(pp) | perm | PTE_P | PTE_PS;
+	return 0;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -532,7 +668,8 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 // can be used to verify page permissions for syscall arguments,
 // but should not be used by most callers.
 //
-// Return NULL if there is no page mapped at va.
+// Return NULL if there is no page mapped at va.  In a 4MB page that is
+// its first page, which holds the reference count.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -564,29 +701,196 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
-page_remove(pde_t *pgdir, void *va)
+// page_remove() without the TLB flush and the page_decref(), returns
+// the page which was mapped at va, or NULL.  Its reference may only be
+// dropped once no CPU can reach it through a stale TLB entry any more.
+static struct PageInfo *
+page_unmap(pde_t *pgdir, void *va)
 {
 	pte_t *pte;
 	struct PageInfo *pp = page_lookup(pgdir, va, &pte);
-	if (!pp)
-		return;
+	if (!pp || !(*pte & PTE_P))
+		return NULL;
 
-	page_decref(pp);
 	*pte = 0;
-	tlb_invalidate(pgdir, va);
+	return pp;
+}
+
+void
+page_remove(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp;
+
+	if ((pp = page_unmap(pgdir, va)) != NULL) {
+		tlb_invalidate(pgdir, va);
+		page_decref(pp);
+	}
+}
+
+// Pages page_remove_range() unmaps before a shootdown
+#define UNMAP_BATCH	64
+
+// Flush the n pages unmapped at va[] (see tlb_shootdown()), then drop them
+static void
+page_free_unmapped(pde_t *pgdir, uintptr_t *va, struct PageInfo **pps, int n)
+{
+	int i;
+
+	tlb_shootdown(pgdir, va, n);
+	for (i = 0; i < n; i++)
+		page_decref(pps[i]);
+}
+
+//
+// Unmaps every page in [va, va + len) like page_remove(), but with a
+// single TLB shootdown per UNMAP_BATCH pages, after which they are freed.
+//
+void
+page_remove_range(pde_t *pgdir, void *va, size_t len)
+{
+	struct PageInfo *pp, *unmapped[UNMAP_BATCH];
+	uintptr_t batch[TLB_BATCH];
+	uintptr_t a = ROUNDDOWN((uintptr_t)va, PGSIZE);
+	int n = 0;
+
+	for (; a < (uintptr_t)va + len; a += PGSIZE) {
+		if ((pp = page_unmap(pgdir, (void *)a)) == NULL)
+			continue;
+		if (n < TLB_BATCH)
+			batch[n] = a;
+		unmapped[n++] = pp;
+		if (n == UNMAP_BATCH) {
+			page_free_unmapped(pgdir, batch, unmapped, n);
+			n = 0;
+		}
+	}
+	if (n)
+		page_free_unmapped(pgdir, batch, unmapped, n);
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// edited are the ones currently in use by a processor.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	// For now, there is only one address space, so always invalidate.
-	invlpg(va);
+	uintptr_t a = (uintptr_t)va;
+	tlb_shootdown(pgdir, &a, 1);
+}
+
+// Enable global pages on this CPU, so kernel mappings (PTE_G) survive
+// the CR3 reloads of context switches, and the 4MB pages of kern_pgdir.
+// Called before the CPU loads kern_pgdir.
+void
+tlb_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_FEAT_PGE)
+		lcr4(rcr4() | CR4_PGE);
+	if (use_pse)
+		lcr4(rcr4() | CR4_PSE);
+}
+
+// Reloading CR3 keeps global entries, toggling CR4.PGE drops them too.
+static void
+tlbflush_global(void)
+{
+	uint32_t cr4 = rcr4();
+
+	if (cr4 & CR4_PGE) {
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		tlbflush();
+}
+
+// Flush va[0..n) of pgdir from this CPU's TLB, if it uses pgdir.
+// Kernel mappings are shared by every page directory.
+// n < 0 asks to stop using pgdir because it is about to be freed.
+static void
+tlb_flush_local(pde_t *pgdir, uintptr_t *va, int n)
+{
+	int i;
+
+	if (n < 0) {
+		if (thiscpu->cpu_pgdir == pgdir)
+			cpu_load_pgdir(kern_pgdir);
+		return;
+	}
+	if (pgdir != kern_pgdir && rcr3() != PADDR(pgdir))
+		return;
+	if (n > TLB_BATCH && pgdir == kern_pgdir)
+		tlbflush_global();
+	else if (n > TLB_BATCH)
+		tlbflush();
+	else
+		for (i = 0; i < n; i++)
+			invlpg((void *)va[i]);
+}
+
+//
+// TLB shootdown.
+//
+// Flush va[0..n) of pgdir (everything if n > TLB_BATCH) from the TLB
+// of every CPU that may cache it.  With n < 0 those CPUs switch to
+// kern_pgdir instead, an idle CPU keeps the page directory of its last
+// task loaded (lazy TLB) so this has to happen before pgdir is freed.
+//
+// The initiator fills tlb_req under
+// tlb_lock, sends an IRQ_TLB IPI to every other CPU running on pgdir
+// and waits until each one has cleared its bit in pending.
+//
+// The kernel runs with interrupts disabled, so CPUs waiting in a spin
+// loop answer with tlb_shootdown_poll(), otherwise a CPU spinning on a
+// lock held by the initiator would never acknowledge.
+//
+void
+tlb_shootdown(pde_t *pgdir, uintptr_t *va, int n)
+{
+	uint32_t mask = 0;
+	int c, me = cpunum();
+
+	tlb_flush_local(pgdir, va, n);
+	// Also before mp_init()
+	if (ncpu <= 1)
+		return;
+
+	// The locked xadd in spin_lock() also orders our page table
+	// updates before the reads of cpu_pgdir below.
+	spin_lock(&tlb_lock);
+	for (c = 0; c < ncpu; c++)
+		if (c != me && cpus[c].cpu_status == CPU_STARTED &&
+		    (pgdir == kern_pgdir || cpus[c].cpu_pgdir == pgdir))
+			mask |= 1 << c;
+	if (mask) {
+		tlb_req.pgdir = pgdir;
+		tlb_req.n = n;
+		if (n >= 0 && n <= TLB_BATCH)
+			memcpy(tlb_req.va, va, n * sizeof(va[0]));
+		tlb_req.pending = mask;
+		for (c = 0; c < ncpu; c++)
+			if (mask & (1 << c))
+				lapic_ipi_cpu(cpus[c].cpu_id, IRQ_OFFSET + IRQ_TLB);
+		while (tlb_req.pending)
+			asm volatile ("pause" ::: "memory");
+	}
+	spin_unlock(&tlb_lock);
+}
+
+// Handle the shootdown request for this CPU, if there is one.
+// Called from the IRQ_TLB handler and from kernel spin loops.
+void
+tlb_shootdown_poll(void)
+{
+	uint32_t bit = 1 << cpunum();
+
+	if (!(tlb_req.pending & bit))
+		return;
+	tlb_flush_local(tlb_req.pgdir, tlb_req.va, tlb_req.n);
+	xadd(&tlb_req.pending, -bit);
 }
 
 /* This is the system call implementation of get_num_free_page */
@@ -636,7 +940,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	//
 	size = ROUNDUP(size, PGSIZE);	
 	assert(base + size < MMIOLIM);
-	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD | PTE_PWT | PTE_W);
+	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD | PTE_PWT | PTE_W | PTE_G);
 	uintptr_t ret = base;
 	base += size;
 	return ret;
@@ -833,6 +1137,7 @@ check_kern_pgdir(void)
 		case PDX(UVPT):
 		case PDX(KSTACKTOP-1):
 		case PDX(UPAGES):
+		case PDX(UVCLOCK):
 		case PDX(MMIOBASE):
 			assert(pgdir[i] & PTE_P);
 			break;
@@ -861,6 +1166,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_PS_ADDR(*pgdir) | (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
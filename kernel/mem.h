@@ -6,7 +6,6 @@
 
 extern char bootstacktop[], bootstack[];
 
-extern bool debug_page;
 extern struct PageInfo *pages;
 extern size_t npages;
 
@@ -46,17 +45,30 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// pp_flags of struct PageInfo
+#define PP_HUGE		0x1	// First page of a 4MB page
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_huge(int alloc_flags);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_huge(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+void	page_remove_range(pde_t *pgdir, void *va, size_t len);
+
+// Max pages flushed one by one in a TLB shootdown
+#define TLB_BATCH	16
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(pde_t *pgdir, uintptr_t *va, int n);
+void	tlb_shootdown_poll(void);
+void	tlb_init_percpu(void);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -80,6 +92,15 @@ page2kva(struct PageInfo *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+// The physical address of va, which the entry pte of pgdir_walk() maps
+static inline physaddr_t
+pte_pa(pte_t pte, const void *va)
+{
+	if (pte & PTE_PS)
+		return PDE_PS_ADDR(pte) | ((uintptr_t)va & (PTSIZE - 1));
+	return PTE_ADDR(pte) | PGOFF(va);
+}
+
 void mem_init(void);
 void *mmio_map_region(physaddr_t pa, size_t size);
 size_t get_num_free_page(void);
@@ -0,0 +1,60 @@
+/*
+ * Memory of a program beyond its image and stack: sbrk() moves the end
+ * of the heap, mmap() adds an anonymous region and munmap() removes
+ * any part of the address space.  The pages are zeroed on first touch
+ * like the rest of VMA_ANON, see vm.c.  MAP_HUGE asks for a huge
+ * region of 4MB pages.
+ */
+#include <inc/mmu.h>
+#include <inc/syscall.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/vm.h>
+
+// Returns the old end of the heap, always below 2GB
+int
+sys_sbrk(intptr_t incr)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	uintptr_t old;
+	int err;
+
+	if ((err = vm_sbrk(cur->mm, incr, &old)) < 0)
+		return err;
+	return old;
+}
+
+/*
+ * len bytes of zeroed memory at addr with MAP_FIXED, or wherever there
+ * is room in [UMMAP, UMMAP_TOP).  Returns the address.
+ */
+int
+sys_mmap(void *addr, size_t len, int prot, int flags)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	int perm = PTE_U | (prot & PROT_WRITE ? PTE_W : 0);
+	bool huge = flags & MAP_HUGE;
+	uintptr_t va;
+	int err;
+
+	if (!(flags & MAP_ANON) || (flags & ~(MAP_ANON | MAP_FIXED | MAP_HUGE)) ||
+	    (prot & ~(PROT_READ | PROT_WRITE)))
+		return -STATUS_EINVAL;
+	// Let vm_map_free() align it
+	if (huge && (flags & MAP_FIXED))
+		return -STATUS_EINVAL;
+	if (flags & MAP_FIXED) {
+		va = (uintptr_t)addr;
+		if (va >= UMMAP_TOP)
+			return -STATUS_EINVAL;
+		err = vm_map(cur->mm, va, len, VMA_ANON, perm, NULL, 0, 0);
+	} else
+		err = vm_map_free(cur->mm, len, VMA_ANON, perm, huge, NULL, &va);
+	return err < 0 ? err : va;
+}
+
+int
+sys_munmap(void *addr, size_t len)
+{
+	return vm_unmap(thiscpu->cpu_task->mm, (uintptr_t)addr, len);
+}
@@ -0,0 +1,385 @@
+/*
+ * Page cache of the files mapped by exec(), so a program is read from
+ * the disk a page at a time as it touches it, and a second run of it
+ * finds the pages in memory.
+ *
+ * A cached page holds one reference of its PageInfo, every mapping
+ * holds another one.  Only pages nobody maps (pp_ref == 1) are evicted,
+ * by a clock over the page slots.  Everything is protected by vm_lock,
+ * the disk is read with it dropped: the FAT code takes fs_lock and may
+ * fault on nothing but kernel memory.
+ *
+ * Writing or removing a file through the system calls invalidates it,
+ * tasks which map it keep the pages they already have.
+ *
+ * A page fault which had to wait for the disk reads the next page
+ * ahead on the work queue of another CPU, see pcache_readahead().
+ */
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/pcache.h>
+#include <kernel/vm.h>
+#include <kernel/workqueue.h>
+
+#define PCACHE_FILES	4	// Below FS_KFD_MAX, an open takes one more
+#define PCACHE_PAGES	256
+#define PCACHE_HASH	64	// A power of two
+#define PCACHE_RA	8	// Read-aheads in flight
+
+struct pc_page {
+	struct pc_file *file;	// NULL if free
+	uint32_t off;
+	struct PageInfo *pp;
+	int next;		// Hash chain or free list, -1 ends it
+	bool referenced;	// Looked up since the clock hand passed
+};
+
+// A page to read ahead, work first so the work item leads to it
+struct pc_ra {
+	struct work work;
+	struct pc_file *file;	// NULL if free
+	uint32_t off;
+};
+
+static struct pc_file pc_files[PCACHE_FILES];
+static struct pc_page pc_pages[PCACHE_PAGES];
+static int pc_hash[PCACHE_HASH];
+static int pc_free;
+static int pc_hand;
+static struct pc_ra pc_ras[PCACHE_RA];
+
+static void pc_readahead_work(struct work *w);
+
+void
+pcache_init(void)
+{
+	int i;
+
+	for (i = 0; i < PCACHE_RA; i++)
+		work_init(&pc_ras[i].work, pc_readahead_work);
+
+	for (i = 0; i < PCACHE_HASH; i++)
+		pc_hash[i] = -1;
+	for (i = 0; i < PCACHE_PAGES; i++)
+		pc_pages[i].next = i + 1 < PCACHE_PAGES ? i + 1 : -1;
+	pc_free = 0;
+}
+
+static int
+pc_bucket(struct pc_file *f, uint32_t off)
+{
+	return ((f - pc_files) * 31 + off / PGSIZE) & (PCACHE_HASH - 1);
+}
+
+static int
+pc_lookup(struct pc_file *f, uint32_t off)
+{
+	int i;
+
+	for (i = pc_hash[pc_bucket(f, off)]; i >= 0; i = pc_pages[i].next)
+		if (pc_pages[i].file == f && pc_pages[i].off == off)
+			return i;
+	return -1;
+}
+
+// Take slot i out of its hash chain and drop the cache's reference
+static void
+pc_evict(int i)
+{
+	struct pc_page *p = &pc_pages[i];
+	int *link = &pc_hash[pc_bucket(p->file, p->off)];
+
+	while (*link != i)
+		link = &pc_pages[*link].next;
+	*link = p->next;
+	page_decref(p->pp);
+	p->file = NULL;
+	p->next = pc_free;
+	pc_free = i;
+}
+
+// A free slot, evicting an unmapped page if needed, or -1
+static int
+pc_alloc(void)
+{
+	struct pc_page *p;
+	int i, n;
+
+	// Two rounds, the first one clears the referenced bits
+	for (n = 0; pc_free < 0 && n < 2 * PCACHE_PAGES; n++) {
+		p = &pc_pages[pc_hand];
+		i = pc_hand;
+		pc_hand = (pc_hand + 1) % PCACHE_PAGES;
+		if (p->file == NULL || p->pp->pp_ref > 1)
+			continue;
+		if (p->referenced)
+			p->referenced = false;
+		else
+			pc_evict(i);
+	}
+	if ((i = pc_free) >= 0)
+		pc_free = pc_pages[i].next;
+	return i;
+}
+
+// Drop the cached pages of f
+static void
+pc_drop(struct pc_file *f)
+{
+	int i;
+
+	for (i = 0; i < PCACHE_PAGES; i++)
+		if (pc_pages[i].file == f)
+			pc_evict(i);
+}
+
+static const char *
+pc_name(const char *path)
+{
+	while (*path == '/')
+		path++;
+	return path;
+}
+
+// f with its reference, if path is open and up to date
+static struct pc_file *
+pc_find(const char *path)
+{
+	struct pc_file *f;
+
+	for (f = pc_files; f < pc_files + PCACHE_FILES; f++)
+		if (f->fd && !f->stale && strcmp(f->path, path) == 0) {
+			f->ref++;
+			return f;
+		}
+	return NULL;
+}
+
+static void
+pc_fd_close(struct fs_fd *fd)
+{
+	file_close(fd);
+	fd_put(fd);
+}
+
+/*
+ * Open path for reading through the cache, in *fp.  The file stays
+ * open while it has references, and after that until it is replaced
+ * or invalidated.  Returns 0 or -STATUS_*.
+ */
+int
+pcache_open(const char *path, struct pc_file **fp)
+{
+	struct pc_file *f, *victim = NULL;
+	struct fs_fd *fd, *old = NULL;
+	int err;
+
+	path = pc_name(path);
+	if (strlen(path) >= sizeof(f->path))
+		return -STATUS_EINVAL;
+	spin_lock(&vm_lock);
+	f = pc_find(path);
+	spin_unlock(&vm_lock);
+	if (f) {
+		*fp = f;
+		return 0;
+	}
+
+	// Not one of the user descriptors, see fd_new_kernel()
+	if ((fd = fd_new_kernel()) == NULL)
+		return -STATUS_ENOSPC;
+	err = file_open(fd, path, O_RDONLY);
+	if (err < 0) {
+		fd_put(fd);
+		return err;
+	}
+
+	spin_lock(&vm_lock);
+	// Somebody opened it meanwhile
+	if ((f = pc_find(path)) != NULL) {
+		spin_unlock(&vm_lock);
+		pc_fd_close(fd);
+		*fp = f;
+		return 0;
+	}
+	for (f = pc_files; f < pc_files + PCACHE_FILES; f++) {
+		if (f->fd == NULL)
+			break;
+		if (f->ref == 0 && victim == NULL)
+			victim = f;
+	}
+	if (f == pc_files + PCACHE_FILES) {
+		if ((f = victim) == NULL) {
+			spin_unlock(&vm_lock);
+			pc_fd_close(fd);
+			return -STATUS_ENOSPC;
+		}
+		pc_drop(f);
+		old = f->fd;
+	}
+	strcpy(f->path, path);
+	f->fd = fd;
+	f->size = fd->size;
+	f->ref = 1;
+	f->stale = false;
+	spin_unlock(&vm_lock);
+	if (old)
+		pc_fd_close(old);
+	*fp = f;
+	return 0;
+}
+
+// Another reference to f, with vm_lock held
+void
+pcache_dup(struct pc_file *f)
+{
+	f->ref++;
+}
+
+void
+pcache_close(struct pc_file *f)
+{
+	struct fs_fd *fd = NULL;
+
+	spin_lock(&vm_lock);
+	if (--f->ref == 0 && f->stale) {
+		fd = f->fd;
+		f->fd = NULL;
+	}
+	spin_unlock(&vm_lock);
+	if (fd)
+		pc_fd_close(fd);
+}
+
+/*
+ * The page at off (page aligned) of f in *ppp, with a reference for
+ * the caller.  Called with vm_lock held, which is dropped to read the
+ * disk on a miss, the caller must check what it looked up before
+ * again.  Bytes past the end of the file are zero.  Returns 1 if it
+ * was read from the disk.
+ */
+int
+pcache_get(struct pc_file *f, uint32_t off, struct PageInfo **ppp)
+{
+	struct PageInfo *pp;
+	int i, n;
+
+	if ((i = pc_lookup(f, off)) >= 0) {
+		pc_pages[i].referenced = true;
+		*ppp = pc_pages[i].pp;
+		(*ppp)->pp_ref++;
+		return 0;
+	}
+
+	spin_unlock(&vm_lock);
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+		spin_lock(&vm_lock);
+		return -STATUS_ENOMEM;
+	}
+	n = 0;
+	if (off < f->size)
+		n = file_pread(f->fd, page2kva(pp), MIN(PGSIZE, f->size - off), off);
+	spin_lock(&vm_lock);
+	if (n < 0) {
+		page_free(pp);
+		return n;
+	}
+
+	// Read by somebody else meanwhile
+	if ((i = pc_lookup(f, off)) >= 0) {
+		page_free(pp);
+		pp = pc_pages[i].pp;
+	} else if (!f->stale && (i = pc_alloc()) >= 0) {
+		pc_pages[i].file = f;
+		pc_pages[i].off = off;
+		pc_pages[i].pp = pp;
+		pc_pages[i].next = pc_hash[pc_bucket(f, off)];
+		pc_hash[pc_bucket(f, off)] = i;
+		pp->pp_ref++;
+	}
+	if (i >= 0)
+		pc_pages[i].referenced = true;
+	pp->pp_ref++;
+	*ppp = pp;
+	return 1;
+}
+
+static void
+pc_readahead_work(struct work *w)
+{
+	struct pc_ra *ra = (struct pc_ra *)w;
+	struct pc_file *f = ra->file;
+	struct PageInfo *pp;
+
+	spin_lock(&vm_lock);
+	// Stays cached, unless the cache is full or f went stale
+	if (pcache_get(f, ra->off, &pp) >= 0)
+		page_decref(pp);
+	ra->file = NULL;
+	spin_unlock(&vm_lock);
+	pcache_close(f);
+}
+
+/*
+ * Read the page at off of f into the cache in the background, takes
+ * over a reference of f.  Runs on the next CPU, the disk is polled and
+ * would stall the task which is about to touch the page here.
+ */
+void
+pcache_readahead(struct pc_file *f, uint32_t off)
+{
+	struct pc_ra *ra = NULL;
+	int i;
+
+	spin_lock(&vm_lock);
+	if (off < f->size && !f->stale && pc_lookup(f, off) < 0) {
+		for (i = 0; i < PCACHE_RA; i++) {
+			// One read-ahead of a page is enough
+			if (pc_ras[i].file == f && pc_ras[i].off == off) {
+				ra = NULL;
+				break;
+			}
+			if (pc_ras[i].file == NULL && ra == NULL)
+				ra = &pc_ras[i];
+		}
+	}
+	if (ra) {
+		ra->file = f;
+		ra->off = off;
+	}
+	spin_unlock(&vm_lock);
+	if (ra)
+		queue_work_on((cpunum() + 1) % ncpu, &ra->work);
+	else
+		pcache_close(f);
+}
+
+/*
+ * path is about to change on disk.  Its pages are dropped, the file is
+ * closed now if nobody maps it or else with the last reference.
+ */
+void
+pcache_invalidate(const char *path)
+{
+	struct pc_file *f;
+	struct fs_fd *fds[PCACHE_FILES];
+	int i, n = 0;
+
+	path = pc_name(path);
+	spin_lock(&vm_lock);
+	for (f = pc_files; f < pc_files + PCACHE_FILES; f++) {
+		if (f->fd == NULL || f->stale || strcmp(f->path, path) != 0)
+			continue;
+		pc_drop(f);
+		if (f->ref == 0) {
+			fds[n++] = f->fd;
+			f->fd = NULL;
+		} else
+			f->stale = true;
+	}
+	spin_unlock(&vm_lock);
+	for (i = 0; i < n; i++)
+		pc_fd_close(fds[i]);
+}
@@ -0,0 +1,23 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+#include <inc/types.h>
+#include <kernel/mem.h>
+#include <kernel/fs/fs.h>
+
+// A file open in the page cache, see pcache.c
+struct pc_file {
+	char path[64];		// As given to pcache_open(), no leading '/'
+	struct fs_fd *fd;	// NULL if the slot is free
+	uint32_t size;
+	int ref;		// Mappings and exec() using it
+	bool stale;		// Changed on disk, closed with the last ref
+};
+
+void pcache_init(void);
+int pcache_open(const char *path, struct pc_file **fp);
+void pcache_dup(struct pc_file *f);
+void pcache_close(struct pc_file *f);
+int pcache_get(struct pc_file *f, uint32_t off, struct PageInfo **ppp);
+void pcache_readahead(struct pc_file *f, uint32_t off);
+void pcache_invalidate(const char *path);
+#endif
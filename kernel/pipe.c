@@ -0,0 +1,371 @@
+/*
+ * Pipes: a ring of up to PIPE_BUFS pages between a writer and a reader,
+ * both ends are descriptors of the fd table (FD_PIPE, see fs_syscall.c).
+ * read() and write() copy, a full pipe puts the writer to sleep and an
+ * empty one the reader, until the other end closes.  They copy with
+ * copyin() and copyout(), the user buffer may be unmapped by another
+ * thread while they sleep.
+ *
+ * splice() and vmsplice() move whole pages instead: a page of the page
+ * cache, or a page of the writer which becomes copy on write, is put
+ * into the ring as it is, and a file is written straight from the pages
+ * of the ring.  Such shared pages are never appended to.
+ */
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/spinlock.h>
+#include <kernel/pcache.h>
+#include <kernel/vm.h>
+#include <kernel/pipe.h>
+
+#define NPIPE		8
+#define PIPE_BUFS	16	// Pages in the ring
+
+struct pipe_buf {
+	struct PageInfo *pp;
+	uint32_t off;		// Of the first byte not read yet
+	uint32_t len;
+	bool shared;		// Mapped or cached elsewhere, read-only
+};
+
+// Taken before tasks_lock and vm_lock, held while copying to and from
+// prefaulted user memory but not while writing a file (fs_lock sleeps)
+struct pipe {
+	struct spinlock lock;
+	struct pipe_buf bufs[PIPE_BUFS];
+	int head;		// First buffer to read
+	int n;			// Buffers in use
+	int readers;		// Open ends, both 0 if the pipe is free
+	int writers;
+	struct wait_queue rwait;	// Readers of an empty pipe
+	struct wait_queue wwait;	// Writers of a full one
+};
+
+static struct pipe pipes[NPIPE];
+
+void
+pipe_init(void)
+{
+	int i;
+
+	// One entry of lockstat for all pipes
+	__spin_initlock_array(&pipes[0].lock, NPIPE, sizeof(pipes[0]), "pipe");
+	for (i = 0; i < NPIPE; i++) {
+		wq_init(&pipes[i].rwait);
+		wq_init(&pipes[i].wwait);
+	}
+}
+
+// A free pipe with one reader and one writer, or NULL
+struct pipe *
+pipe_alloc(void)
+{
+	struct pipe *p;
+
+	for (p = pipes; p < pipes + NPIPE; p++) {
+		spin_lock(&p->lock);
+		if (p->readers == 0 && p->writers == 0) {
+			p->readers = p->writers = 1;
+			p->head = p->n = 0;
+			spin_unlock(&p->lock);
+			return p;
+		}
+		spin_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+// The pages of the page cache and of tasks count their users under vm_lock
+static void
+pipe_put_page(struct PageInfo *pp)
+{
+	spin_lock(&vm_lock);
+	page_decref(pp);
+	spin_unlock(&vm_lock);
+}
+
+static struct pipe_buf *
+pipe_last(struct pipe *p)
+{
+	return &p->bufs[(p->head + p->n - 1) % PIPE_BUFS];
+}
+
+// Bytes write() can still add to the last buffer
+static uint32_t
+pipe_room(struct pipe *p)
+{
+	struct pipe_buf *b = pipe_last(p);
+
+	if (p->n == 0 || b->shared)
+		return 0;
+	return PGSIZE - b->off - b->len;
+}
+
+// Add the page pp to the ring, which takes over the caller's reference
+static void
+pipe_push(struct pipe *p, struct PageInfo *pp, uint32_t off, uint32_t len,
+	  bool shared)
+{
+	struct pipe_buf *b = &p->bufs[(p->head + p->n) % PIPE_BUFS];
+
+	b->pp = pp;
+	b->off = off;
+	b->len = len;
+	b->shared = shared;
+	p->n++;
+	wq_wake_all(&p->rwait);
+}
+
+// Drop the first buffer
+static void
+pipe_pop(struct pipe *p)
+{
+	pipe_put_page(p->bufs[p->head].pp);
+	p->head = (p->head + 1) % PIPE_BUFS;
+	p->n--;
+	wq_wake_all(&p->wwait);
+}
+
+/*
+ * Wait until there is room for a buffer, or for a byte as well if
+ * bytes.  Returns -STATUS_EPIPE once nobody reads any more.
+ */
+static int
+pipe_wait_room(struct pipe *p, bool bytes)
+{
+	struct Task *cur = thiscpu->cpu_task;
+
+	while (p->readers > 0 && !cur->killed && p->n == PIPE_BUFS &&
+	       !(bytes && pipe_room(p)))
+		wq_sleep(&p->wwait, &p->lock);
+	if (p->readers == 0)
+		return -STATUS_EPIPE;
+	return cur->killed ? -STATUS_EINTR : 0;
+}
+
+// Wait until there is something to read, 0 is the end of the data
+static int
+pipe_wait_data(struct pipe *p)
+{
+	struct Task *cur = thiscpu->cpu_task;
+
+	while (p->n == 0 && p->writers > 0 && !cur->killed)
+		wq_sleep(&p->rwait, &p->lock);
+	if (p->n == 0 && cur->killed)
+		return -STATUS_EINTR;
+	return 0;
+}
+
+// The last user of one end is gone
+void
+pipe_close(struct pipe *p, bool write)
+{
+	spin_lock(&p->lock);
+	if (write)
+		p->writers--;
+	else
+		p->readers--;
+	wq_wake_all(&p->rwait);
+	wq_wake_all(&p->wwait);
+	if (p->readers == 0 && p->writers == 0)
+		while (p->n)
+			pipe_pop(p);
+	spin_unlock(&p->lock);
+}
+
+/*
+ * Copy up to len bytes into buf, which is faulted in.  Sleeps until
+ * there is something, returns 0 when the writers are gone.
+ */
+int
+pipe_read(struct pipe *p, void *buf, size_t len)
+{
+	struct pipe_buf *b;
+	uint32_t n;
+	int done = 0, err;
+
+	spin_lock(&p->lock);
+	if ((err = pipe_wait_data(p)) < 0) {
+		spin_unlock(&p->lock);
+		return err;
+	}
+	while (done < len && p->n) {
+		b = &p->bufs[p->head];
+		n = MIN(len - done, b->len);
+		if ((err = copyout((char *)buf + done,
+				   (char *)page2kva(b->pp) + b->off, n)) < 0)
+			break;
+		b->off += n;
+		b->len -= n;
+		done += n;
+		if (b->len == 0)
+			pipe_pop(p);
+	}
+	spin_unlock(&p->lock);
+	return done ? done : err;
+}
+
+/*
+ * Copy all of buf, which is faulted in, into the pipe.  Sleeps while it
+ * is full, returns what was written before the readers went away.
+ */
+int
+pipe_write(struct pipe *p, const void *buf, size_t len)
+{
+	struct PageInfo *pp;
+	struct pipe_buf *b;
+	uint32_t n;
+	int done = 0, err = 0;
+
+	spin_lock(&p->lock);
+	while (done < len) {
+		if ((err = pipe_wait_room(p, true)) < 0)
+			break;
+		if (pipe_room(p) == 0) {
+			if ((pp = page_alloc(0)) == NULL) {
+				err = -STATUS_ENOMEM;
+				break;
+			}
+			pp->pp_ref++;
+			pipe_push(p, pp, 0, 0, false);
+		}
+		b = pipe_last(p);
+		n = MIN(len - done, pipe_room(p));
+		if ((err = copyin((char *)page2kva(b->pp) + b->off + b->len,
+				  (const char *)buf + done, n)) < 0)
+			break;
+		b->len += n;
+		done += n;
+		wq_wake_all(&p->rwait);
+	}
+	spin_unlock(&p->lock);
+	return done ? done : err;
+}
+
+/*
+ * Write buf into the pipe, its whole pages without copying them: they
+ * go into the ring and become copy on write for the caller, whose later
+ * writes do not change what the reader gets.  The ragged ends are
+ * copied.
+ */
+int
+pipe_vmsplice(struct pipe *p, const void *buf, size_t len)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	struct PageInfo *pp;
+	uintptr_t va = (uintptr_t)buf;
+	size_t n;
+	int done = 0, err = 0;
+
+	while (done < len) {
+		n = len - done;
+		if (va % PGSIZE || n < PGSIZE ||
+		    (err = vm_page_share(cur->mm, va, &pp)) == -STATUS_EINVAL) {
+			// Ragged ends and shared memory are copied
+			n = MIN(n, PGSIZE - va % PGSIZE);
+			if ((err = vm_prefault((void *)va, n, false)) < 0 ||
+			    (err = pipe_write(p, (void *)va, n)) < 0)
+				break;
+		} else {
+			n = PGSIZE;
+			if (err < 0)
+				break;
+			spin_lock(&p->lock);
+			if ((err = pipe_wait_room(p, false)) == 0)
+				pipe_push(p, pp, 0, PGSIZE, true);
+			spin_unlock(&p->lock);
+			if (err < 0) {
+				pipe_put_page(pp);
+				break;
+			}
+		}
+		va += n;
+		done += n;
+	}
+	return done ? done : err;
+}
+
+/*
+ * Move up to len bytes of the file fd from its position into the pipe
+ * as pages of the page cache, and move the position past them.
+ */
+int
+pipe_splice_in(struct pipe *p, struct fs_fd *fd, size_t len)
+{
+	struct pc_file *f;
+	struct PageInfo *pp;
+	uint32_t off, n;
+	int done = 0, err;
+
+	if ((err = pcache_open(fd->path, &f)) < 0)
+		return err;
+	while (done < len && (off = fd->pos + done) < f->size) {
+		spin_lock(&vm_lock);
+		err = pcache_get(f, ROUNDDOWN(off, PGSIZE), &pp);
+		spin_unlock(&vm_lock);
+		if (err < 0)
+			break;
+		n = MIN(len - done, PGSIZE - off % PGSIZE);
+		n = MIN(n, f->size - off);
+		spin_lock(&p->lock);
+		if ((err = pipe_wait_room(p, false)) == 0)
+			pipe_push(p, pp, off % PGSIZE, n, true);
+		spin_unlock(&p->lock);
+		if (err < 0) {
+			pipe_put_page(pp);
+			break;
+		}
+		done += n;
+	}
+	pcache_close(f);
+	if (done)
+		file_lseek(fd, fd->pos + done);
+	return done ? done : err;
+}
+
+/*
+ * Write up to len bytes of the pipe to the file fd, from the pages of
+ * the ring.  Sleeps until there is something, 0 if the writers are gone.
+ * The bytes are taken off the ring before the file is written, those
+ * a full disk did not take are lost.
+ */
+int
+pipe_splice_out(struct pipe *p, struct fs_fd *fd, size_t len)
+{
+	struct pipe_buf *b;
+	struct PageInfo *pp;
+	uint32_t off;
+	int done = 0, n, ret, err;
+
+	spin_lock(&p->lock);
+	err = pipe_wait_data(p);
+	while (err == 0 && done < len && p->n) {
+		b = &p->bufs[p->head];
+		n = MIN(len - done, b->len);
+		pp = b->pp;
+		off = b->off;
+		spin_lock(&vm_lock);
+		pp->pp_ref++;
+		spin_unlock(&vm_lock);
+		b->off += n;
+		b->len -= n;
+		if (b->len == 0)
+			pipe_pop(p);
+		spin_unlock(&p->lock);
+
+		ret = file_write(fd, (char *)page2kva(pp) + off, n);
+		pipe_put_page(pp);
+		spin_lock(&p->lock);
+		if (ret > 0)
+			done += ret;
+		if (ret < n) {
+			err = ret < 0 ? ret : -STATUS_ENOSPC;
+			break;
+		}
+	}
+	spin_unlock(&p->lock);
+	return done ? done : err;
+}
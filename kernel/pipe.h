@@ -0,0 +1,16 @@
+#ifndef PIPE_H
+#define PIPE_H
+#include <inc/types.h>
+#include <kernel/fs/fs.h>
+
+struct pipe;
+
+void pipe_init(void);
+struct pipe *pipe_alloc(void);
+void pipe_close(struct pipe *p, bool write);
+int pipe_read(struct pipe *p, void *buf, size_t len);
+int pipe_write(struct pipe *p, const void *buf, size_t len);
+int pipe_vmsplice(struct pipe *p, const void *buf, size_t len);
+int pipe_splice_in(struct pipe *p, struct fs_fd *fd, size_t len);
+int pipe_splice_out(struct pipe *p, struct fs_fd *fd, size_t len);
+#endif
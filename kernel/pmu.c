@@ -0,0 +1,228 @@
+/*
+ * Hardware performance counters, the Intel architectural PMU described
+ * by CPUID leaf 0AH.
+ *
+ * One general purpose counter per PERF_* event counts in both rings
+ * all the time.  On every context switch pmu_account() charges what
+ * the counters advanced since the last switch to the task that ran, so
+ * per-task counts cost a few rdmsr per switch and no counter writes.
+ * Without a PMU (e.g. QEMU without KVM) only PERF_CYCLES is counted,
+ * from the TSC.
+ *
+ * For the profiler, fixed counter 1 (unhalted core cycles) is preloaded
+ * to overflow every pmu_period cycles and raises an NMI through the
+ * LAPIC PCINT entry.  Unlike timer samples those also hit the kernel,
+ * which runs with interrupts disabled.
+ */
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/prof.h>
+#include <kernel/pmu.h>
+#include <kernel/vm.h>
+
+#define MSR_IA32_PMC0			0x0c1
+#define MSR_IA32_PERFEVTSEL0		0x186
+#define MSR_CORE_PERF_FIXED_CTR1	0x30a
+#define MSR_CORE_PERF_FIXED_CTR_CTRL	0x38d
+#define MSR_CORE_PERF_GLOBAL_STATUS	0x38e
+#define MSR_CORE_PERF_GLOBAL_CTRL	0x38f
+#define MSR_CORE_PERF_GLOBAL_OVF_CTRL	0x390
+
+// IA32_PERFEVTSELx
+#define EVTSEL_USR		(1 << 16)
+#define EVTSEL_OS		(1 << 17)
+#define EVTSEL_EN		(1 << 22)
+
+// Fixed counter 1 fields of IA32_FIXED_CTR_CTRL and global MSRs
+#define FIXED1_OS		(1 << 4)
+#define FIXED1_USR		(1 << 5)
+#define FIXED1_PMI		(1 << 7)
+#define GLOBAL_FIXED1		(1ULL << 33)
+
+static const struct {
+	uint8_t event;
+	uint8_t umask;
+	int8_t arch;		// CPUID.0AH:EBX bit, -1 if model specific
+} pmu_events[PERF_NEVENTS] = {
+	[PERF_CYCLES]		= { 0x3c, 0x00, 0 },	// UnHalted Core Cycles
+	[PERF_INSTRUCTIONS]	= { 0xc0, 0x00, 1 },	// Instructions Retired
+	[PERF_LLC_MISSES]	= { 0x2e, 0x41, 4 },	// LLC Misses
+	// DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK on Nehalem and later
+	[PERF_DTLB_MISSES]	= { 0x08, 0x01, -1 },
+};
+
+static uint32_t pmu_valid;		// PERF_* events with a counter
+static int pmu_counter[PERF_NEVENTS];	// General purpose counter of each
+static uint64_t pmu_mask;		// Counter width
+static uint64_t pmu_fixed_mask;
+static bool pmu_can_sample;		// Fixed counter 1 and PCINT usable
+
+// Counter values at the last pmu_account() of each CPU
+static uint64_t pmu_last[NCPU][PERF_NEVENTS];
+
+// Sampling period in cycles, 0 if off.  Each CPU reprograms itself on
+// its next timer tick when its pmu_cpu_period differs.
+static volatile uint32_t pmu_period;
+static uint32_t pmu_cpu_period[NCPU];
+
+static uint64_t
+pmu_read(int e)
+{
+	if (pmu_valid & (1 << e))
+		return rdmsr(MSR_IA32_PMC0 + pmu_counter[e]);
+	return read_tsc();
+}
+
+// Every CPU runs this, they all find the same PMU and set the globals
+// to the same values
+void
+pmu_init_percpu(void)
+{
+	uint32_t max, eax, ebx, edx, valid = 0;
+	int c = cpunum(), e, n = 0, version, ngp, veclen;
+
+	cpuid(0, &max, NULL, NULL, NULL);
+	if (max >= 0xa) {
+		cpuid(0xa, &eax, &ebx, NULL, &edx);
+		version = eax & 0xff;
+		ngp = version ? (eax >> 8) & 0xff : 0;
+		veclen = eax >> 24;
+		pmu_mask = (1ULL << ((eax >> 16) & 0xff)) - 1;
+
+		for (e = 0; e < PERF_NEVENTS && n < ngp; e++) {
+			// An EBX bit set means the event is not available
+			if (pmu_events[e].arch >= 0 &&
+			    (pmu_events[e].arch >= veclen ||
+			     (ebx & (1 << pmu_events[e].arch))))
+				continue;
+			pmu_counter[e] = n;
+			valid |= 1 << e;
+			wrmsr(MSR_IA32_PMC0 + n, 0);
+			wrmsr(MSR_IA32_PERFEVTSEL0 + n, pmu_events[e].event |
+			      (pmu_events[e].umask << 8) | EVTSEL_USR |
+			      EVTSEL_OS | EVTSEL_EN);
+			n++;
+		}
+
+		// Version 2 added the global controls and fixed counters
+		pmu_can_sample = version >= 2 && (edx & 0x1f) >= 2;
+		if (version >= 2)
+			wrmsr(MSR_CORE_PERF_GLOBAL_CTRL, ((1ULL << n) - 1) |
+			      (pmu_can_sample ? GLOBAL_FIXED1 : 0));
+		if (pmu_can_sample) {
+			pmu_fixed_mask = (1ULL << ((edx >> 5) & 0xff)) - 1;
+			wrmsr(MSR_CORE_PERF_FIXED_CTR_CTRL, 0);
+			lapic_pcint_nmi();
+		}
+	}
+	pmu_valid = valid;
+	pmu_cpu_period[c] = 0;
+	for (e = 0; e < PERF_NEVENTS; e++)
+		pmu_last[c][e] = pmu_read(e);
+}
+
+// Charge the counts since the last call on this CPU to ts, the idle
+// loop (ts NULL) is charged to nobody.
+void
+pmu_account(struct Task *ts)
+{
+	uint64_t now, delta;
+	int c = cpunum(), e;
+
+	for (e = 0; e < PERF_NEVENTS; e++) {
+		if (e != PERF_CYCLES && !(pmu_valid & (1 << e)))
+			continue;
+		now = pmu_read(e);
+		delta = now - pmu_last[c][e];
+		if (pmu_valid & (1 << e))
+			delta &= pmu_mask;
+		pmu_last[c][e] = now;
+		if (ts)
+			ts->perf[e] += delta;
+	}
+}
+
+static void
+pmu_load_period(uint32_t period)
+{
+	if (period) {
+		wrmsr(MSR_CORE_PERF_FIXED_CTR1, -(uint64_t)period & pmu_fixed_mask);
+		wrmsr(MSR_CORE_PERF_FIXED_CTR_CTRL, FIXED1_OS | FIXED1_USR | FIXED1_PMI);
+	} else
+		wrmsr(MSR_CORE_PERF_FIXED_CTR_CTRL, 0);
+}
+
+// Called from the timer interrupt, picks up a new sampling period
+void
+pmu_tick(void)
+{
+	int c = cpunum();
+
+	if (pmu_can_sample && pmu_cpu_period[c] != pmu_period) {
+		pmu_cpu_period[c] = pmu_period;
+		pmu_load_period(pmu_cpu_period[c]);
+	}
+}
+
+// Take a profiler sample every period cycles on every CPU, 0 stops.
+// Returns -E_INVAL without a usable overflow interrupt.
+int
+pmu_set_period(uint32_t period)
+{
+	if (!pmu_can_sample)
+		return period ? -E_INVAL : 0;
+	pmu_period = period;
+	pmu_tick();
+	return 0;
+}
+
+// NMI handler, runs anywhere in the kernel so it must not take locks
+void
+pmu_nmi(struct Trapframe *tf)
+{
+	uint64_t status;
+	int c = cpunum();
+
+	if (!pmu_can_sample)
+		return;
+	status = rdmsr(MSR_CORE_PERF_GLOBAL_STATUS);
+	if (status & GLOBAL_FIXED1) {
+		if (pmu_cpu_period[c])
+			wrmsr(MSR_CORE_PERF_FIXED_CTR1,
+			      -(uint64_t)pmu_cpu_period[c] & pmu_fixed_mask);
+		prof_sample(tf);
+	}
+	wrmsr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, status);
+	// Delivering the NMI masked PCINT
+	lapic_pcint_nmi();
+}
+
+// Counts of task pid (0 for the caller) up to now
+int
+sys_perf_read(int pid, struct perf_counts *pc)
+{
+	struct perf_counts counts;
+	struct Task *ts;
+	int err;
+
+	if ((err = vm_prefault_array(pc, 1, sizeof(*pc))) < 0)
+		return err;
+	// Counts change on context switches, under tasks_lock, which also
+	// keeps the task from being freed until we are done
+	spin_lock(&tasks_lock);
+	ts = pid ? task_lookup(pid) : thiscpu->cpu_task;
+	if (!ts || (pid && ts->task_id != pid)) {
+		spin_unlock(&tasks_lock);
+		return -E_INVAL;
+	}
+	if (ts == thiscpu->cpu_task)
+		pmu_account(ts);
+	memcpy(counts.count, ts->perf, sizeof(counts.count));
+	counts.valid = pmu_valid | (1 << PERF_CYCLES);
+	err = copyout(pc, &counts, sizeof(counts));
+	spin_unlock(&tasks_lock);
+	return err;
+}
@@ -0,0 +1,15 @@
+#ifndef PMU_H
+#define PMU_H
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/syscall.h>
+
+struct Task;
+
+void pmu_init_percpu(void);
+void pmu_account(struct Task *ts);
+void pmu_tick(void);
+int pmu_set_period(uint32_t period);
+void pmu_nmi(struct Trapframe *tf);
+int sys_perf_read(int pid, struct perf_counts *pc);
+#endif
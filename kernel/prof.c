@@ -0,0 +1,134 @@
+/*
+ * Sampling profiler.  Every timer interrupt, or every n cycles with the
+ * PMU overflow NMI (see pmu.c), records where the CPU was into a ring
+ * of that CPU.  Only the owning CPU writes a ring and only
+ * SYS_prof reads it, so recording needs no lock, readers take
+ * prof_lock among themselves.  A full ring drops new samples.
+ */
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/spinlock.h>
+#include <kernel/prof.h>
+#include <kernel/pmu.h>
+#include <kernel/vm.h>
+
+#define PROF_RING 1024		// Samples per CPU, a power of two
+
+struct prof_ring {
+	struct prof_sample buf[PROF_RING];
+	volatile uint32_t head;	// Next slot to fill, owning CPU only
+	volatile uint32_t tail;	// Next slot to read, under prof_lock
+	volatile uint32_t dropped;
+};
+
+static struct prof_ring prof_rings[NCPU];
+static volatile bool prof_on;
+static volatile bool prof_nmi;		// Sampled by pmu_nmi() instead
+static struct spinlock prof_lock;
+
+void
+prof_init(void)
+{
+	spin_initlock(&prof_lock);
+}
+
+// Record the interrupted frame, also called from NMI
+void
+prof_sample(struct Trapframe *tf)
+{
+	struct prof_ring *r;
+	struct prof_sample *s;
+	struct Task *ts;
+
+	if (!prof_on)
+		return;
+	r = &prof_rings[cpunum()];
+	if (r->head - r->tail >= PROF_RING) {
+		r->dropped++;
+		return;
+	}
+	s = &r->buf[r->head & (PROF_RING - 1)];
+	ts = thiscpu->cpu_task;
+	s->eip = tf->tf_eip;
+	s->pid = ts ? ts->task_id : -1;
+	s->cpu = cpunum();
+	s->user = (tf->tf_cs & 3) == 3;
+	// Fill the slot before publishing it
+	asm volatile("" ::: "memory");
+	r->head++;
+}
+
+// Timer interrupt
+void
+prof_tick(struct Trapframe *tf)
+{
+	if (!prof_nmi)
+		prof_sample(tf);
+}
+
+/*
+ * PROF_START clears the rings and starts sampling, on every timer tick
+ * or every n cycles if n > 0.  PROF_STOP stops it.
+ * PROF_DRAIN moves up to n samples of all CPUs into buf and returns how
+ * many, PROF_DROPPED returns the samples lost to full rings.
+ */
+int
+sys_prof(int op, struct prof_sample *buf, int n)
+{
+	struct prof_ring *r;
+	int c, got = 0, err;
+
+	if (op == PROF_DRAIN) {
+		n = MIN(n, NCPU * PROF_RING);
+		if ((err = vm_prefault_array(buf, n, sizeof(*buf))) < 0)
+			return err;
+	}
+	spin_lock(&prof_lock);
+	switch (op) {
+	case PROF_START:
+		prof_on = false;
+		for (c = 0; c < NCPU; c++) {
+			prof_rings[c].tail = prof_rings[c].head;
+			prof_rings[c].dropped = 0;
+		}
+		if (pmu_set_period(n > 0 ? n : 0) < 0) {
+			got = -1;
+			break;
+		}
+		prof_nmi = n > 0;
+		prof_on = true;
+		break;
+	case PROF_STOP:
+		prof_on = false;
+		prof_nmi = false;
+		pmu_set_period(0);
+		break;
+	case PROF_DRAIN:
+		for (c = 0; c < NCPU && got < n && !err; c++) {
+			r = &prof_rings[c];
+			while (r->tail != r->head && got < n) {
+				err = copyout(&buf[got], &r->buf[r->tail & (PROF_RING - 1)],
+					      sizeof(*buf));
+				if (err < 0)
+					break;
+				got++;
+				// Copy the slot before handing it back
+				asm volatile("" ::: "memory");
+				r->tail++;
+			}
+		}
+		if (!got)
+			got = err;
+		break;
+	case PROF_DROPPED:
+		for (c = 0; c < NCPU; c++)
+			got += prof_rings[c].dropped;
+		break;
+	default:
+		got = -1;
+	}
+	spin_unlock(&prof_lock);
+	return got;
+}
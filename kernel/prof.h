@@ -0,0 +1,11 @@
+#ifndef PROF_H
+#define PROF_H
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/syscall.h>
+
+void prof_init(void);
+void prof_sample(struct Trapframe *tf);
+void prof_tick(struct Trapframe *tf);
+int sys_prof(int op, struct prof_sample *buf, int n);
+#endif
@@ -1,5 +1,7 @@
 #include <inc/assert.h>
 #include <inc/elf.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
 #include <inc/x86.h>
 #include <kernel/task.h>
 
@@ -61,17 +63,62 @@ readseg(uint32_t pa, uint32_t count, uint32_t offset)
 	}
 }
 
+// Pages of the boot user image at UTEXT, read in by the first call of
+// load_elf().  Each holds a reference of its own, so they stay while
+// the first task of every CPU maps them.
+static struct PageInfo *image_pages[UIMAGE_SIZE / PGSIZE];
+static bool image_loaded;
+
+// Copy the bytes of segment ph which fall into the page at va
+static void
+image_fill(uint8_t *binary, struct Proghdr *ph, uintptr_t va)
+{
+	uint8_t *page = page2kva(image_pages[(va - UTEXT) / PGSIZE]);
+	uintptr_t start = MAX(va, ph->p_va);
+	uintptr_t end = MIN(va + PGSIZE, ph->p_va + ph->p_filesz);
+
+	if (start < end)
+		memmove(page + start - va, binary + ph->p_offset + start - ph->p_va,
+			end - start);
+}
+
+/*
+ * Map the image into t.  Read-only segments are shared by every task
+ * running it, writable ones are copied on write (see vm_fault()).
+ * The APs boot one at a time, the first call is the only one to load.
+ */
 void
-load_elf(struct Task *t, uint8_t *binary)
+load_elf(struct Task *t, struct Elf *elf)
 {
-	// LAB 3: Your code here.
-	struct Elf *elf = (struct Elf *)binary;
+	uint8_t *binary = (uint8_t *)elf;
 	struct Proghdr *eph, *ph = (struct Proghdr *) (binary + (elf->e_phoff));
+	uintptr_t va, start, end;
+	int perm, i;
+
 	eph = ph + elf->e_phnum;
-	lcr3(PADDR(t->pgdir));
-	for (; ph < eph; ph++)
-		if (ph->p_type == ELF_PROG_LOAD) {
-			memmove((void *)ph->p_va, binary+ph->p_offset, ph->p_filesz);
-			memset((void *)ph->p_va+ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+	for (; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD || ph->p_memsz == 0)
+			continue;
+		start = ROUNDDOWN(ph->p_va, PGSIZE);
+		end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+		if (start < UTEXT || end > UTEXT + UIMAGE_SIZE)
+			panic("load_elf: segment at %p out of the image", ph->p_va);
+		perm = PTE_U | (ph->p_flags & ELF_PROG_FLAG_WRITE ? PTE_W : 0);
+		if (vm_map(t->mm, start, end - start, VMA_ANON, perm, NULL, 0, 0) < 0)
+			panic("load_elf: can not map the segment at %p", ph->p_va);
+		// The bss past the file contents is zero filled on demand
+		end = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+		for (va = start; va < end; va += PGSIZE) {
+			i = (va - UTEXT) / PGSIZE;
+			if (!image_loaded) {
+				if (!(image_pages[i] = page_alloc(ALLOC_ZERO)))
+					panic("load_elf: out of memory");
+				image_pages[i]->pp_ref++;
+				image_fill(binary, ph, va);
+			}
+			if (vm_share(t->mm, va, image_pages[i]) < 0)
+				panic("load_elf: out of memory");
 		}
+	}
+	image_loaded = true;
 }
@@ -2,93 +2,643 @@
 #include <kernel/task.h>
 #include <kernel/timer.h>
 #include <kernel/spinlock.h>
+#include <kernel/pmu.h>
+#include <kernel/trace.h>
+#include <kernel/vm.h>
 #include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
 
-#define ctx_switch(ts) \
-  do { task_pop_tf(&((ts)->tf)); } while(0)
+/*
+ * Scheduling classes, strongest first:
+ *
+ * SCHED_FIFO tasks run by priority, the one runnable the longest first
+ * among equals, until they block or yield.
+ *
+ * SCHED_NORMAL tasks share the CPU in proportion to the weight of their
+ * nice level.  vruntime is the time a task ran, in TSC cycles scaled by
+ * NICE_0_WEIGHT / weight, and the one with the smallest vruntime runs
+ * next.  Every task gets a slice of sched_latency in proportion to its
+ * weight before it is preempted, or sooner if a task that just woke up
+ * is behind it by more than sched_wakeup_gran.
+ *
+ * SCHED_IDLE tasks share the CPU the same way, but only when nothing
+ * else wants it.
+ *
+ * The tasks are few, so each CPU scans its share of the task table
+ * instead of keeping them sorted.
+ */
+#define NICE_0_WEIGHT		1024
+#define SCHED_LATENCY_MS	30
+#define SCHED_MIN_GRAN_MS	4
+#define SCHED_WAKEUP_GRAN_MS	1
+
+// Weight of nice -20 .. 19, each level is about 10% of CPU time
+static const uint32_t nice_to_weight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15,
+};
+
+// In TSC cycles, see sched_init()
+static uint64_t sched_latency, sched_min_gran, sched_wakeup_gran;
+
+uint32_t
+sched_weight(int nice)
+{
+	return nice_to_weight[nice - NICE_MIN];
+}
+
+// Classes never mix, a task in a stronger one always runs first
+static int
+sched_rank(struct Task *ts)
+{
+	switch (ts->policy) {
+	case SCHED_FIFO:
+		return 2 + ts->prio;
+	case SCHED_NORMAL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Should a run before b, both are runnable on the same CPU
+static bool
+sched_before(struct Task *a, struct Task *b)
+{
+	int ra = sched_rank(a), rb = sched_rank(b);
+
+	if (ra != rb)
+		return ra > rb;
+	// acct.ts is when it became runnable
+	if (a->policy == SCHED_FIFO)
+		return a->acct.ts < b->acct.ts;
+	return a->vruntime < b->vruntime;
+}
+
+// The vruntime sleepers of this CPU are placed against never goes back.
+// SCHED_IDLE tasks run while the others sleep, they do not move it.
+static void
+sched_update_min(struct Task *ts)
+{
+	if (ts->policy == SCHED_NORMAL && ts->vruntime > thiscpu->cpu_min_vruntime)
+		thiscpu->cpu_min_vruntime = ts->vruntime;
+}
+
+// Charge the time ts ran since exec_start to its vruntime
+static void
+sched_update_curr(struct Task *ts, uint64_t now)
+{
+	uint64_t delta = now - ts->exec_start;
+
+	ts->exec_start = now;
+	if (ts->policy != SCHED_FIFO)
+		ts->vruntime += delta * NICE_0_WEIGHT / ts->weight;
+}
+
+/*
+ * Switch from the current task (or the per-CPU idle loop) to ts,
+ * NULL switches to the idle loop, see sched_idle().
+ * The caller holds tasks_lock, whoever resumes us releases it.
+ */
+static void
+ctx_switch(struct Task *ts)
+{
+	struct Task *prev = thiscpu->cpu_task;
+	struct Context **old = prev ? &prev->context : &thiscpu->cpu_context;
+	uint64_t now = read_tsc();
+
+	// prev was in the kernel since its last accounting point.  A task
+	// switched out still runnable was preempted (or yielded), it
+	// waits for a CPU from now on.
+	if (prev) {
+		sched_update_curr(prev, now);
+		prev->acct.stime += now - prev->acct.ts;
+		prev->acct.ts = now;
+		if (prev->state == TASK_RUNNABLE)
+			prev->acct.nivcsw++;
+		else
+			prev->acct.nvcsw++;
+	} else
+		thiscpu->cpu_idle += now - thiscpu->cpu_idle_ts;
+	if (ts) {
+		ts->exec_start = ts->slice_start = now;
+		ts->acct.wait += now - ts->acct.ts;
+		ts->acct.ts = now;
+		ts->acct.cpu = cpunum();
+	} else
+		thiscpu->cpu_idle_ts = now;
+
+	pmu_account(prev);
+	trace(EV_SCHED_SWITCH, prev ? prev->task_id : -1, ts ? ts->task_id : -1);
+	thiscpu->cpu_task = ts;
+	if (ts == NULL) {
+		// Lazy TLB: the idle loop only uses kernel mappings, keep
+		// the page directory of the last task loaded.
+		context_switch(old, thiscpu->cpu_context);
+		return;
+	}
+	// Trap into the top of the new task's kernel stack
+	thiscpu->cpu_tss.ts_esp0 = (uint32_t)ts->kstack + KSTKSIZE;
+	thiscpu->cpu_sysenter_esp0 = thiscpu->cpu_tss.ts_esp0;
+	// Only reload CR3 (and lose the TLB) when the address space
+	// actually changes, e.g. not when we come back from idle.  A
+	// kernel thread keeps the last one like the idle loop.
+	if (ts->mm && thiscpu->cpu_pgdir != ts->mm->pgdir)
+		cpu_load_pgdir(ts->mm->pgdir);
+	if (!ts->kthread)
+		task_load_tls(ts);
+	context_switch(old, ts->context);
+}
 
 extern bool booted;
 
 /*
-* Implement a simple round-robin scheduler (Start with the next one)
-*
-* 1. You have to remember the task you picked last time.
-*
-* 2. If the next task is in TASK_RUNNABLE state, choose
-*    it.
-*
-* 3. After your choice set cur_task to the picked task
-*    and set its state, pick_tick, and change page
-*    directory to its pgdir.
-*
-* 4. CONTEXT SWITCH, leverage the macro ctx_switch(ts)
-*    Please make sure you understand the mechanism.
-*/
+ * Called after ts became runnable.  Tasks are partitioned to CPUs by
+ * task_id, if ts belongs to another CPU send it a reschedule IPI so it
+ * does not wait for its next timer tick.
+ */
+void
+sched_kick(struct Task *ts)
+{
+	int c = ts->task_id % ncpu;
+
+	// It waits for a CPU from now on, see ctx_switch()
+	ts->acct.ts = read_tsc();
+	// A sleeper gets ahead of the others by half a latency at most,
+	// or it could hold the CPU for as long as it slept.
+	if (ts->policy != SCHED_FIFO &&
+	    ts->vruntime + sched_latency / 2 < cpus[c].cpu_min_vruntime)
+		ts->vruntime = cpus[c].cpu_min_vruntime - sched_latency / 2;
+	trace(EV_WAKEUP, ts->task_id, c);
+	// Either way its CPU checks whether ts preempts what runs there
+	if (c == cpunum())
+		thiscpu->cpu_resched = 1;
+	else if (booted)
+		lapic_ipi_cpu(cpus[c].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+/*
+ * Pick the next runnable task of this CPU.  skip is a task that yields,
+ * it is only picked if no other task in its class can run.  Returns
+ * NULL if no task can run, the CPU goes to the idle loop then.
+ */
+static struct Task *
+sched_pick(struct Task *skip)
+{
+	struct Task *ts, *best = NULL;
+	int c = cpunum();
+
+	for (ts = &tasks[c]; ts < &tasks[NR_TASKS]; ts += ncpu)
+		if (ts->state == TASK_RUNNABLE && ts != skip &&
+		    (!best || sched_before(ts, best)))
+			best = ts;
+	if (skip && skip->state == TASK_RUNNABLE &&
+	    (!best || sched_rank(skip) > sched_rank(best)))
+		best = skip;
+	return best;
+}
+
+// Slice of cur out of sched_latency, by its share of the weight of the
+// runnable tasks in its class
+static uint64_t
+sched_slice(struct Task *cur)
+{
+	struct Task *ts;
+	uint64_t load = cur->weight, slice;
+
+	for (ts = &tasks[cpunum()]; ts < &tasks[NR_TASKS]; ts += ncpu)
+		if (ts->state == TASK_RUNNABLE && ts->policy == cur->policy)
+			load += ts->weight;
+	slice = sched_latency * cur->weight / load;
+	return slice > sched_min_gran ? slice : sched_min_gran;
+}
+
+// Should the running task cur give the CPU to another one
+static bool
+sched_preempt(struct Task *cur)
+{
+	struct Task *next = sched_pick(NULL);
+	uint64_t now = read_tsc(), ran;
+
+	sched_update_curr(cur, now);
+	if (next == NULL) {
+		sched_update_min(cur);
+		return false;
+	}
+	if (sched_rank(next) != sched_rank(cur))
+		return sched_rank(next) > sched_rank(cur);
+	if (cur->policy == SCHED_FIFO)
+		return false;
+
+	sched_update_min(next->vruntime < cur->vruntime ? next : cur);
+	ran = now - cur->slice_start;
+	if (ran >= sched_slice(cur))
+		return true;
+	return ran >= sched_min_gran &&
+	       cur->vruntime > next->vruntime + sched_wakeup_gran;
+}
+
+// Run the picked task on this CPU, called with tasks_lock held
+static void
+sched_run(struct Task *ts)
+{
+	// Assert task start form runnable state
+	assert(ts->state == TASK_RUNNABLE);
+
+	ts->state = TASK_RUNNING;
+	sched_update_min(ts);
+	if (ts != thiscpu->cpu_task)
+		ctx_switch(ts);
+	else
+		ts->slice_start = read_tsc();
+}
+
+/*
+ * Give up the CPU, the caller holds tasks_lock and has already changed
+ * the state of the current task.
+ */
+static void
+sched(struct Task *skip)
+{
+	struct Task *ts = sched_pick(skip);
+
+	if (ts)
+		sched_run(ts);
+	else
+		ctx_switch(NULL);
+}
+
+/*
+ * Called on timer ticks and reschedule IPIs, and by a task that already
+ * changed its state to give up the CPU.  Wakes up the sleepers (CPU 0
+ * only), and switches away from the current task if it is no longer
+ * running or sched_preempt() says so.
+ *
+ * Returns when the current task is picked again.
+ */
 void sched_yield(void)
 {
-	int i, j;
 	long jiffies = get_tick();
 
 	if (!booted)
-		task_pop_tf(thiscpu->last_tf);
+		return;
 
-	// start the first task
-	if (thiscpu->cpu_task == 0) {
-		thiscpu->cpu_task = &tasks[cpunum()];
-		lcr3(PADDR(tasks[cpunum()].pgdir));
-		task_pop_tf(&thiscpu->cpu_task->tf);
-	}
+	// Killed on another CPU, we are still on it and its files are safe
+	// to close
+	if (thiscpu->cpu_task && thiscpu->cpu_task->state == TASK_STOP)
+		task_put_stdio(thiscpu->cpu_task);
 
 	spin_lock(&tasks_lock);
+
 	// Wake up tasks
 	if (cpunum() == 0) {
 		struct Task *ts;
-		for (ts = &tasks[ncpu]; ts < &tasks[NR_TASKS]; ++ts) {
+		for (ts = &tasks[0]; ts < &tasks[NR_TASKS]; ++ts) {
 			if (ts->state == TASK_SLEEP) {
-				if (ts->pick_tick - jiffies <= 0)
+				if (ts->pick_tick - jiffies <= 0) {
 					ts->state = TASK_RUNNABLE;
+					sched_kick(ts);
+				}
+			} else if (ts->state == TASK_WAIT && ts->wq_timed &&
+				   ts->pick_tick - jiffies <= 0) {
+				wq_remove(ts);
+				ts->wq_timed = false;
+				ts->state = TASK_RUNNABLE;
+				sched_kick(ts);
 			}
 		}
 	}
 
+	// Whoever was woken up is considered below
+	thiscpu->cpu_resched = 0;
+
+	// Interrupted the idle loop, it picks the next task itself
+	if (thiscpu->cpu_task == NULL) {
+		spin_unlock(&tasks_lock);
+		return;
+	}
+
+	// We are still on its kernel stack, which is not freed until the
+	// slot is reused, and that needs tasks_lock.
 	if (thiscpu->cpu_task->state == TASK_STOP)
 		task_free(thiscpu->cpu_task->task_id);
 
 	// Test task should be preempted?
 	if (thiscpu->cpu_task->state == TASK_RUNNING) {
-		if ((thiscpu->cpu_task->pick_tick - jiffies <= 0) || (thiscpu->cpu_task->task_id < ncpu))
+		if (sched_preempt(thiscpu->cpu_task))
 			thiscpu->cpu_task->state = TASK_RUNNABLE;
-		else
-			ctx_switch(thiscpu->cpu_task);
+		else {
+			spin_unlock(&tasks_lock);
+			return;
+		}
 	}
 
-	// Find current task
-	// My implement 'task_id = i = &tasks[i] - &tasks[0]'
-	i = thiscpu->cpu_task->task_id;
+	sched(NULL);
+	spin_unlock(&tasks_lock);
+}
 
-	// Skip idle task
-	if (i < ncpu)
-		i = ncpu + cpunum();
+// Give up the rest of the time slice, returns at once if nothing
+// else can run on this CPU.
+void sys_yield(void)
+{
+	spin_lock(&tasks_lock);
+	thiscpu->cpu_task->state = TASK_RUNNABLE;
+	sched(thiscpu->cpu_task);
+	spin_unlock(&tasks_lock);
+}
 
-	// Search from the next task
-	j = i;
-	do {
-		i += ncpu;
-		if (i >= NR_TASKS)
-			i = i - NR_TASKS + ncpu;
-	} while ((tasks[i].state != TASK_RUNNABLE) && (i != j));
+/*
+ * Per-CPU idle loop, runs on the boot stack of the CPU once it is
+ * booted.  Halts until an interrupt when there is nothing to run, so
+ * a CPU whose tasks are all blocked does not burn cycles.
+ */
+void sched_idle(void)
+{
+	struct Task *ts;
 
-	// No runnable task is found, select idle task
-	if (tasks[i].state != TASK_RUNNABLE)
-		i = cpunum();
+	thiscpu->cpu_idle_ts = read_tsc();
+	for (;;) {
+		spin_lock(&tasks_lock);
+		if ((ts = sched_pick(NULL)) != NULL) {
+			sched_run(ts);
+			// Back from sched() with nothing runnable
+			spin_unlock(&tasks_lock);
+			continue;
+		}
+		spin_unlock(&tasks_lock);
 
-	// Assert task start form runnable state
-	assert(tasks[i].state == TASK_RUNNABLE);
+		// Wait for an interrupt to make some task runnable
+		asm volatile("sti; hlt; cli");
+	}
+}
+
+void
+sched_init(void)
+{
+	uint64_t khz = vclock_page.vc.tsc_khz;
+
+	// Guess 1 GHz if the TSC could not be calibrated
+	if (khz == 0)
+		khz = 1000000;
+	sched_latency = SCHED_LATENCY_MS * khz;
+	sched_min_gran = SCHED_MIN_GRAN_MS * khz;
+	sched_wakeup_gran = SCHED_WAKEUP_GRAN_MS * khz;
+}
+
+/*
+ * Move task pid (0 for the caller) to class policy, prio is the nice
+ * level of SCHED_NORMAL and SCHED_IDLE, 1 .. 99 for SCHED_FIFO.
+ */
+int
+sys_sched_setscheduler(int pid, int policy, int prio)
+{
+	struct Task *ts = pid ? task_lookup(pid) : thiscpu->cpu_task;
+
+	if (policy == SCHED_FIFO) {
+		if (prio < RT_PRIO_MIN || prio > RT_PRIO_MAX)
+			return -E_INVAL;
+	} else if (policy == SCHED_NORMAL || policy == SCHED_IDLE) {
+		if (prio < NICE_MIN || prio > NICE_MAX)
+			return -E_INVAL;
+	} else
+		return -E_INVAL;
+	if (!ts)
+		return -E_INVAL;
+
+	spin_lock(&tasks_lock);
+	if (ts == thiscpu->cpu_task)
+		sched_update_curr(ts, read_tsc());
+	ts->policy = policy;
+	ts->prio = prio;
+	ts->weight = policy == SCHED_FIFO ? NICE_0_WEIGHT : sched_weight(prio);
+	// Leaving SCHED_FIFO, join the others where they are
+	if (policy != SCHED_FIFO &&
+	    ts->vruntime < cpus[ts->task_id % ncpu].cpu_min_vruntime)
+		ts->vruntime = cpus[ts->task_id % ncpu].cpu_min_vruntime;
+	spin_unlock(&tasks_lock);
+	// We may no longer be the one to run
+	thiscpu->cpu_resched = 1;
+	return 0;
+}
+
+/***** Accounting *****/
+
+/*
+ * acct.ts of a task is its last accounting point.  The time since then
+ * is charged at the next boundary to what the task was doing: user
+ * mode when it traps, kernel when it returns to user mode or is
+ * switched out, waiting when it is switched in.
+ */
+void
+acct_user_enter(struct Task *ts)
+{
+	uint64_t now = read_tsc();
+
+	ts->acct.utime += now - ts->acct.ts;
+	ts->acct.ts = now;
+}
+
+void
+acct_user_exit(struct Task *ts)
+{
+	uint64_t now = read_tsc();
+
+	ts->acct.stime += now - ts->acct.ts;
+	ts->acct.ts = now;
+}
+
+int
+sys_task_stat(struct task_stat *buf, int n)
+{
+	struct task_stat st;
+	struct Task *ts;
+	int i = 0, err;
+
+	n = MIN(n, NR_TASKS);
+	if ((err = vm_prefault_array(buf, n, sizeof(*buf))) < 0)
+		return err;
+	spin_lock(&tasks_lock);
+	// Bring our own times up to date, the other tasks are only as
+	// current as their last accounting point.
+	acct_user_exit(thiscpu->cpu_task);
+	for (ts = tasks; ts < &tasks[NR_TASKS] && i < n; ts++) {
+		if (ts->state == TASK_FREE)
+			continue;
+		st.pid = ts->task_id;
+		st.ppid = ts->parent_id;
+		st.state = ts->state;
+		st.cpu = ts->acct.cpu;
+		st.policy = ts->policy;
+		st.prio = ts->prio;
+		st.utime = ts->acct.utime;
+		st.stime = ts->acct.stime;
+		st.wait = ts->acct.wait;
+		st.nvcsw = ts->acct.nvcsw;
+		st.nivcsw = ts->acct.nivcsw;
+		st.nsyscalls = ts->acct.nsyscalls;
+		st.npgfaults = ts->acct.npgfaults;
+		memcpy(st.name, ts->name, sizeof(st.name));
+		if ((err = copyout(&buf[i], &st, sizeof(st))) < 0)
+			break;
+		i++;
+	}
+	spin_unlock(&tasks_lock);
+	return i ? i : err;
+}
+
+int
+sys_cpu_stat(struct cpu_stat *buf, int n)
+{
+	struct cpu_stat st;
+	uint64_t now;
+	int c, err;
+
+	n = MIN(n, ncpu);
+	if ((err = vm_prefault_array(buf, n, sizeof(*buf))) < 0)
+		return err;
+	spin_lock(&tasks_lock);
+	now = read_tsc();
+	for (c = 0; c < ncpu && c < n; c++) {
+		st.idle = cpus[c].cpu_idle;
+		// Add the current stretch of a CPU sitting in the idle loop
+		if (cpus[c].cpu_task == NULL && cpus[c].cpu_idle_ts &&
+		    now > cpus[c].cpu_idle_ts)
+			st.idle += now - cpus[c].cpu_idle_ts;
+		st.tsc = now;
+		if ((err = copyout(&buf[c], &st, sizeof(st))) < 0)
+			break;
+	}
+	spin_unlock(&tasks_lock);
+	return c ? c : err;
+}
 
-	thiscpu->cpu_task = &tasks[i];
-	thiscpu->cpu_task->state = TASK_RUNNING;
-	thiscpu->cpu_task->pick_tick = get_tick() + (i < ncpu) ? 0 : TIME_QUANT;
+/***** Wait queues *****/
+
+void
+wq_init(struct wait_queue *wq)
+{
+	wq->head = wq->tail = NULL;
+}
+
+/*
+ * Block the current task on wq.  lk protects the condition the caller
+ * waits for, it is released while sleeping and held again on return.
+ * It may be tasks_lock itself.  The caller should test the condition
+ * again after waking up.
+ */
+void
+wq_sleep(struct wait_queue *wq, struct spinlock *lk)
+{
+	wq_sleep_timeout(wq, lk, 0);
+}
+
+/*
+ * wq_sleep() for at most ticks timer ticks, or for ever if ticks is 0.
+ * Returns -STATUS_ETIMEDOUT if nobody woke us up in time.
+ */
+int
+wq_sleep_timeout(struct wait_queue *wq, struct spinlock *lk, int32_t ticks)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	int err = 0;
+
+	// Once we hold tasks_lock no wakeup can be missed, because
+	// wq_wake_*() needs it as well.
+	if (lk != &tasks_lock) {
+		spin_lock(&tasks_lock);
+		if (lk)
+			spin_unlock(lk);
+	}
+
+	cur->state = TASK_WAIT;
+	cur->wq = wq;
+	cur->task_link = NULL;
+	if (wq->tail)
+		wq->tail->task_link = cur;
+	else
+		wq->head = cur;
+	wq->tail = cur;
+	// CPU 0 takes us off the queue once the tick passed, see sched_yield()
+	if (ticks > 0) {
+		cur->pick_tick = get_tick() + ticks;
+		cur->wq_timed = true;
+	}
+
+	sched(NULL);
+
+	if (ticks > 0 && !cur->wq_timed)
+		err = -STATUS_ETIMEDOUT;
+	cur->wq_timed = false;
+	if (lk != &tasks_lock) {
+		spin_unlock(&tasks_lock);
+		if (lk)
+			spin_lock(lk);
+	}
+	return err;
+}
+
+// Called with tasks_lock held
+void
+wq_wake(struct wait_queue *wq, bool all)
+{
+	struct Task *ts;
+
+	while ((ts = wq->head) != NULL) {
+		wq->head = ts->task_link;
+		if (wq->head == NULL)
+			wq->tail = NULL;
+		ts->task_link = NULL;
+		ts->wq = NULL;
+		ts->state = TASK_RUNNABLE;
+		sched_kick(ts);
+		if (!all)
+			break;
+	}
+}
+
+void
+wq_wake_one(struct wait_queue *wq)
+{
+	spin_lock(&tasks_lock);
+	wq_wake(wq, false);
 	spin_unlock(&tasks_lock);
-	lcr3(PADDR(thiscpu->cpu_task->pgdir));
-	ctx_switch(thiscpu->cpu_task);
+}
+
+void
+wq_wake_all(struct wait_queue *wq)
+{
+	spin_lock(&tasks_lock);
+	wq_wake(wq, true);
+	spin_unlock(&tasks_lock);
+}
+
+/*
+ * Take a waiting task off its queue, e.g. when it is killed.
+ * Called with tasks_lock held.
+ */
+void
+wq_remove(struct Task *ts)
+{
+	struct wait_queue *wq = ts->wq;
+	struct Task **pp, *prev = NULL;
+
+	if (wq == NULL)
+		return;
+	for (pp = &wq->head; *pp; prev = *pp, pp = &(*pp)->task_link) {
+		if (*pp == ts) {
+			*pp = ts->task_link;
+			if (wq->tail == ts)
+				wq->tail = prev;
+			break;
+		}
+	}
+	ts->task_link = NULL;
+	ts->wq = NULL;
 }
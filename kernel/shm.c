@@ -0,0 +1,157 @@
+/*
+ * Shared memory segments: pages allocated once by shm_create() and
+ * mapped by shm_map() into every task which asks for the segment, as a
+ * VMA_SHM region (see vm.c).  The tasks then talk through plain loads
+ * and stores, and futexes when one has to wait for the other.
+ *
+ * A segment is named by its index in shms[] and lives until it was
+ * removed with shm_remove() and the last region mapping it is gone.
+ *
+ * A segment created with SHM_HUGE is made of 4MB pages and mapped as a
+ * huge region.
+ */
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/mem.h>
+#include <kernel/vm.h>
+#include <kernel/shm.h>
+
+#define NSHM		8
+#define SHM_MAXPAGES	16
+
+// The counts are protected by vm_lock, as the regions using them
+struct shm {
+	int ref;		// Regions, plus one until removed, 0 if free
+	bool removed;
+	bool huge;		// pages[] are 4MB pages
+	int npages;
+	struct PageInfo *pages[SHM_MAXPAGES];
+};
+
+static struct shm shms[NSHM];
+
+// Called with vm_lock held
+void
+shm_dup(struct shm *s)
+{
+	s->ref++;
+}
+
+// Called with vm_lock held, frees the pages with the last reference
+void
+shm_put(struct shm *s)
+{
+	int i;
+
+	if (--s->ref > 0)
+		return;
+	for (i = 0; i < s->npages; i++)
+		page_decref(s->pages[i]);
+	s->npages = 0;
+}
+
+// The page with the i-th 4KB of s, the first page of a 4MB one
+struct PageInfo *
+shm_page(struct shm *s, int i)
+{
+	return s->pages[s->huge ? i / NPTENTRIES : i];
+}
+
+/*
+ * A new segment of size bytes, zeroed, of 4MB pages if flags has
+ * SHM_HUGE.  Returns its id, -STATUS_ENOSPC if all are in use or
+ * -STATUS_ENOMEM.
+ */
+int
+sys_shm_create(size_t size, int flags)
+{
+	struct PageInfo *pages[SHM_MAXPAGES];
+	struct shm *s;
+	bool huge = flags & SHM_HUGE;
+	size_t pgsize = huge ? PTSIZE : PGSIZE;
+	int i, n = ROUNDUP(size, pgsize) / pgsize;
+
+	if (size == 0 || size > SHM_MAXPAGES * pgsize || (flags & ~SHM_HUGE))
+		return -STATUS_EINVAL;
+	for (i = 0; i < n; i++) {
+		if (huge)
+			pages[i] = page_alloc_huge(ALLOC_ZERO);
+		else
+			pages[i] = page_alloc(ALLOC_ZERO);
+		if (pages[i] == NULL)
+			break;
+		pages[i]->pp_ref++;
+	}
+	spin_lock(&vm_lock);
+	for (s = shms; s < shms + NSHM && i == n; s++) {
+		if (s->ref == 0) {
+			s->ref = 1;
+			s->removed = false;
+			s->huge = huge;
+			s->npages = n;
+			memcpy(s->pages, pages, n * sizeof(pages[0]));
+			spin_unlock(&vm_lock);
+			return s - shms;
+		}
+	}
+	while (i > 0)
+		page_decref(pages[--i]);
+	spin_unlock(&vm_lock);
+	return s == shms + NSHM ? -STATUS_ENOSPC : -STATUS_ENOMEM;
+}
+
+// A segment still open for shm_map(), with vm_lock held, or NULL
+static struct shm *
+shm_lookup(int id)
+{
+	struct shm *s;
+
+	if (id < 0 || id >= NSHM)
+		return NULL;
+	s = &shms[id];
+	spin_lock(&vm_lock);
+	if (s->ref == 0 || s->removed) {
+		spin_unlock(&vm_lock);
+		return NULL;
+	}
+	return s;
+}
+
+// Map the segment id writable into the caller, returns its address
+int
+sys_shm_map(int id)
+{
+	struct Task *cur = thiscpu->cpu_task;
+	struct shm *s;
+	uintptr_t va;
+	int err;
+
+	if ((s = shm_lookup(id)) == NULL)
+		return -STATUS_EINVAL;
+	// Held by us until the region has its own reference
+	shm_dup(s);
+	spin_unlock(&vm_lock);
+	err = vm_map_free(cur->mm, s->npages * (s->huge ? PTSIZE : PGSIZE),
+			  VMA_SHM, PTE_U | PTE_W, s->huge, s, &va);
+	spin_lock(&vm_lock);
+	shm_put(s);
+	spin_unlock(&vm_lock);
+	return err < 0 ? err : va;
+}
+
+// No more shm_map() of id, it is freed with the last mapping
+int
+sys_shm_remove(int id)
+{
+	struct shm *s;
+
+	if ((s = shm_lookup(id)) == NULL)
+		return -STATUS_EINVAL;
+	s->removed = true;
+	shm_put(s);
+	spin_unlock(&vm_lock);
+	return 0;
+}
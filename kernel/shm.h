@@ -0,0 +1,14 @@
+#ifndef SHM_H
+#define SHM_H
+#include <inc/types.h>
+
+struct shm;
+struct PageInfo;
+
+void shm_dup(struct shm *s);
+void shm_put(struct shm *s);
+struct PageInfo *shm_page(struct shm *s, int i);
+int sys_shm_create(size_t size, int flags);
+int sys_shm_map(int id);
+int sys_shm_remove(int id);
+#endif
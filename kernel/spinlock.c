@@ -5,8 +5,10 @@
 #include <inc/x86.h>
 #include <inc/memlayout.h>
 #include <inc/string.h>
+#include <inc/syscall.h>
 #include <kernel/cpu.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -31,18 +33,78 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->owner != lock->next && lock->cpu == thiscpu;
 }
 #endif
 
-void
-__spin_initlock(struct spinlock *lk, char *name)
+#ifdef SPINLOCK_STATS
+// Every initialized lock, for SYS_lockstat.  An array of locks, like
+// the buckets of a hash table, is one entry of n locks stride bytes
+// apart whose statistics add up.
+struct lockstat_entry {
+	struct spinlock *lk;
+	int n;
+	size_t stride;
+};
+
+static struct lockstat_entry lockstat_locks[NLOCKSTAT];
+static volatile uint32_t nlockstat;
+
+static void
+lockstat_register(struct spinlock *lk, int n, size_t stride)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	uint32_t i;
+
+	for (i = 0; i < nlockstat && i < NLOCKSTAT; i++)
+		if (lockstat_locks[i].lk == lk)
+			return;
+	i = xadd(&nlockstat, 1);
+	if (i < NLOCKSTAT) {
+		lockstat_locks[i].n = n;
+		lockstat_locks[i].stride = stride;
+		lockstat_locks[i].lk = lk;
+	}
+}
+#endif
+
+static void
+spin_initlock_stats(struct spinlock *lk, char *name)
+{
+	lk->next = 0;
+	lk->owner = 0;
 	lk->name = name;
+#ifdef DEBUG_SPINLOCK
 	lk->cpu = 0;
 #endif
+#ifdef SPINLOCK_STATS
+	lk->acquisitions = 0;
+	lk->contended = 0;
+	lk->spin_cycles = 0;
+	lk->max_hold = 0;
+#endif
+}
+
+void
+__spin_initlock(struct spinlock *lk, char *name)
+{
+	spin_initlock_stats(lk, name);
+#ifdef SPINLOCK_STATS
+	lockstat_register(lk, 1, 0);
+#endif
+}
+
+// Initialize n locks stride bytes apart, counted as one by SYS_lockstat
+void
+__spin_initlock_array(struct spinlock *lk, int n, size_t stride, char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		spin_initlock_stats((struct spinlock *)((char *)lk + i * stride),
+				    name);
+#ifdef SPINLOCK_STATS
+	lockstat_register(lk, n, stride);
+#endif
 }
 
 // Acquire the lock.
@@ -57,11 +119,30 @@ spin_lock(struct spinlock *lk)
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
+	// Take a ticket, the xadd is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	unsigned ticket = xadd(&lk->next, 1);
+
+	if (lk->owner != ticket) {
+#ifdef SPINLOCK_STATS
+		uint64_t spin_start = read_tsc();
+#endif
+		// Only the read of owner is shared by the waiters, the
+		// holder writes it once on release.
+		while (lk->owner != ticket) {
+			asm volatile ("pause" ::: "memory");
+			tlb_shootdown_poll();
+		}
+#ifdef SPINLOCK_STATS
+		lk->contended++;
+		lk->spin_cycles += read_tsc() - spin_start;
+#endif
+	}
+#ifdef SPINLOCK_STATS
+	lk->acquisitions++;
+	lk->hold_start = read_tsc();
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -87,15 +168,162 @@ spin_unlock(struct spinlock *lk)
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
+#ifdef SPINLOCK_STATS
+	uint64_t hold = read_tsc() - lk->hold_start;
+	if (hold > lk->max_hold)
+		lk->max_hold = hold;
+#endif
+
+	// Hand the lock to the next ticket.  Only the holder writes
+	// owner, so a plain store is enough: the 2007 Intel 64
+	// Architecture Memory Ordering White Paper says that Intel 64
+	// and IA-32 will not move a load after a store.  The compiler
+	// barrier keeps gcc from sinking the critical section below it.
+	asm volatile ("" ::: "memory");
+	lk->owner++;
+}
+
+#ifdef SPINLOCK_STATS
+/*
+ * Copy the statistics of up to n locks to st, and clear them if
+ * reset is set.  Returns the number of entries filled.
+ */
+int
+spin_lockstat(struct lockstat *st, int n, bool reset)
+{
+	int i, j, cnt = MIN(nlockstat, NLOCKSTAT), err;
+	struct lockstat_entry *e;
+	struct spinlock *lk;
+	struct lockstat s;
+
+	n = MIN(n, cnt);
+	if ((err = vm_prefault_array(st, n, sizeof(*st))) < 0)
+		return err;
+	for (i = 0; i < cnt; i++) {
+		e = &lockstat_locks[i];
+		memset(&s, 0, sizeof(s));
+		strlcpy(s.name, e->lk->name, sizeof(s.name));
+		for (j = 0; j < e->n; j++) {
+			lk = (struct spinlock *)((char *)e->lk + j * e->stride);
+			s.acquisitions += lk->acquisitions;
+			s.contended += lk->contended;
+			s.spin_cycles += lk->spin_cycles;
+			s.max_hold = MAX(s.max_hold, lk->max_hold);
+			if (reset) {
+				lk->acquisitions = 0;
+				lk->contended = 0;
+				lk->spin_cycles = 0;
+				lk->max_hold = 0;
+			}
+		}
+		// Keep resetting the rest if the copy fails
+		if (i < n && !err)
+			err = copyout(&st[i], &s, sizeof(s));
+	}
+	return err < 0 ? err : n;
+}
+#else
+int
+spin_lockstat(struct lockstat *st, int n, bool reset)
+{
+	return 0;
+}
+#endif
+
+/***** Reader-writer locks *****/
+
+void
+__rw_initlock(struct rwlock *rw, char *name)
+{
+	rw->cnt = 0;
+	rw->name = name;
+}
+
+void
+read_lock(struct rwlock *rw)
+{
+	for (;;) {
+		while (rw->cnt & RW_WRITER) {
+			asm volatile ("pause" ::: "memory");
+			tlb_shootdown_poll();
+		}
+		if ((xadd(&rw->cnt, 1) & RW_WRITER) == 0)
+			return;
+		// Lost against a writer, back out and wait again
+		xadd(&rw->cnt, -1);
+	}
+}
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+void
+read_unlock(struct rwlock *rw)
+{
+	xadd(&rw->cnt, -1);
+}
+
+void
+write_lock(struct rwlock *rw)
+{
+	for (;;) {
+		while (rw->cnt != 0) {
+			asm volatile ("pause" ::: "memory");
+			tlb_shootdown_poll();
+		}
+		if (cmpxchg(&rw->cnt, 0, RW_WRITER) == 0)
+			return;
+	}
+}
+
+void
+write_unlock(struct rwlock *rw)
+{
+	// Readers may be backing out their count right now, so don't
+	// just store 0.
+	xadd(&rw->cnt, -RW_WRITER);
+}
+
+/***** Sequence locks *****/
+
+void
+__seq_initlock(struct seqlock *sl, char *name)
+{
+	sl->seq = 0;
+	__spin_initlock(&sl->lock, name);
+}
+
+unsigned
+read_seqbegin(struct seqlock *sl)
+{
+	unsigned seq;
+
+	while ((seq = sl->seq) & 1) {
+		asm volatile ("pause" ::: "memory");
+		tlb_shootdown_poll();
+	}
+	// x86 does not reorder loads with other loads, keep gcc
+	// from doing it.
+	asm volatile ("" ::: "memory");
+	return seq;
+}
+
+bool
+read_seqretry(struct seqlock *sl, unsigned start)
+{
+	asm volatile ("" ::: "memory");
+	return sl->seq != start;
+}
+
+void
+write_seqlock(struct seqlock *sl)
+{
+	spin_lock(&sl->lock);
+	sl->seq++;
+	asm volatile ("" ::: "memory");
+}
+
+void
+write_sequnlock(struct seqlock *sl)
+{
+	asm volatile ("" ::: "memory");
+	sl->seq++;
+	spin_unlock(&sl->lock);
 }
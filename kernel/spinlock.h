@@ -6,22 +6,81 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Comment this to disable per-lock statistics (see SYS_lockstat)
+#define SPINLOCK_STATS
+
+// Maximum number of locks tracked for SYS_lockstat
+#define NLOCKSTAT	32
+
 // Mutual exclusion lock.
+// A ticket lock: CPUs take a ticket from next and spin until owner
+// reaches it, so the lock is handed out in FIFO order.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile unsigned next;        // Next ticket to hand out
+	volatile unsigned owner;       // Ticket allowed to hold the lock
+	char *name;                    // Name of lock.
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
+
+#ifdef SPINLOCK_STATS
+	uint32_t acquisitions;         // Times the lock was taken
+	uint32_t contended;            // Times we had to wait for it
+	uint64_t spin_cycles;          // TSC cycles spent waiting
+	uint64_t max_hold;             // Longest hold in TSC cycles
+	uint64_t hold_start;           // TSC when the lock was taken
+#endif
+};
+
+// Reader-writer spin lock for read-mostly data, any number of readers
+// or one writer.  Readers count in the low bits of cnt.
+struct rwlock {
+	volatile uint32_t cnt;
+	char *name;
 };
 
+#define RW_WRITER	0x80000000
+
+// Sequence lock, readers never write the shared line and retry if a
+// writer ran meanwhile:
+//
+//	do {
+//		seq = read_seqbegin(&sl);
+//		... copy the data ...
+//	} while (read_seqretry(&sl, seq));
+//
+// Writers serialize on the spinlock.
+struct seqlock {
+	volatile unsigned seq;         // Odd while a writer is active
+	struct spinlock lock;
+};
+
+struct lockstat;
+
 void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock_array(struct spinlock *lk, int n, size_t stride,
+			   char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+int spin_lockstat(struct lockstat *st, int n, bool reset);
+
+void __rw_initlock(struct rwlock *rw, char *name);
+void read_lock(struct rwlock *rw);
+void read_unlock(struct rwlock *rw);
+void write_lock(struct rwlock *rw);
+void write_unlock(struct rwlock *rw);
+
+void __seq_initlock(struct seqlock *sl, char *name);
+unsigned read_seqbegin(struct seqlock *sl);
+bool read_seqretry(struct seqlock *sl, unsigned start);
+void write_seqlock(struct seqlock *sl);
+void write_sequnlock(struct seqlock *sl);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
+#define rw_initlock(lock)     __rw_initlock(lock, #lock)
+#define seq_initlock(lock)    __seq_initlock(lock, #lock)
 #endif
@@ -4,9 +4,11 @@
 #include <kernel/cpu.h>
 #include <kernel/task.h>
 #include <kernel/timer.h>
-
-// kernel/screen.c
-extern void putch(unsigned char c);
+#include <kernel/prof.h>
+#include <kernel/pmu.h>
+#include <kernel/trace.h>
+#include <kernel/futex.h>
+#include <kernel/shm.h>
 
 // kernel/kbd.c
 extern int getc(void);
@@ -14,14 +16,20 @@ extern int getc(void);
 // kernel/sched.c
 extern void sched_yield(void);
 
+// kernel/fs/fs_syscall.c
+extern int sys_write(int fd, const void *buf, size_t len);
+extern int sys_pipe(int *fds);
+extern int sys_dup2(int fd, int std);
+extern int sys_splice(int in, int out, size_t len);
+extern int sys_vmsplice(int fd, const void *buf, size_t len);
+
 static void
 do_puts(char *str, uint32_t len)
 {
-	uint32_t i;
-	for (i = 0; i < len; i++)
-	{
-		putch(str[i]);
-	}
+	// The console, or the pipe of a program in a pipeline.  sys_write()
+	// copies str in, it is user memory.
+	if (len)
+		sys_write(STDOUT_FILENO, str, len);
 }
 
 static int32_t
@@ -97,19 +105,104 @@ do_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a
 	case SYS_readdir:
 		retVal = sys_readdir((const char *)a1);
 		break;
+	case SYS_lockstat:
+		retVal = spin_lockstat((struct lockstat *)a1, a2, a3);
+		break;
+	case SYS_yield:
+		sys_yield();
+		break;
+	case SYS_clock_gettime:
+		retVal = sys_clock_gettime(a1, (struct timespec *)a2);
+		break;
+	case SYS_prof:
+		retVal = sys_prof(a1, (struct prof_sample *)a2, a3);
+		break;
+	case SYS_perf_read:
+		retVal = sys_perf_read(a1, (struct perf_counts *)a2);
+		break;
+	case SYS_ktrace:
+		retVal = sys_ktrace(a1, (struct trace_event *)a2, a3);
+		break;
+	case SYS_task_stat:
+		retVal = sys_task_stat((struct task_stat *)a1, a2);
+		break;
+	case SYS_cpu_stat:
+		retVal = sys_cpu_stat((struct cpu_stat *)a1, a2);
+		break;
+	case SYS_sched_setscheduler:
+		retVal = sys_sched_setscheduler(a1, a2, a3);
+		break;
+	case SYS_exec:
+		retVal = sys_exec((const char *)a1, (char *const *)a2);
+		break;
+	case SYS_spawn:
+		retVal = sys_spawn((const char *)a1, (char *const *)a2);
+		break;
+	case SYS_vfork:
+		retVal = sys_vfork();
+		break;
+	case SYS_clone:
+		retVal = sys_clone((void *)a1, (void *)a2);
+		break;
+	case SYS_futex_wait:
+		retVal = sys_futex_wait((volatile uint32_t *)a1, a2, a3);
+		break;
+	case SYS_futex_wake:
+		retVal = sys_futex_wake((volatile uint32_t *)a1, a2);
+		break;
+	case SYS_pipe:
+		retVal = sys_pipe((int *)a1);
+		break;
+	case SYS_dup2:
+		retVal = sys_dup2(a1, a2);
+		break;
+	case SYS_splice:
+		retVal = sys_splice(a1, a2, a3);
+		break;
+	case SYS_vmsplice:
+		retVal = sys_vmsplice(a1, (const void *)a2, a3);
+		break;
+	case SYS_shm_create:
+		retVal = sys_shm_create(a1, a2);
+		break;
+	case SYS_shm_map:
+		retVal = sys_shm_map(a1);
+		break;
+	case SYS_shm_remove:
+		retVal = sys_shm_remove(a1);
+		break;
+	case SYS_sbrk:
+		retVal = sys_sbrk(a1);
+		break;
+	case SYS_mmap:
+		retVal = sys_mmap((void *)a1, a2, a3, a4);
+		break;
+	case SYS_munmap:
+		retVal = sys_munmap((void *)a1, a2);
+		break;
 	default:
 		return -1;
 	}
 	return retVal;
 }
 
+// Entered through sysenter, reg_esi holds the user return address
+// instead of a5 (see lib/syscall.c).
 void
 syscall_dispatch(struct Trapframe *tf)
 {
-	tf->tf_regs.reg_eax = do_syscall(tf->tf_regs.reg_eax,
+	int num = tf->tf_regs.reg_eax;
+
+	thiscpu->cpu_task->acct.nsyscalls++;
+	trace(EV_SYSCALL_ENTER, num, tf->tf_regs.reg_edx);
+	tf->tf_regs.reg_eax = do_syscall(num,
 		tf->tf_regs.reg_edx,
 		tf->tf_regs.reg_ecx,
 		tf->tf_regs.reg_ebx,
 		tf->tf_regs.reg_edi,
 		tf->tf_regs.reg_esi);
+	trace(EV_SYSCALL_EXIT, num, tf->tf_regs.reg_eax);
+	// Killed while it slept in there
+	if (thiscpu->cpu_task->killed)
+		sys_kill(0);
 }
@@ -10,6 +10,7 @@
 #include <kernel/timer.h>
 #include <kernel/mem.h>
 #include <kernel/spinlock.h>
+#include <kernel/fs/fs.h>
 
 // Global descriptor table.
 //
@@ -26,7 +27,10 @@
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-static struct Segdesc gdt[NCPU + 5] =
+// This is only the template, each CPU loads its own copy (see
+// gdt_init_percpu()) with its TSS and per-CPU data segment filled in.
+//
+static struct Segdesc gdt[(GD_TLS >> 3) + 1] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -43,22 +47,35 @@ static struct Segdesc gdt[NCPU + 5] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W , 0x0, 0xffffffff, 3),
 
-	// First TSS descriptors (starting from GD_TSS0) are initialized
-	// in task_init()
-	[GD_TSS0 >> 3] = SEG_NULL
-	
-};
+	// TSS descriptor is initialized in task_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL,
 
-static struct Pseudodesc gdt_pd = {
-	sizeof(gdt) - 1, (unsigned long) gdt
+	// Per-CPU data segment, based at cpus[c] in gdt_init_percpu()
+	[GD_PERCPU >> 3] = SEG_NULL,
+
+	// User %gs, based at the TLS of the running task
+	[GD_TLS >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3)
 };
 
+static struct Segdesc percpu_gdt[NCPU][(GD_TLS >> 3) + 1];
+
 static struct Task *task_free_list;
 struct Task tasks[NR_TASKS];
 
+// Per-task kernel stacks.  A task traps into the top of its own stack,
+// see sched_yield() for how TSS esp0 follows the running task.
+static unsigned char task_kstacks[NR_TASKS][KSTKSIZE]
+	__attribute__ ((aligned(PGSIZE)));
+
 struct spinlock tasks_lock;
+// Parents blocked in vfork()
+static struct wait_queue vfork_wq;
+// Protects which task slots are in use (state != TASK_FREE), so pid
+// lookups don't need tasks_lock.  Taken inside tasks_lock.
+struct rwlock task_table_lock;
 
 extern char bootstacktop[];
+extern void trapret();	// trap_entry.S
 
 int idle_entry()
 {
@@ -73,83 +90,6 @@ int idle_entry()
 	while(1);
 }
 
-//
-// Initialize the kernel virtual memory layout for environment e.
-// Allocate a page directory, set e->env_pgdir accordingly,
-// and initialize the kernel portion of the new environment's address space.
-// Do NOT (yet) map anything into the user portion
-// of the environment's virtual address space.
-//
-// Returns 0 on success, < 0 on error.  Errors include:
-//	-E_NO_MEM if page directory or table could not be allocated.
-//
-static int
-setupkvm(struct Task *t)
-{
-	int i;
-	struct PageInfo *p = NULL;
-
-	// Allocate a page for the page directory
-	if (!(p = page_alloc(ALLOC_ZERO)))
-		return -E_NO_MEM;
-
-	// Hint:
-	//    - The VA space of all envs is identical above UTOP
-	//	(except at UVPT, which we've set below).
-	//	See inc/memlayout.h for permissions and layout.
-	//	Can you use kern_pgdir as a template?  Hint: Yes.
-	//	(Make sure you got the permissions right in Lab 2.)
-	//    - The initial VA below UTOP is empty.
-	//    - You do not need to make any more calls to page_alloc.
-	//    - Note: In general, pp_ref is not maintained for
-	//	physical pages mapped only above UTOP, but env_pgdir
-	//	is an exception -- you need to increment env_pgdir's
-	//	pp_ref for env_free to work correctly.
-	//    - The functions in kern/pmap.h are handy.
-	t->pgdir = (pde_t *)page2kva(p);
-	for (i = 0; i < NPDENTRIES; i++) {
-		t->pgdir[i] = kern_pgdir[i];
-		if (kern_pgdir[i] & PTE_P)
-			pa2page(PTE_ADDR(kern_pgdir[i]))->pp_ref++;
-	}
-
-	// UVPT maps the env's own page table read-only.
-	// Permissions: kernel R, user R
-	t->pgdir[PDX(UVPT)] = PADDR(t->pgdir) | PTE_P | PTE_U;
-	p->pp_ref++;
-
-	return 0;
-}
-
-// XXX: Now just map to physical address
-static void
-setupvm(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa)
-{
-	size_t i;
-	for (i = 0; i < size; i += PGSIZE) {
-		pte_t *pte = pgdir_walk(pgdir, (char *)va, 1);
-		*pte = pa | PTE_W | PTE_U | PTE_P;
-		// Why I need this? I do not find in TA code @@
-		pgdir[PDX(va)] |= PTE_U;
-		va += PGSIZE;
-		pa += PGSIZE;
-	}
-}
-
-static void
-region_alloc(struct Task *ts, void *va, size_t len)
-{
-	size_t size = ROUNDUP(va + len, PGSIZE) - ROUNDDOWN(va, PGSIZE);
-	int i;
-	for (i = 0; i < size; i += PGSIZE) {
-		// XXX
-		struct PageInfo *page = page_alloc(0);
-		if (!page)
-			panic("No page");
-		page_insert(ts->pgdir, page, va + i, PTE_P | PTE_W | PTE_U);
-	}
-}
-
 /*
  * 1. Find a free task structure for the new task,
  *    the global task list is in the array "tasks".
@@ -175,39 +115,85 @@ region_alloc(struct Task *ts, void *va, size_t len)
  * 6. Return the pid of the newly created task.
  *
  */
-static int task_create(bool is_u)
+/*
+ * A new task's first context_switch() returns here, with tasks_lock
+ * still held by sched_yield().  Then "returns" to trapret.
+ */
+static void
+forkret(void)
 {
-	struct Task *ts = NULL;
+	spin_unlock(&tasks_lock);
+}
+
+/*
+ * Create a task using the user memory mm, the caller's reference of it
+ * goes to the task.  It runs on CPU cpu, tasks are partitioned to CPUs
+ * by task_id (see sched_kick()), or on any CPU if cpu < 0.
+ */
+static int task_create_on(bool is_u, int cpu, struct mm *mm)
+{
+	struct Task *ts = NULL, **link;
+	uint8_t *sp;
 
 	/* Find a free task structure */
-	if (task_free_list == NULL)
+	for (link = &task_free_list; *link; link = &(*link)->task_link)
+		if (cpu < 0 || (*link)->task_id % ncpu == cpu)
+			break;
+	if (*link == NULL)
 		return -1;
-	ts = task_free_list;
-	task_free_list = ts->task_link;
-
-	// /* Setup Page Directory and pages for kernel*/
-	if (setupkvm(ts))
-		panic("Not enough memory for per process page directory!\n");
-
-	/* Setup User Stack */
-	region_alloc(ts, (void *)(USTACKTOP - USR_STACK_SIZE), USR_STACK_SIZE);
+	ts = *link;
+	*link = ts->task_link;
+
+	/* The user memory is set up by the caller, see vm.c */
+	ts->mm = mm;
+	ts->tls = 0;
+
+	/* Setup kernel stack: Trapframe on top, then a context which
+	 * starts executing at forkret, which returns to trapret. */
+	sp = ts->kstack + KSTKSIZE;
+	sp -= sizeof(*ts->tf);
+	ts->tf = (struct Trapframe *)sp;
+	sp -= 4;
+	*(uint32_t *)sp = (uint32_t)trapret;
+	sp -= sizeof(*ts->context);
+	ts->context = (struct Context *)sp;
+	memset(ts->context, 0, sizeof(*ts->context));
+	ts->context->eip = (uint32_t)forkret;
 
 	/* Setup Trapframe */
-	memset( &(ts->tf), 0, sizeof(ts->tf));
+	memset(ts->tf, 0, sizeof(*ts->tf));
+
+	memset(ts->perf, 0, sizeof(ts->perf));
+	memset(&ts->acct, 0, sizeof(ts->acct));
+	ts->acct.ts = read_tsc();
+	ts->policy = SCHED_NORMAL;
+	ts->prio = 0;
+	ts->weight = sched_weight(0);
+	ts->vruntime = 0;
+	ts->vfork = false;
+	ts->vfork_child = NULL;
+	ts->killed = false;
+	ts->kthread = false;
+	ts->name[0] = '\0';
+	ts->stdio[0] = ts->stdio[1] = NULL;
 
 	if (is_u) {
-		ts->tf.tf_cs = GD_UT | 0x03;
-		ts->tf.tf_ds = GD_UD | 0x03;
-		ts->tf.tf_es = GD_UD | 0x03;
-		ts->tf.tf_ss = GD_UD | 0x03;
+		ts->tf->tf_cs = GD_UT | 0x03;
+		ts->tf->tf_ds = GD_UD | 0x03;
+		ts->tf->tf_es = GD_UD | 0x03;
+		ts->tf->tf_fs = GD_UD | 0x03;
+		ts->tf->tf_gs = GD_TLS | 0x03;
+		ts->tf->tf_ss = GD_UD | 0x03;
 	} else {
-		ts->tf.tf_cs = GD_KT | 0x00;
-		ts->tf.tf_ds = GD_KD | 0x00;
-		ts->tf.tf_es = GD_KD | 0x00;
-		ts->tf.tf_ss = GD_KD | 0x00;
+		ts->tf->tf_cs = GD_KT | 0x00;
+		ts->tf->tf_ds = GD_KD | 0x00;
+		ts->tf->tf_es = GD_KD | 0x00;
+		ts->tf->tf_fs = GD_KD | 0x00;
+		ts->tf->tf_gs = GD_PERCPU | 0x00;
+		ts->tf->tf_ss = GD_KD | 0x00;
 	}
-	ts->tf.tf_esp = USTACKTOP;
-	ts->tf.tf_eflags = FL_IF;
+	ts->tf->tf_esp = USTACKTOP;
+	ts->tf->tf_eflags = FL_IF;
 
 	// /* Setup task structure (task_id and parent_id) */
 	// ts->task_id = ts - tasks;	// setup at init
@@ -216,6 +202,19 @@ static int task_create(bool is_u)
 	return (ts - tasks);
 }
 
+// A task with new empty user memory
+static int task_create(bool is_u)
+{
+	struct mm *mm;
+	int pid;
+
+	if ((mm = mm_alloc()) == NULL)
+		return -1;
+	if ((pid = task_create_on(is_u, -1, mm)) < 0)
+		mm_put(mm);
+	return pid;
+}
+
 
 /*
  * This function free the memory allocated by kernel.
@@ -236,26 +235,24 @@ static int task_create(bool is_u)
  */
 void task_free(int pid)
 {
-	lcr3(PADDR(kern_pgdir));
 	struct Task *ts = &tasks[pid];
-	// Remove stack
-	uint32_t i = USTACKTOP - USR_STACK_SIZE;
-	for(; i < USTACKTOP; i += PGSIZE){
-		page_remove(ts->pgdir, i);
-	}
-	// Remove page table
-	for (i = 0; i < NPDENTRIES; i++) {
-		if (ts->pgdir[i] & PTE_P)
-			page_decref(pa2page(PTE_ADDR(ts->pgdir[i])));
-	}
-	// Remove page directory
-	// We map pgdir to UVPT, remove page table will remove pgdir
-	// Umm... magic work! OwO
-	// page_free(pa2page(PADDR(ts->pgdir)));
-	ts->pgdir = NULL;
+	// The parent waits for its memory
+	if (ts->vfork)
+		vfork_release(ts);
+	// Blocked in the kernel
+	if (ts->state == TASK_WAIT)
+		wq_remove(ts);
+	ts->wq_timed = false;
+	// Remove user memory, page tables and page directory with the
+	// last thread using them, kernel threads have none
+	if (ts->mm)
+		mm_put(ts->mm);
+	ts->mm = NULL;
 
 	// Task has been free
+	write_lock(&task_table_lock);
 	ts->state = TASK_FREE;
+	write_unlock(&task_table_lock);
 	ts->task_link = task_free_list;
 	task_free_list = ts;
 }
@@ -267,25 +264,109 @@ void task_free(int pid)
 //
 void sys_kill(int pid)
 {
+	struct fs_fd *stdio[2] = { NULL, NULL };
+	int i;
+
 	if (pid == 0)
 		pid = thiscpu->cpu_task->task_id;
-	if (pid > 0 && pid < NR_TASKS)
+	struct Task *t = task_lookup(pid);
+	// Kernel threads end by returning
+	if (t && t->kthread && t != thiscpu->cpu_task)
+		return;
+	if (t == thiscpu->cpu_task)
+		task_put_stdio(t);
+	if (pid > 0 && t)
 	{
-		struct Task *t = &tasks[pid];
 		spin_lock(&tasks_lock);
 		if (t->state == TASK_RUNNING) {
 			// Let task stop, scheduler will kill it
 			t->state = TASK_STOP;
-		} else {
+			t->killed = true;
+		} else if (t->vfork_child) {
+			// Its child runs on its memory, dies when it is back
+			t->killed = true;
+		} else if (t->state == TASK_WAIT) {
+			// Gives back what it holds on the way out of the
+			// system call it sleeps in
+			t->killed = true;
+			wq_remove(t);
+			t->state = TASK_RUNNABLE;
+			sched_kick(t);
+		} else if (t->state != TASK_FREE) {
+			// Closed below, closing a pipe needs tasks_lock
+			stdio[0] = t->stdio[0];
+			stdio[1] = t->stdio[1];
+			t->stdio[0] = t->stdio[1] = NULL;
 			task_free(pid);
 		}
 		spin_unlock(&tasks_lock);
+		for (i = 0; i < 2; i++)
+			if (stdio[i])
+				fd_put(stdio[i]);
 		// Kill itself
 		if (pid == thiscpu->cpu_task->task_id)
 			sched_yield();
 	}
 }
 
+/*
+ * Drop the standard input and output of ts, the current task or one
+ * which does not run.  Not with tasks_lock held, the last user of a
+ * pipe end wakes up the other end.
+ */
+void
+task_put_stdio(struct Task *ts)
+{
+	struct fs_fd *fd;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if ((fd = ts->stdio[i]) != NULL) {
+			ts->stdio[i] = NULL;
+			fd_put(fd);
+		}
+	}
+}
+
+/*
+ * Find a live task by pid.  Only takes task_table_lock for reading, so
+ * lookups on many CPUs run in parallel.  The task may exit right after
+ * we return, callers that modify it must check its state again under
+ * tasks_lock.
+ */
+struct Task *
+task_lookup(int pid)
+{
+	struct Task *ts = NULL;
+
+	if (pid < 0 || pid >= NR_TASKS)
+		return NULL;
+	read_lock(&task_table_lock);
+	if (tasks[pid].state != TASK_FREE)
+		ts = &tasks[pid];
+	read_unlock(&task_table_lock);
+	return ts;
+}
+
+// A new child of the current task: same class as the parent, starts
+// where the others of its CPU are
+static void
+task_inherit(struct Task *ts)
+{
+	struct Task *cur = thiscpu->cpu_task;
+
+	ts->parent_id = cur->task_id;
+	// fd_lock comes after tasks_lock
+	if ((ts->stdio[0] = cur->stdio[0]) != NULL)
+		fd_dup(ts->stdio[0]);
+	if ((ts->stdio[1] = cur->stdio[1]) != NULL)
+		fd_dup(ts->stdio[1]);
+	ts->policy = cur->policy;
+	ts->prio = cur->prio;
+	ts->weight = cur->weight;
+	ts->vruntime = cpus[ts->task_id % ncpu].cpu_min_vruntime;
+}
+
 /*
  * In this function, you have several things todo
  *
@@ -317,29 +398,31 @@ int sys_fork()
 	
 	if ((uint32_t)thiscpu->cpu_task)
 	{
-		// debug_page = true;
 		spin_lock(&tasks_lock);
 		pid = task_create(true);
 		
-		if (pid < 0)
+		if (pid < 0) {
+			spin_unlock(&tasks_lock);
 			return -1;
+		}
 
 		// Copy trapframe
-		tasks[pid].tf = thiscpu->cpu_task->tf;
-		// Copy stack
-		uint32_t i = USTACKTOP - USR_STACK_SIZE;
-		for(; i < USTACKTOP; i += PGSIZE){
-			struct PageInfo *pp = page_lookup(tasks[pid].pgdir, i , NULL);
-			memcpy((page2kva(pp)), i, PGSIZE);
+		*tasks[pid].tf = *thiscpu->cpu_task->tf;
+		tasks[pid].tls = thiscpu->cpu_task->tls;
+		// Copy the user memory
+		if (vm_fork(tasks[pid].mm, thiscpu->cpu_task->mm) < 0) {
+			task_free(pid);
+			spin_unlock(&tasks_lock);
+			return -1;
 		}
-		// Setup virtual memory
-		setupvm(tasks[pid].pgdir, 0x800000, 64*PGSIZE, 0x800000);
+		task_inherit(&tasks[pid]);
 		// Setup child is runnable
+		write_lock(&task_table_lock);
 		tasks[pid].state = TASK_RUNNABLE;
+		write_unlock(&task_table_lock);
+		sched_kick(&tasks[pid]);
 		// Child return 0
-		tasks[pid].tf.tf_regs.reg_eax = 0;
-		// Setup child parent
-		tasks[pid].parent_id = thiscpu->cpu_task->task_id;
+		tasks[pid].tf->tf_regs.reg_eax = 0;
 		spin_unlock(&tasks_lock);
 		return pid;
 	}
@@ -347,6 +430,206 @@ int sys_fork()
 	panic("fork but thiscpu->cpu_task not exist!");
 }
 
+/*
+ * A child of the current task on its memory, with its registers.
+ * Called with tasks_lock held.
+ */
+static struct Task *
+task_share(void)
+{
+	struct Task *cur = thiscpu->cpu_task, *child;
+	int pid;
+
+	mm_get(cur->mm);
+	if ((pid = task_create_on(true, -1, cur->mm)) < 0) {
+		mm_put(cur->mm);
+		return NULL;
+	}
+	child = &tasks[pid];
+	*child->tf = *cur->tf;
+	child->tf->tf_regs.reg_eax = 0;
+	child->tls = cur->tls;
+	task_inherit(child);
+	return child;
+}
+
+static void
+task_run(struct Task *ts)
+{
+	write_lock(&task_table_lock);
+	ts->state = TASK_RUNNABLE;
+	write_unlock(&task_table_lock);
+	sched_kick(ts);
+}
+
+/*
+ * fork() without copying anything: the child runs on our memory, we
+ * wait until it calls exec() or exits.  Until then it may only touch
+ * its own stack frames (see vfork() in lib/syscall.c).
+ */
+int
+sys_vfork(void)
+{
+	struct Task *cur = thiscpu->cpu_task, *child;
+	int pid;
+
+	spin_lock(&tasks_lock);
+	if ((child = task_share()) == NULL) {
+		spin_unlock(&tasks_lock);
+		return -1;
+	}
+	pid = child->task_id;
+	child->vfork = true;
+	cur->vfork_child = child;
+	task_run(child);
+
+	while (cur->vfork_child)
+		wq_sleep(&vfork_wq, &tasks_lock);
+	spin_unlock(&tasks_lock);
+	if (cur->killed)
+		sys_kill(0);
+	return pid;
+}
+
+/*
+ * The vfork() child ts is done with its parent's memory, it has exec()ed
+ * or exits.  Called with tasks_lock held.
+ */
+void
+vfork_release(struct Task *ts)
+{
+	ts->vfork = false;
+	tasks[ts->parent_id].vfork_child = NULL;
+	wq_wake(&vfork_wq, true);
+}
+
+/*
+ * A new thread of the current program: it shares our memory, returns 0
+ * on stack with tls as the base of its %gs.  Returns its pid.
+ */
+int
+sys_clone(void *stack, void *tls)
+{
+	struct Task *child;
+	int pid;
+
+	spin_lock(&tasks_lock);
+	if ((child = task_share()) == NULL) {
+		spin_unlock(&tasks_lock);
+		return -1;
+	}
+	pid = child->task_id;
+	child->tf->tf_esp = (uintptr_t)stack;
+	child->tls = (uint32_t)tls;
+	task_run(child);
+	spin_unlock(&tasks_lock);
+	return pid;
+}
+
+// Point GD_TLS of this CPU at the TLS of ts, which is about to run.
+// The user %gs is loaded from it on the way back to user mode.
+void
+task_load_tls(struct Task *ts)
+{
+	percpu_gdt[cpunum()][GD_TLS >> 3] = SEG(STA_W, ts->tls, 0xffffffff, 3);
+}
+
+/*
+ * An empty user task for spawn(), it doesn't run until the caller has
+ * set up its memory and registers and calls task_start().  Returns the
+ * pid or -1.
+ */
+int
+task_alloc(void)
+{
+	int pid;
+
+	spin_lock(&tasks_lock);
+	pid = task_create(true);
+	spin_unlock(&tasks_lock);
+	return pid;
+}
+
+void
+task_start(struct Task *ts)
+{
+	spin_lock(&tasks_lock);
+	task_inherit(ts);
+	task_run(ts);
+	spin_unlock(&tasks_lock);
+}
+
+/*
+ * A kernel thread starts here from forkret, see kthread_create(), and
+ * is gone when fn returns.
+ */
+static void
+kthread_main(void (*fn)(void *), void *arg)
+{
+	fn(arg);
+	sys_kill(0);
+	panic("kthread %s: still alive", thiscpu->cpu_task->name);
+}
+
+/*
+ * Run fn(arg) in a new kernel thread called name on CPU cpu, or any
+ * CPU if cpu < 0.  It is scheduled like a user task, but the kernel is
+ * not preempted: it runs until it blocks, e.g. in wq_sleep(), or calls
+ * sched_yield().  Returns the pid or -1.
+ */
+int
+kthread_create(void (*fn)(void *), void *arg, const char *name, int cpu)
+{
+	struct Task *ts;
+	uint32_t *frame;
+	int pid;
+
+	spin_lock(&tasks_lock);
+	// No user memory, it runs on whatever page directory is loaded
+	if ((pid = task_create_on(false, cpu, NULL)) < 0) {
+		spin_unlock(&tasks_lock);
+		return -1;
+	}
+	ts = &tasks[pid];
+	ts->kthread = true;
+	strlcpy(ts->name, name, sizeof(ts->name));
+	// forkret returns to kthread_main instead of trapret, the unused
+	// Trapframe above becomes its frame: return address and arguments
+	*(uint32_t *)((uint8_t *)ts->tf - 4) = (uint32_t)kthread_main;
+	frame = (uint32_t *)ts->tf;
+	frame[0] = 0;
+	frame[1] = (uint32_t)fn;
+	frame[2] = (uint32_t)arg;
+	ts->parent_id = 0;
+	task_run(ts);
+	spin_unlock(&tasks_lock);
+	return pid;
+}
+
+/*
+ * Load this CPU's copy of the GDT, whose GD_PERCPU segment is based at
+ * cpus[c], and point %gs at it so thiscpu and cpunum() are a single
+ * %gs relative load.  Must run before anything uses thiscpu, even
+ * cprintf() takes a spinlock.
+ */
+void
+gdt_init_percpu(int c)
+{
+	struct Pseudodesc pd = {
+		sizeof(percpu_gdt[c]) - 1, (unsigned long) percpu_gdt[c]
+	};
+
+	memcpy(percpu_gdt[c], gdt, sizeof(gdt));
+	percpu_gdt[c][GD_PERCPU >> 3] = SEG(STA_W, (uint32_t)&cpus[c], sizeof(struct CpuInfo) - 1, 0);
+	cpus[c].cpu_self = &cpus[c];
+
+	/* Load GDT&LDT */
+	lgdt(&pd);
+	lldt(0);
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_PERCPU));
+	asm volatile("movw %%ax,%%fs" :: "a" (GD_KD));
+}
+
 /*
  * We've done the initialization for you,
  * please make sure you understand the code.
@@ -356,6 +639,8 @@ void task_init(void)
 	int i;
 
 	spin_initlock(&tasks_lock);
+	rw_initlock(&task_table_lock);
+	wq_init(&vfork_wq);
 	/* Initial task sturcture */
 	task_free_list = NULL;
 	for (i = NR_TASKS - 1; i >= 0; --i)
@@ -364,6 +649,7 @@ void task_init(void)
 		tasks[i].state = TASK_FREE;
 		tasks[i].task_link = task_free_list;
 		tasks[i].task_id = i;
+		tasks[i].kstack = task_kstacks[i];
 		task_free_list = &tasks[i];
 	}
 }
@@ -388,22 +674,31 @@ task_init_percpu(struct Elf *ehdr) {
 	memset(&(cpus[c].cpu_tss), 0, sizeof(struct tss_struct));
 	// Stack QAQ
 	cpus[c].cpu_tss.ts_esp0 = (uint32_t)(&percpu_kstacks[c]) + KSTKSIZE;
+	cpus[c].cpu_sysenter_esp0 = cpus[c].cpu_tss.ts_esp0;
 	cpus[c].cpu_tss.ts_ss0 = GD_KD;
 
 	// fs and gs stay in user data segment
 	cpus[c].cpu_tss.ts_fs = GD_UD | 0x03;
 	cpus[c].cpu_tss.ts_gs = GD_UD | 0x03;
 
-	/* Setup TSS in GDT */
-	gdt[(GD_TSS0 >> 3) + c] = SEG16(STS_T32A, (uint32_t)(&cpus[c].cpu_tss), sizeof(struct tss_struct), 0);
-	gdt[(GD_TSS0 >> 3) + c].sd_s = 0;
-
-	/* Load GDT&LDT */
-	lgdt(&gdt_pd);
-	lldt(0);
+	/* Setup TSS in GDT, gdt_init_percpu() already loaded it */
+	percpu_gdt[c][GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t)(&cpus[c].cpu_tss), sizeof(struct tss_struct), 0);
+	percpu_gdt[c][GD_TSS0 >> 3].sd_s = 0;
 
 	// Load the TSS selector 
-	ltr(GD_TSS0 + (c << 3));
+	ltr(GD_TSS0);
+
+	// Setup the fast system call entry (see sysenter_entry in
+	// kernel/trap_entry.S), sysenter loads the kernel stack from
+	// cpu_sysenter_esp0.
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_FEAT_SEP) {
+		extern void sysenter_entry();
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, (uint32_t)&cpus[c].cpu_sysenter_esp0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t)sysenter_entry);
+	}
 
 	struct Task *ret;
 
@@ -413,26 +708,40 @@ task_init_percpu(struct Elf *ehdr) {
 	if (i == -1)
 		panic("create task fail");
 	ret = &tasks[i];
+	// The shell runs on CPU 0, the others only spin in user mode (see
+	// _start() of user/shell.c) and must not take the CPU from anybody
+	if (c != 0)
+		ret->policy = SCHED_IDLE;
+	write_lock(&task_table_lock);
 	ret->state = TASK_RUNNABLE;
+	write_unlock(&task_table_lock);
+
+	if (vm_map(ret->mm, USTACKTOP - USR_STACK_SIZE, USR_STACK_SIZE, VMA_ANON, PTE_W | PTE_U, NULL, 0, 0) < 0 ||
+	    vm_map(ret->mm, UTLS, PGSIZE, VMA_ANON, PTE_W | PTE_U, NULL, 0, 0) < 0)
+		panic("Not enough memory for the first task!\n");
+	ret->tls = UTLS;
 
 	if (ehdr) {
-		/* For user program */
-		setupvm(ret->pgdir, 0x800000, 64*PGSIZE, 0x800000);
-		extern void load_elf(struct Task *t, uint8_t *binary);
+		/* For user program, shares the pages of the image with the
+		 * first tasks of the other CPUs */
+		extern void load_elf(struct Task *t, struct Elf *elf);
 		load_elf(ret, ehdr);
-		ret->tf.tf_cs = GD_UT | 0x03;
-		ret->tf.tf_ds = GD_UD | 0x03;
-		ret->tf.tf_es = GD_UD | 0x03;
-		ret->tf.tf_ss = GD_UD | 0x03;
-		ret->tf.tf_eip = ehdr->e_entry;
+		ret->tf->tf_cs = GD_UT | 0x03;
+		ret->tf->tf_ds = GD_UD | 0x03;
+		ret->tf->tf_es = GD_UD | 0x03;
+		ret->tf->tf_fs = GD_UD | 0x03;
+		ret->tf->tf_gs = GD_TLS | 0x03;
+		ret->tf->tf_ss = GD_UD | 0x03;
+		ret->tf->tf_eip = ehdr->e_entry;
 	} else {
 		// defalut idle task
-		setupvm(ret->pgdir, 0x800000, 64*PGSIZE, 0x800000);
-		ret->tf.tf_cs = GD_UT | 0x03;
-		ret->tf.tf_ds = GD_UD | 0x03;
-		ret->tf.tf_es = GD_UD | 0x03;
-		ret->tf.tf_ss = GD_UD | 0x03;
-		ret->tf.tf_eip = ehdr->e_entry; // XXX idle_entry
+		ret->tf->tf_cs = GD_UT | 0x03;
+		ret->tf->tf_ds = GD_UD | 0x03;
+		ret->tf->tf_es = GD_UD | 0x03;
+		ret->tf->tf_fs = GD_UD | 0x03;
+		ret->tf->tf_gs = GD_TLS | 0x03;
+		ret->tf->tf_ss = GD_UD | 0x03;
+		ret->tf->tf_eip = ehdr->e_entry; // XXX idle_entry
 	}
 
 	return ret;
@@ -450,6 +759,8 @@ task_pop_tf(struct Trapframe *tf)
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
+		"\tpopl %%gs\n"
+		"\tpopl %%fs\n"
 		"\tpopl %%es\n"
 		"\tpopl %%ds\n"
 		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
@@ -2,10 +2,11 @@
 #define TASK_H
 
 #include <inc/trap.h>
+#include <inc/syscall.h>
 #include <kernel/mem.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
 #define NR_TASKS	32
-#define TIME_QUANT	100
 
 typedef enum
 {
@@ -14,29 +15,129 @@ typedef enum
 	TASK_RUNNING,
 	TASK_SLEEP,
 	TASK_STOP,
+	TASK_WAIT,	// Blocked on a wait_queue
 } TaskState;
 
+struct Task;
+struct fs_fd;
+
+// CPU accounting of a task, in TSC cycles, kept by sched.c
+struct task_acct
+{
+	uint64_t ts;		// Last accounting point, see sched.c
+	uint64_t utime;		// Running in user mode
+	uint64_t stime;		// Running in the kernel
+	uint64_t wait;		// Runnable, waiting for a CPU
+	uint32_t nvcsw;		// Blocked or slept
+	uint32_t nivcsw;	// Preempted or yielded
+	uint32_t nsyscalls;
+	uint32_t npgfaults;
+	int cpu;		// Last CPU it ran on
+};
+
+// Tasks blocked in the kernel, linked through task_link.
+// Protected by tasks_lock.
+struct wait_queue
+{
+	struct Task *head;
+	struct Task *tail;
+};
+
+// Saved registers for kernel context switches.
+// Don't need to save all the segment registers (%cs, etc),
+// because they are constant across kernel contexts.
+// Don't need to save %eax, %ecx, %edx, because the
+// x86 convention is that the caller has saved them.
+// Contexts are stored at the bottom of the stack they
+// describe; the stack pointer is the address of the context.
+// The layout of the context matches the layout of the stack in
+// kernel/switch.S at the "Switch stacks" comment.
+struct Context
+{
+	uint32_t edi;
+	uint32_t esi;
+	uint32_t ebx;
+	uint32_t ebp;
+	uint32_t eip;
+};
+
 struct Task
 {
 	int task_id;
 	int parent_id;
-	struct Trapframe tf;	// Saved registers
-	int32_t pick_tick;
+	struct Trapframe *tf;	// Saved registers, at the top of kstack
+	struct Context *context;	// context_switch() here to run task
+	uint8_t *kstack;	// Bottom of the per-task kernel stack
+	int32_t pick_tick;	// Tick to wake up at in TASK_SLEEP, or to
+				// give up a wait_queue if wq_timed
 	TaskState state;	// Task state
-	pde_t *pgdir;		// Per process Page Directory
+	struct mm *mm;		// User memory, see vm.c, NULL in kthreads
+	uint32_t tls;		// Base of the GD_TLS segment, see clone()
+	// vfork(), protected by tasks_lock
+	bool vfork;		// The parent waits for our exec() or exit
+	struct Task *vfork_child;	// Uses our memory, we wait for it
+	bool killed;		// Dies on the way out of the system call
+	physaddr_t futex_key;	// The word it waits for in futex_wait()
+	bool kthread;		// Kernel thread, see kthread_create()
+	char name[16];		// Of a kernel thread
+	struct fs_fd *stdio[2];	// Standard input and output, NULL is the
+				// console, see dup2()
 	struct Task *task_link;	// next free or next task...
+	struct wait_queue *wq;	// Queue we are waiting on
+	bool wq_timed;		// Until pick_tick, cleared when it passed
+	uint64_t perf[PERF_NEVENTS];	// Performance counts, see pmu.c
+	struct task_acct acct;
+	// Scheduling class, see sched.c
+	int policy;		// SCHED_NORMAL, SCHED_FIFO or SCHED_IDLE
+	int prio;		// Nice level, or priority of SCHED_FIFO
+	uint32_t weight;	// Of the nice level
+	uint64_t vruntime;	// Weighted cycles run
+	uint64_t exec_start;	// Last time vruntime was updated
+	uint64_t slice_start;	// When it was picked to run
 };
 
 void task_init(void);
 struct Task *task_init_percpu(struct Elf *ehdr);
+void gdt_init_percpu(int c);
 void task_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
+void context_switch(struct Context **old, struct Context *new);
 
 void task_free(int pid);
+void task_put_stdio(struct Task *ts);
+struct Task *task_lookup(int pid);
 void sys_kill(int pid);
 int sys_fork(void);
+int sys_vfork(void);
+int sys_clone(void *stack, void *tls);
+void vfork_release(struct Task *ts);
+void task_load_tls(struct Task *ts);
+int task_alloc(void);
+void task_start(struct Task *ts);
+int kthread_create(void (*fn)(void *), void *arg, const char *name, int cpu);
+
+void sched_init(void);
+uint32_t sched_weight(int nice);
+int sys_sched_setscheduler(int pid, int policy, int prio);
+void sched_yield(void);
+void sys_yield(void);
+void sched_kick(struct Task *ts);
+void sched_idle(void) __attribute__((noreturn));
+void acct_user_enter(struct Task *ts);
+void acct_user_exit(struct Task *ts);
+int sys_task_stat(struct task_stat *buf, int n);
+int sys_cpu_stat(struct cpu_stat *buf, int n);
+
+void wq_init(struct wait_queue *wq);
+void wq_sleep(struct wait_queue *wq, struct spinlock *lk);
+int wq_sleep_timeout(struct wait_queue *wq, struct spinlock *lk, int32_t ticks);
+void wq_wake_one(struct wait_queue *wq);
+void wq_wake_all(struct wait_queue *wq);
+void wq_wake(struct wait_queue *wq, bool all);
+void wq_remove(struct Task *ts);
 
 extern struct Task tasks[NR_TASKS];
 extern struct spinlock tasks_lock;
+extern struct rwlock task_table_lock;
 
 
 #endif
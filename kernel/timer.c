@@ -3,12 +3,26 @@
 #include <kernel/task.h>
 #include <kernel/trap.h>
 #include <kernel/picirq.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/vm.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
 #include <inc/mmu.h>
 #include <inc/x86.h>
 
 #define TIME_HZ 100
+#define PIT_HZ 1193182
+#define CALIBRATE_MS 10
+#define VCLOCK_SHIFT 24
 
-static unsigned long jiffies = 0;
+// Only CPU 0 updates it, but a 64-bit counter can not be read
+// atomically on i386.  Readers on every CPU use the seqlock so they
+// never write a shared cache line.
+static uint64_t jiffies = 0;
+static struct seqlock jiffies_lock;
+
+union vclock_page vclock_page __attribute__((aligned(PGSIZE)));
 
 void set_timer(int hz)
 {
@@ -18,14 +32,61 @@ void set_timer(int hz)
     outb(0x40, divisor >> 8);     /* Set high byte of divisor */
 }
 
+/*
+ * Count TSC cycles over CALIBRATE_MS with PIT channel 2 in one-shot
+ * mode, its output is readable at bit 5 of port 0x61 and needs no
+ * interrupt.  Returns the TSC frequency in kHz, 0 if the PIT did not
+ * count down.
+ */
+static uint32_t tsc_calibrate(void)
+{
+	uint32_t latch = PIT_HZ / (1000 / CALIBRATE_MS);
+	uint64_t start, end;
+	uint32_t loops = 0;
+
+	// Gate channel 2 on, speaker off
+	outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+	// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+	outb(0x43, 0xb0);
+	outb(0x42, latch & 0xff);
+	outb(0x42, latch >> 8);
+
+	start = read_tsc();
+	while ((inb(0x61) & 0x20) == 0)
+		if (++loops > 100000000)
+			return 0;
+	end = read_tsc();
+
+	return (end - start) / CALIBRATE_MS;
+}
+
+// Move the vclock base to now, only CPU 0 does it
+static void vclock_update(void)
+{
+	struct vclock *vc = &vclock_page.vc;
+	uint64_t now = read_tsc();
+
+	vc->seq++;
+	asm volatile("" ::: "memory");
+	if (now > vc->tsc_base)
+		vc->ns_base += ((now - vc->tsc_base) * vc->mult) >> vc->shift;
+	vc->tsc_base = now;
+	asm volatile("" ::: "memory");
+	vc->seq++;
+}
+
 /* 
  * Timer interrupt handler
  */
 void timer_handler()
 {
-	if (cpunum() == 0)
+	if (cpunum() == 0) {
+		write_seqlock(&jiffies_lock);
 		jiffies++;
-	else
+		write_sequnlock(&jiffies_lock);
+		if (vclock_page.vc.mult)
+			vclock_update();
+	} else
 		lapic_eoi();
 
 	/*
@@ -41,13 +102,62 @@ void timer_handler()
 	sched_yield();
 }
 
+uint64_t get_tick64()
+{
+	uint64_t ret;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&jiffies_lock);
+		ret = jiffies;
+	} while (read_seqretry(&jiffies_lock, seq));
+	return ret;
+}
+
 unsigned long get_tick()
 {
-	return jiffies;
+	return get_tick64();
+}
+
+// Nanoseconds since boot, in jiffies if the TSC is not usable
+uint64_t clock_ns(void)
+{
+	if (vclock_page.vc.mult)
+		return vclock_read(&vclock_page.vc);
+	return get_tick64() * (NSEC_PER_SEC / TIME_HZ);
+}
+
+int sys_clock_gettime(int clk, struct timespec *tp)
+{
+	struct timespec ts;
+	uint64_t ns;
+	int err;
+
+	if (clk != CLOCK_MONOTONIC)
+		return -E_INVAL;
+	if ((err = vm_prefault(tp, sizeof(*tp), true)) < 0)
+		return err;
+	ns = clock_ns();
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	return copyout(tp, &ts, sizeof(ts));
 }
 
 void timer_init()
 {
+	struct vclock *vc = &vclock_page.vc;
+
+	seq_initlock(&jiffies_lock);
+
+	vc->tsc_khz = tsc_calibrate();
+	if (vc->tsc_khz) {
+		vc->shift = VCLOCK_SHIFT;
+		vc->mult = (NSEC_PER_MSEC << VCLOCK_SHIFT) / vc->tsc_khz;
+		vc->tsc_base = read_tsc();
+		cprintf("TSC: %u kHz\n", vc->tsc_khz);
+	} else
+		cprintf("TSC: calibration failed, clock_gettime() uses jiffies\n");
+
 	set_timer(TIME_HZ);
 
 	/* Enable interrupt */
@@ -1,5 +1,20 @@
 #ifndef TIMER_H
 #define TIMER_H
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/time.h>
+
+// Clock data mapped read-only for user space at UVCLOCK, padded so no
+// other kernel data shares the page
+union vclock_page {
+	struct vclock vc;
+	uint8_t pad[PGSIZE];
+};
+extern union vclock_page vclock_page;
+
 void timer_init();
 unsigned long get_tick();
+uint64_t get_tick64();
+uint64_t clock_ns(void);
+int sys_clock_gettime(int clk, struct timespec *tp);
 #endif
@@ -0,0 +1,114 @@
+/*
+ * Event tracing.  trace() records a timestamped binary event into a
+ * ring of the current CPU.  The kernel runs with interrupts disabled,
+ * so the CPU is the only writer of its ring and needs no lock, readers
+ * of SYS_ktrace take trace_lock among themselves.  A full ring drops
+ * new events, the reader sees how many.
+ */
+#include <inc/x86.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/spinlock.h>
+#include <kernel/trace.h>
+#include <kernel/vm.h>
+
+#define TRACE_RING 1024		// Events per CPU, a power of two
+
+struct trace_ring {
+	struct trace_event buf[TRACE_RING];
+	volatile uint32_t head;	// Next slot to fill, owning CPU only
+	volatile uint32_t tail;	// Next slot to read, under trace_lock
+	volatile uint32_t dropped;
+};
+
+volatile uint32_t trace_mask;
+static struct trace_ring trace_rings[NCPU];
+static struct spinlock trace_lock;
+
+void
+trace_init(void)
+{
+	spin_initlock(&trace_lock);
+}
+
+void
+__trace(int ev, uint32_t a0, uint32_t a1)
+{
+	struct trace_ring *r = &trace_rings[cpunum()];
+	struct trace_event *e;
+	struct Task *ts;
+
+	if (r->head - r->tail >= TRACE_RING) {
+		r->dropped++;
+		return;
+	}
+	e = &r->buf[r->head & (TRACE_RING - 1)];
+	ts = thiscpu->cpu_task;
+	e->tsc = read_tsc();
+	e->ev = ev;
+	e->cpu = cpunum();
+	e->pid = ts ? ts->task_id : -1;
+	e->a0 = a0;
+	e->a1 = a1;
+	// Fill the slot before publishing it
+	asm volatile("" ::: "memory");
+	r->head++;
+}
+
+/*
+ * TRACE_START clears the rings and enables the events in mask n,
+ * TRACE_STOP disables all of them.  TRACE_DRAIN moves up to n events
+ * into buf and returns how many, the events of one CPU are in order.
+ * TRACE_DROPPED returns the events lost to full rings.
+ */
+int
+sys_ktrace(int op, struct trace_event *buf, int n)
+{
+	struct trace_ring *r;
+	int c, got = 0, err;
+
+	if (op == TRACE_DRAIN) {
+		n = MIN(n, NCPU * TRACE_RING);
+		if ((err = vm_prefault_array(buf, n, sizeof(*buf))) < 0)
+			return err;
+	}
+	spin_lock(&trace_lock);
+	switch (op) {
+	case TRACE_START:
+		trace_mask = 0;
+		for (c = 0; c < NCPU; c++) {
+			trace_rings[c].tail = trace_rings[c].head;
+			trace_rings[c].dropped = 0;
+		}
+		trace_mask = n & ((1 << EV_NR) - 1);
+		break;
+	case TRACE_STOP:
+		trace_mask = 0;
+		break;
+	case TRACE_DRAIN:
+		for (c = 0; c < NCPU && got < n && !err; c++) {
+			r = &trace_rings[c];
+			while (r->tail != r->head && got < n) {
+				err = copyout(&buf[got], &r->buf[r->tail & (TRACE_RING - 1)],
+					      sizeof(*buf));
+				if (err < 0)
+					break;
+				got++;
+				// Copy the slot before handing it back
+				asm volatile("" ::: "memory");
+				r->tail++;
+			}
+		}
+		if (!got)
+			got = err;
+		break;
+	case TRACE_DROPPED:
+		for (c = 0; c < NCPU; c++)
+			got += trace_rings[c].dropped;
+		break;
+	default:
+		got = -1;
+	}
+	spin_unlock(&trace_lock);
+	return got;
+}
@@ -0,0 +1,20 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <inc/types.h>
+#include <inc/syscall.h>
+
+// Bit mask of the enabled EV_* events
+extern volatile uint32_t trace_mask;
+
+void trace_init(void);
+void __trace(int ev, uint32_t a0, uint32_t a1);
+int sys_ktrace(int op, struct trace_event *buf, int n);
+
+// Static tracepoint, a disabled one costs a load and a branch
+#define trace(ev, a0, a1)						\
+	do {								\
+		if (trace_mask & (1 << (ev)))				\
+			__trace((ev), (uint32_t)(a0), (uint32_t)(a1));	\
+	} while (0)
+
+#endif
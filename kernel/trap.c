@@ -1,6 +1,8 @@
 #include <kernel/cpu.h>
 #include <kernel/task.h>
 #include <kernel/trap.h>
+#include <kernel/prof.h>
+#include <kernel/pmu.h>
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/x86.h>
@@ -11,6 +13,9 @@ extern void pgflt_trap_entry();		// trap_entry.S
 extern void kbd_trap_entry();		// trap_entry.S
 extern void timer_trap_entry();		// trap_entry.S
 extern void syscall_trap_entry();	// trap_entry.S
+extern void resched_ipi_entry();	// trap_entry.S
+extern void tlb_ipi_entry();		// trap_entry.S
+extern void nmi_entry();		// trap_entry.S
 extern void timer_handler();
 extern void kbd_intr();
 extern void syscall_dispatch(struct Trapframe *tf);
@@ -94,11 +99,40 @@ print_trapframe(struct Trapframe *tf)
 	}
 }
 
+/*
+ * User memory is mapped on demand (see vm_fault()), also when the
+ * kernel touches it in a system call.  Anything else kills the task,
+ * or is a kernel bug.
+ *
+ * copy_user() (see copyin()) may run with spinlocks held, where the
+ * fault must not wait for the disk.  Its pages were faulted in, only a
+ * write to one which became copy on write meanwhile is handled, and a
+ * page another thread unmapped makes it fail.
+ */
 void
 pgflt_handler(struct Trapframe *tf)
 {
-	cprintf("Page fault @ %p\n", rcr2());
-	while (1);
+	extern char copy_user_start[], copy_user_end[], copy_user_fixup[];
+	struct Task *cur = thiscpu->cpu_task;
+	uint32_t va = rcr2();
+	bool ucopy = (tf->tf_cs & 3) == 0 &&
+		     tf->tf_eip >= (uintptr_t)copy_user_start &&
+		     tf->tf_eip < (uintptr_t)copy_user_end;
+
+	if (cur)
+		cur->acct.npgfaults++;
+	if (cur && cur->mm && va < UTOP && (!ucopy || (tf->tf_err & FEC_PR)) &&
+	    vm_fault(cur->mm, va, tf->tf_err & FEC_WR) == 0)
+		return;
+	if (ucopy) {
+		tf->tf_eip = (uintptr_t)copy_user_fixup;
+		return;
+	}
+	print_trapframe(tf);
+	if ((tf->tf_cs & 3) == 0)
+		panic("Page fault @ %p in the kernel", va);
+	cprintf("[%d] Page fault @ %p, killed\n", cur->task_id, va);
+	sys_kill(0);
 }
 
 /* For debugging */
@@ -120,7 +154,6 @@ trap_dispatch(struct Trapframe *tf)
 {
 	switch (tf->tf_trapno) {
 	case T_PGFLT:
-		print_trapframe(tf);
 		pgflt_handler(tf);
 		break;
 	case T_SYSCALL:
@@ -130,8 +163,18 @@ trap_dispatch(struct Trapframe *tf)
 		kbd_intr();
 		break;
 	case IRQ_OFFSET+IRQ_TIMER:
+		prof_tick(tf);
+		pmu_tick();
 		timer_handler();
 		break;
+	case IRQ_OFFSET+IRQ_RESCHED:
+		lapic_eoi();
+		sched_yield();
+		break;
+	case IRQ_OFFSET+IRQ_TLB:
+		tlb_shootdown_poll();
+		lapic_eoi();
+		break;
 	default:
 		// Unexpected trap: The user process or the kernel has a bug.
 		print_trapframe(tf);
@@ -140,35 +183,74 @@ trap_dispatch(struct Trapframe *tf)
 
 }
 
-extern bool booted;
-/* 
- * Note: This is the called for every interrupt.
+/*
+ * The trap frame lives at the top of the current task's kernel stack
+ * (see task_create()), so nothing needs to be copied to resume the
+ * task later.  Just record it for print_trapframe().
  */
-void default_trap_handler(struct Trapframe *tf)
+static void
+trap_enter(struct Trapframe *tf)
 {
-	if (booted && thiscpu->cpu_task != 0) {
-	// if ((tf->tf_cs & 3) == 3) {
-		// Trapped from user mode.
-		assert(thiscpu->cpu_task);
-
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		thiscpu->cpu_task->tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &thiscpu->cpu_task->tf;
+	// Trapped from user mode, TSS esp0 must have been the current
+	// task's kernel stack.
+	if ((tf->tf_cs & 3) == 3) {
+		assert(tf == thiscpu->cpu_task->tf);
+		acct_user_enter(thiscpu->cpu_task);
 	}
 
 	// Record that tf is the last real trapframe so
 	// print_trapframe can print some additional information.
 	thiscpu->last_tf = tf;
+}
+
+/*
+ * About to return to user mode.  A task woken up on this CPU by the
+ * trap may have to run first, see sched_kick().
+ */
+static void
+trap_exit(void)
+{
+	if (thiscpu->cpu_resched)
+		sched_yield();
+	acct_user_exit(thiscpu->cpu_task);
+}
+
+/* 
+ * Note: This is the called for every interrupt.
+ * Returns to trapret in trap_entry.S.
+ */
+void default_trap_handler(struct Trapframe *tf)
+{
+	// An NMI may interrupt the kernel anywhere, even another trap
+	// handler, keep it away from last_tf and any lock.
+	if (tf->tf_trapno == T_NMI) {
+		pmu_nmi(tf);
+		return;
+	}
+
+	trap_enter(tf);
 
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
-	task_pop_tf(thiscpu->last_tf);
+	// We may have been switched out and back in meanwhile, but tf
+	// is still the frame of the current task.
+	if ((tf->tf_cs & 3) == 3)
+		trap_exit();
 }
 
+/*
+ * Called by sysenter_entry in trap_entry.S, which leaves with sysexit
+ * using the returned frame.
+ */
+struct Trapframe *
+sysenter_trap_handler(struct Trapframe *tf)
+{
+	trap_enter(tf);
+	syscall_dispatch(tf);
+	trap_exit();
+	return tf;
+}
 
 void trap_init()
 {
@@ -196,6 +278,13 @@ void trap_init()
 
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, syscall_trap_entry, 3);
 
+	/* IPIs */
+	SETGATE(idt[IRQ_OFFSET+IRQ_RESCHED], 0, GD_KT, resched_ipi_entry, 0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_TLB], 0, GD_KT, tlb_ipi_entry, 0);
+
+	/* Performance counter overflows, see pmu.c */
+	SETGATE(idt[T_NMI], 0, GD_KT, nmi_entry, 0);
+
 	/* Load IDT */
 	lidt(&idt_pd);
 }
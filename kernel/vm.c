@@ -0,0 +1,874 @@
+/*
+ * User address spaces.  A task's memory below UTOP is a list of regions
+ * (struct vma), the page tables are filled lazily from them by the page
+ * fault handler:
+ *
+ *   VMA_ANON   a zeroed page on the first touch
+ *   VMA_FILE   the page cache's own pages; past filesz the region
+ *              reads zero, that page is a private copy
+ *   VMA_SHM    the pages of a shared memory segment, shared by all
+ *              tasks mapping it and by fork()
+ *
+ * A huge region is mapped in 4MB pages (PTE_PS) instead, for programs
+ * which walk through much memory with few TLB misses.  Its pages are
+ * never shared copy on write: fork() copies those of VMA_ANON.
+ *
+ * A page shared by a writable region is mapped read-only with PTE_COW,
+ * the first write gives the task a copy of its own, or the page itself
+ * if nobody else holds it any more.  fork() shares every page this way,
+ * a child costs its page tables until one of them writes.
+ *
+ * The regions and the page directory make up a struct mm, which the
+ * threads of a program share (see clone()).  Besides the program image
+ * and the stack a program has a heap at UHEAP which sbrk() moves the
+ * end of, and mmap() and shm_map() put regions into [UMMAP, UMMAP_TOP).
+ */
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/pcache.h>
+#include <kernel/shm.h>
+#include <kernel/vm.h>
+
+struct spinlock vm_lock;
+
+// Every task has one at most
+static struct mm mms[NR_TASKS];
+
+void
+vm_init(void)
+{
+	spin_initlock(&vm_lock);
+	pcache_init();
+}
+
+//
+// Initialize the kernel virtual memory layout for environment e.
+// Allocate a page directory, set e->env_pgdir accordingly,
+// and initialize the kernel portion of the new environment's address space.
+// Do NOT (yet) map anything into the user portion
+// of the environment's virtual address space.
+//
+// Returns 0 on success, < 0 on error.  Errors include:
+//	-E_NO_MEM if page directory or table could not be allocated.
+//
+static int
+setupkvm(struct mm *t)
+{
+	int i;
+	struct PageInfo *p = NULL;
+
+	// Allocate a page for the page directory
+	if (!(p = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+
+	// Hint:
+	//    - The VA space of all envs is identical above UTOP
+	//	(except at UVPT, which we've set below).
+	//	See inc/memlayout.h for permissions and layout.
+	//	Can you use kern_pgdir as a template?  Hint: Yes.
+	//	(Make sure you got the permissions right in Lab 2.)
+	//    - The initial VA below UTOP is empty.
+	//    - You do not need to make any more calls to page_alloc.
+	//    - Note: In general, pp_ref is not maintained for
+	//	physical pages mapped only above UTOP, but env_pgdir
+	//	is an exception -- you need to increment env_pgdir's
+	//	pp_ref for env_free to work correctly.
+	//    - The functions in kern/pmap.h are handy.
+	t->pgdir = (pde_t *)page2kva(p);
+	for (i = 0; i < NPDENTRIES; i++) {
+		t->pgdir[i] = kern_pgdir[i];
+		// Page tables, the 4MB pages of the kernel have none.  UVPT
+		// is replaced with our own page directory below.
+		if (i != PDX(UVPT) &&
+		    (kern_pgdir[i] & (PTE_P | PTE_PS)) == PTE_P)
+			pa2page(PTE_ADDR(kern_pgdir[i]))->pp_ref++;
+	}
+
+	// UVPT maps the env's own page table read-only.
+	// Permissions: kernel R, user R
+	t->pgdir[PDX(UVPT)] = PADDR(t->pgdir) | PTE_P | PTE_U;
+	p->pp_ref++;
+
+	return 0;
+}
+
+// An empty address space with one reference, NULL if out of memory
+struct mm *
+mm_alloc(void)
+{
+	struct mm *mm;
+
+	spin_lock(&vm_lock);
+	for (mm = mms; mm < mms + NR_TASKS; mm++)
+		if (mm->ref == 0)
+			break;
+	// Nobody else can take it while the page directory is set up
+	if (mm < mms + NR_TASKS) {
+		mm->ref = 1;
+		mm->brk = UHEAP;
+	}
+	spin_unlock(&vm_lock);
+	if (mm == mms + NR_TASKS)
+		return NULL;
+	if (setupkvm(mm) < 0) {
+		mm->ref = 0;
+		return NULL;
+	}
+	return mm;
+}
+
+void
+mm_get(struct mm *mm)
+{
+	spin_lock(&vm_lock);
+	mm->ref++;
+	spin_unlock(&vm_lock);
+}
+
+// Drop a reference of mm, the last one frees it
+void
+mm_put(struct mm *mm)
+{
+	uint32_t i;
+
+	spin_lock(&vm_lock);
+	if (--mm->ref > 0) {
+		spin_unlock(&vm_lock);
+		return;
+	}
+	// Keeps the slot until the page directory is gone
+	mm->ref = 1;
+	spin_unlock(&vm_lock);
+
+	// Idle CPUs may still have it loaded, see tlb_shootdown()
+	tlb_shootdown(mm->pgdir, NULL, -1);
+	vm_free(mm);
+	// Remove page table, UVPT maps the page directory itself
+	for (i = 0; i < NPDENTRIES; i++) {
+		if (i != PDX(UVPT) &&
+		    (mm->pgdir[i] & (PTE_P | PTE_PS)) == PTE_P)
+			page_decref(pa2page(PTE_ADDR(mm->pgdir[i])));
+	}
+	// Remove page directory, last since the loop reads it
+	page_decref(pa2page(PADDR(mm->pgdir)));
+	mm->pgdir = NULL;
+	mm->ref = 0;
+}
+
+static struct vma *
+vma_find(struct mm *mm, uintptr_t va)
+{
+	struct vma *v;
+
+	for (v = mm->vmas; v < mm->vmas + NVMA; v++)
+		if (v->type != VMA_FREE && v->start <= va && va < v->end)
+			return v;
+	return NULL;
+}
+
+// Whether a region of mm overlaps [va, end), called with vm_lock held
+static bool
+vma_overlaps(struct mm *mm, uintptr_t va, uintptr_t end)
+{
+	struct vma *v;
+
+	for (v = mm->vmas; v < mm->vmas + NVMA; v++)
+		if (v->type != VMA_FREE && va < v->end && v->start < end)
+			return true;
+	return false;
+}
+
+// A free slot of mm or NULL, called with vm_lock held
+static struct vma *
+vma_slot(struct mm *mm)
+{
+	struct vma *v;
+
+	for (v = mm->vmas; v < mm->vmas + NVMA; v++)
+		if (v->type == VMA_FREE)
+			return v;
+	return NULL;
+}
+
+/*
+ * A new region [va, end) of mm of type, which must not overlap the
+ * others, with nothing else set up.  NULL with the error in *errp.
+ * Called with vm_lock held.
+ */
+static struct vma *
+vma_alloc(struct mm *mm, uintptr_t va, uintptr_t end, int type, int perm,
+	  int *errp)
+{
+	struct vma *v;
+
+	if (vma_overlaps(mm, va, end)) {
+		*errp = -STATUS_EINVAL;
+		return NULL;
+	}
+	if ((v = vma_slot(mm)) == NULL) {
+		*errp = -STATUS_ENOMEM;
+		return NULL;
+	}
+	v->start = va;
+	v->end = end;
+	v->type = type;
+	v->perm = perm;
+	v->file = NULL;
+	v->off = v->filesz = 0;
+	v->shm = NULL;
+	v->huge = false;
+	return v;
+}
+
+// Cut off the part of v below va, which is inside it
+static void
+vma_cut_front(struct vma *v, uintptr_t va)
+{
+	uint32_t n = va - v->start;
+
+	v->start = va;
+	v->off += n;
+	v->filesz = v->filesz > n ? v->filesz - n : 0;
+}
+
+/*
+ * The lowest address of [UMMAP, UMMAP_TOP) aligned to align with len
+ * free bytes in mm, or 0.  Called with vm_lock held.
+ */
+static uintptr_t
+vm_find_free(struct mm *mm, size_t len, size_t align)
+{
+	uintptr_t va = UMMAP;
+	struct vma *v;
+	int i;
+
+	// Past every region it overlaps, until nothing is in the way
+	for (i = 0; i < NVMA && va + len <= UMMAP_TOP; i++) {
+		v = &mm->vmas[i];
+		if (v->type != VMA_FREE && va < v->end && v->start < va + len) {
+			va = ROUNDUP(v->end, align);
+			i = -1;
+		}
+	}
+	return va + len <= UMMAP_TOP ? va : 0;
+}
+
+/*
+ * Add the region [va, va + len) of type to mm, it takes its own
+ * reference of file.
+ */
+int
+vm_map(struct mm *mm, uintptr_t va, size_t len, int type, int perm,
+       struct pc_file *file, uint32_t off, uint32_t filesz)
+{
+	uintptr_t end = va + ROUNDUP(len, PGSIZE);
+	struct vma *nv;
+	int err;
+
+	if (va % PGSIZE || end <= va || end > UTOP)
+		return -STATUS_EINVAL;
+	spin_lock(&vm_lock);
+	if ((nv = vma_alloc(mm, va, end, type, perm, &err)) == NULL) {
+		spin_unlock(&vm_lock);
+		return err;
+	}
+	nv->file = file;
+	nv->off = off;
+	nv->filesz = filesz;
+	if (type == VMA_FILE)
+		pcache_dup(file);
+	spin_unlock(&vm_lock);
+	return 0;
+}
+
+/*
+ * Add a region of len bytes of type to mm where there is room in
+ * [UMMAP, UMMAP_TOP), the address goes to *vap.  A huge one is rounded
+ * up to 4MB pages.  A VMA_SHM region maps the segment shm from its
+ * start and takes a reference of it.
+ */
+int
+vm_map_free(struct mm *mm, size_t len, int type, int perm, bool huge,
+	    struct shm *shm, uintptr_t *vap)
+{
+	size_t align = huge ? PTSIZE : PGSIZE;
+	struct vma *nv;
+	uintptr_t va;
+	int err = -STATUS_ENOMEM;
+
+	len = ROUNDUP(len, align);
+	if (len == 0)
+		return -STATUS_EINVAL;
+	spin_lock(&vm_lock);
+	if ((va = vm_find_free(mm, len, align)) != 0 &&
+	    (nv = vma_alloc(mm, va, va + len, type, perm, &err)) != NULL) {
+		nv->huge = huge;
+		if (type == VMA_SHM) {
+			nv->shm = shm;
+			shm_dup(shm);
+		}
+		*vap = va;
+		err = 0;
+	}
+	spin_unlock(&vm_lock);
+	return err;
+}
+
+/*
+ * Remove [va, end) from the regions of mm and unmap its pages.  The
+ * files of the regions which are gone are added to files, for the
+ * caller to close once vm_lock is dropped.  Called with vm_lock held.
+ */
+static int
+vma_remove(struct mm *mm, uintptr_t va, uintptr_t end,
+	   struct pc_file **files, int *np)
+{
+	struct vma *v, *nv;
+
+	// 4MB pages go as a whole
+	for (v = mm->vmas; v < mm->vmas + NVMA; v++)
+		if (v->type != VMA_FREE && v->huge &&
+		    ((v->start < va && va < v->end && va % PTSIZE) ||
+		     (v->start < end && end < v->end && end % PTSIZE)))
+			return -STATUS_EINVAL;
+	// A hole needs a slot for the part above it, the only region hit
+	v = vma_find(mm, va);
+	if (v && v->start < va && end < v->end) {
+		if ((nv = vma_slot(mm)) == NULL)
+			return -STATUS_ENOMEM;
+		*nv = *v;
+		vma_cut_front(nv, end);
+		if (v->type == VMA_FILE)
+			pcache_dup(v->file);
+		if (v->type == VMA_SHM)
+			shm_dup(v->shm);
+		v->end = va;
+	}
+	for (v = mm->vmas; v < mm->vmas + NVMA; v++) {
+		if (v->type == VMA_FREE || end <= v->start || v->end <= va)
+			continue;
+		if (v->start < va)
+			v->end = va;
+		else if (end < v->end)
+			vma_cut_front(v, end);
+		else {
+			if (v->type == VMA_FILE)
+				files[(*np)++] = v->file;
+			if (v->type == VMA_SHM)
+				shm_put(v->shm);
+			v->type = VMA_FREE;
+		}
+	}
+	page_remove_range(mm->pgdir, (void *)va, end - va);
+	return 0;
+}
+
+/*
+ * Remove [va, va + len) from the regions of mm.  A region may lose its
+ * front, its back or a hole in the middle, parts of the range which are
+ * not mapped are left alone.
+ */
+int
+vm_unmap(struct mm *mm, uintptr_t va, size_t len)
+{
+	uintptr_t end = va + ROUNDUP(len, PGSIZE);
+	struct pc_file *files[NVMA];
+	int i, n = 0, err;
+
+	if (va % PGSIZE || end <= va || end > UTOP)
+		return -STATUS_EINVAL;
+	spin_lock(&vm_lock);
+	err = vma_remove(mm, va, end, files, &n);
+	spin_unlock(&vm_lock);
+	// May close the file
+	for (i = 0; i < n; i++)
+		pcache_close(files[i]);
+	return err;
+}
+
+/*
+ * Move the end of the heap of mm, [UHEAP, brk), by incr bytes and put
+ * the old end in *oldp.  The heap is an anonymous region, which grows
+ * and shrinks with it a page at a time.
+ */
+int
+vm_sbrk(struct mm *mm, intptr_t incr, uintptr_t *oldp)
+{
+	struct pc_file *files[NVMA];
+	uintptr_t old, brk, a, b;
+	struct vma *v;
+	int i, n = 0, err = 0;
+
+	spin_lock(&vm_lock);
+	old = mm->brk;
+	brk = old + incr;
+	if ((incr > 0 && brk < old) || (incr < 0 && brk > old) ||
+	    brk < UHEAP || brk > UMMAP) {
+		spin_unlock(&vm_lock);
+		return -STATUS_EINVAL;
+	}
+	a = ROUNDUP(old, PGSIZE);
+	b = ROUNDUP(brk, PGSIZE);
+	if (b > a) {
+		// Grow the region which ends at the heap if there is one
+		v = a > UHEAP ? vma_find(mm, a - PGSIZE) : NULL;
+		if (vma_overlaps(mm, a, b))
+			err = -STATUS_ENOMEM;
+		else if (v && v->type == VMA_ANON && v->end == a)
+			v->end = b;
+		else
+			vma_alloc(mm, a, b, VMA_ANON, PTE_U | PTE_W, &err);
+	} else if (b < a)
+		err = vma_remove(mm, b, a, files, &n);
+	if (err == 0) {
+		mm->brk = brk;
+		*oldp = old;
+	}
+	spin_unlock(&vm_lock);
+	for (i = 0; i < n; i++)
+		pcache_close(files[i]);
+	return err;
+}
+
+// perm of the PTE of a page shared by a region with permissions perm
+static int
+share_perm(int perm)
+{
+	return perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm;
+}
+
+/*
+ * Map pp, which the caller keeps a reference of, at va of mm.  va must
+ * be in a region, copy on write if the region is writable.
+ */
+int
+vm_share(struct mm *mm, uintptr_t va, struct PageInfo *pp)
+{
+	struct vma *v;
+	int err = -STATUS_EFAULT;
+
+	spin_lock(&vm_lock);
+	if ((v = vma_find(mm, va)) != NULL)
+		err = page_insert(mm->pgdir, pp, (void *)va, share_perm(v->perm));
+	spin_unlock(&vm_lock);
+	return err < 0 ? err : 0;
+}
+
+// Unmap all regions of mm
+void
+vm_free(struct mm *mm)
+{
+	struct pc_file *files[NVMA];
+	struct vma *v;
+	int i, n = 0;
+
+	spin_lock(&vm_lock);
+	for (v = mm->vmas; v < mm->vmas + NVMA; v++) {
+		if (v->type != VMA_FREE)
+			page_remove_range(mm->pgdir, (void *)v->start, v->end - v->start);
+		if (v->type == VMA_FILE)
+			files[n++] = v->file;
+		if (v->type == VMA_SHM)
+			shm_put(v->shm);
+		v->type = VMA_FREE;
+	}
+	mm->brk = UHEAP;
+	spin_unlock(&vm_lock);
+	// May close the file
+	for (i = 0; i < n; i++)
+		pcache_close(files[i]);
+}
+
+// Give child copies of the 4MB pages of the huge region v of parent
+static int
+vm_fork_huge(struct mm *child, struct mm *parent, struct vma *v)
+{
+	struct PageInfo *pp;
+	uintptr_t a;
+	pde_t pde;
+	int err;
+
+	for (a = v->start; a < v->end; a += PTSIZE) {
+		pde = parent->pgdir[PDX(a)];
+		if (!(pde & PTE_P))
+			continue;
+		// Shared memory stays shared
+		if (v->type == VMA_SHM)
+			pp = pa2page(PDE_PS_ADDR(pde));
+		else if ((pp = page_alloc_huge(0)) == NULL)
+			return -STATUS_ENOMEM;
+		else
+			memcpy(page2kva(pp), KADDR(PDE_PS_ADDR(pde)), PTSIZE);
+		pp->pp_ref++;
+		err = page_insert_huge(child->pgdir, pp, (void *)a, v->perm);
+		page_decref(pp);
+		if (err < 0)
+			return -STATUS_ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Give child, which has no regions yet, the regions of parent, every
+ * mapped page shared copy on write, but those of huge regions.  On failure the caller frees the
+ * child, vm_free() releases what was shared.
+ */
+int
+vm_fork(struct mm *child, struct mm *parent)
+{
+	struct PageInfo *pp;
+	struct vma *v;
+	uintptr_t a;
+	pte_t *pte;
+	bool flush = false;
+	int err = 0;
+
+	spin_lock(&vm_lock);
+	child->brk = parent->brk;
+	for (v = parent->vmas; v < parent->vmas + NVMA && err == 0; v++) {
+		if (v->type == VMA_FREE)
+			continue;
+		child->vmas[v - parent->vmas] = *v;
+		if (v->type == VMA_FILE)
+			pcache_dup(v->file);
+		if (v->type == VMA_SHM)
+			shm_dup(v->shm);
+		if (v->huge) {
+			err = vm_fork_huge(child, parent, v);
+			continue;
+		}
+		for (a = v->start; a < v->end && err == 0; a += PGSIZE) {
+			// Skip page tables which were never needed
+			if (!(parent->pgdir[PDX(a)] & PTE_P)) {
+				a = ROUNDDOWN(a, PTSIZE) + PTSIZE - PGSIZE;
+				continue;
+			}
+			pte = pgdir_walk(parent->pgdir, (void *)a, 0);
+			if (!(*pte & PTE_P))
+				continue;
+			pp = pa2page(PTE_ADDR(*pte));
+			// Shared memory stays shared
+			if (v->type == VMA_SHM) {
+				if (page_insert(child->pgdir, pp, (void *)a, v->perm) < 0)
+					err = -STATUS_ENOMEM;
+				continue;
+			}
+			if (page_insert(child->pgdir, pp, (void *)a, share_perm(v->perm)) < 0) {
+				err = -STATUS_ENOMEM;
+				break;
+			}
+			// The parent's writes must fault from now on
+			if (*pte & PTE_W) {
+				*pte = (*pte & ~PTE_W) | PTE_COW;
+				flush = true;
+			}
+		}
+	}
+	if (flush)
+		tlb_shootdown(parent->pgdir, NULL, TLB_BATCH + 1);
+	spin_unlock(&vm_lock);
+	return err;
+}
+
+// A write to the copy on write page of pte at va
+static int
+vm_cow(struct mm *mm, uintptr_t va, pte_t *pte, int perm)
+{
+	struct PageInfo *old = pa2page(PTE_ADDR(*pte)), *pp;
+
+	if (!(*pte & PTE_COW))
+		return -STATUS_EFAULT;
+	// The others are gone, take it over
+	if (old->pp_ref == 1) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(mm->pgdir, (void *)va);
+		return 0;
+	}
+	if ((pp = page_alloc(0)) == NULL)
+		return -STATUS_ENOMEM;
+	memcpy(page2kva(pp), page2kva(old), PGSIZE);
+	// Drops the reference of old
+	if (page_insert(mm->pgdir, pp, (void *)va, perm) < 0) {
+		page_free(pp);
+		return -STATUS_ENOMEM;
+	}
+	return 0;
+}
+
+// Map the 4MB page at va of the huge region v, see vm_fault()
+static int
+vm_fault_huge(struct mm *mm, struct vma *v, uintptr_t va)
+{
+	uintptr_t a = ROUNDDOWN(va, PTSIZE);
+	struct PageInfo *pp;
+	int err = 0;
+
+	if (v->type == VMA_SHM)
+		pp = shm_page(v->shm, (v->off + a - v->start) / PGSIZE);
+	else if ((pp = page_alloc_huge(ALLOC_ZERO)) == NULL)
+		return -STATUS_ENOMEM;
+	pp->pp_ref++;
+	if (page_insert_huge(mm->pgdir, pp, (void *)a, v->perm) < 0)
+		err = -STATUS_ENOMEM;
+	page_decref(pp);
+	return err;
+}
+
+/*
+ * Map the page at va of mm, for an access which faulted.  Returns
+ * -STATUS_EFAULT if no region allows the access.
+ */
+int
+vm_fault(struct mm *mm, uintptr_t va, bool write)
+{
+	struct PageInfo *pp, *cp;
+	struct pc_file *f, *ra = NULL;
+	struct vma *v;
+	uint32_t pos, off, n, ra_off = 0;
+	pte_t *pte;
+	int perm, err = 0;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	spin_lock(&vm_lock);
+again:
+	v = vma_find(mm, va);
+	if (v == NULL || (write && !(v->perm & PTE_W))) {
+		err = -STATUS_EFAULT;
+		goto out;
+	}
+	pte = pgdir_walk(mm->pgdir, (void *)va, 0);
+	if (pte && (*pte & PTE_P)) {
+		// Mapped by now, or copy on write
+		if (write && !(*pte & PTE_W))
+			err = vm_cow(mm, va, pte, v->perm);
+		goto out;
+	}
+	if (v->huge) {
+		err = vm_fault_huge(mm, v, va);
+		goto out;
+	}
+
+	pos = va - v->start;
+	perm = v->perm;
+	if (v->type == VMA_FILE && pos < v->filesz) {
+		f = v->file;
+		off = v->off + pos;
+		if ((err = pcache_get(f, off, &cp)) < 0)
+			goto out;
+		// vm_lock was dropped, the region may have been cut or
+		// replaced meanwhile and va be another page of the file
+		v = vma_find(mm, va);
+		if (v == NULL || v->type != VMA_FILE || v->file != f ||
+		    v->perm != perm || v->off + (va - v->start) != off) {
+			page_decref(cp);
+			err = 0;
+			goto again;
+		}
+		pos = va - v->start;
+		// Waited for the disk, the next page is likely next
+		if (err > 0 && pos + PGSIZE < v->filesz) {
+			ra = v->file;
+			ra_off = off + PGSIZE;
+			pcache_dup(ra);
+		}
+		err = 0;
+		// The cached page as it is, until a write
+		if (pos + PGSIZE <= v->filesz && !write) {
+			pp = cp;
+			perm = share_perm(v->perm);
+		} else {
+			if ((pp = page_alloc(0)) == NULL) {
+				page_decref(cp);
+				err = -STATUS_ENOMEM;
+				goto out;
+			}
+			pp->pp_ref++;
+			n = MIN(PGSIZE, v->filesz - pos);
+			memcpy(page2kva(pp), page2kva(cp), n);
+			memset(page2kva(pp) + n, 0, PGSIZE - n);
+			page_decref(cp);
+		}
+	} else if (v->type == VMA_SHM) {
+		pp = shm_page(v->shm, (v->off + pos) / PGSIZE);
+		pp->pp_ref++;
+	} else {
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+			err = -STATUS_ENOMEM;
+			goto out;
+		}
+		pp->pp_ref++;
+	}
+
+	pte = pgdir_walk(mm->pgdir, (void *)va, 0);
+	if (!(pte && (*pte & PTE_P)) &&
+	    page_insert(mm->pgdir, pp, (void *)va, perm) < 0)
+		err = -STATUS_ENOMEM;
+	page_decref(pp);
+out:
+	spin_unlock(&vm_lock);
+	if (ra)
+		pcache_readahead(ra, ra_off);
+	return err;
+}
+
+/*
+ * Fault in [va, va + len) of the current task for a system call which
+ * accesses it with a spinlock held, where the fault handler must not
+ * wait for the disk.  Returns -STATUS_EFAULT if some of it is not
+ * accessible.
+ */
+int
+vm_prefault(const void *va, size_t len, bool write)
+{
+	struct mm *mm = thiscpu->cpu_task->mm;
+	uintptr_t a = ROUNDDOWN((uintptr_t)va, PGSIZE);
+	uintptr_t end = (uintptr_t)va + len;
+	pte_t *pte;
+	int err;
+
+	if (end < (uintptr_t)va || end > UTOP)
+		return -STATUS_EFAULT;
+	for (; a < end; a += PGSIZE) {
+		pte = pgdir_walk(mm->pgdir, (void *)a, 0);
+		if (pte && (*pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U) &&
+		    (!write || (*pte & PTE_W)))
+			continue;
+		if ((err = vm_fault(mm, a, write)) < 0)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * vm_prefault() for writing of the n elements of size bytes at buf.
+ * System calls which fill an array from data under a spinlock call it
+ * before they take the lock, a page fault there may not wait for the
+ * disk.  Returns -STATUS_EINVAL if n is negative.
+ */
+int
+vm_prefault_array(void *buf, int n, size_t size)
+{
+	if (n < 0)
+		return -STATUS_EINVAL;
+	if (size && n > UTOP / size)
+		return -STATUS_EFAULT;
+	return vm_prefault(buf, n * size, true);
+}
+
+/*
+ * The page at va of the current task's mm in *ppp, with a reference for
+ * the caller, e.g. a pipe.  It becomes copy on write if it is writable,
+ * so what the caller holds does not change under it.  Shared memory
+ * and 4MB pages can not, -STATUS_EINVAL.
+ */
+int
+vm_page_share(struct mm *mm, uintptr_t va, struct PageInfo **ppp)
+{
+	struct vma *v;
+	pte_t *pte;
+	int err;
+
+	if ((err = vm_prefault((void *)va, PGSIZE, false)) < 0)
+		return err;
+	spin_lock(&vm_lock);
+	v = vma_find(mm, va);
+	pte = pgdir_walk(mm->pgdir, (void *)va, 0);
+	if (v && (v->type == VMA_SHM || v->huge))
+		err = -STATUS_EINVAL;
+	else if (v && pte && (*pte & PTE_P)) {
+		if (*pte & PTE_W) {
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+			tlb_invalidate(mm->pgdir, (void *)va);
+		}
+		*ppp = pa2page(PTE_ADDR(*pte));
+		(*ppp)->pp_ref++;
+	} else
+		err = -STATUS_EFAULT;
+	spin_unlock(&vm_lock);
+	return err;
+}
+
+/*
+ * Copy len bytes from src in the kernel to va of mm, which need not be
+ * the current one, e.g. the arguments of a program on its new stack.
+ */
+int
+vm_copyout(struct mm *mm, uintptr_t va, const void *src, size_t len)
+{
+	pte_t *pte;
+	size_t n;
+	int err;
+
+	while (len > 0) {
+		n = MIN(len, PGSIZE - va % PGSIZE);
+		spin_lock(&vm_lock);
+		pte = pgdir_walk(mm->pgdir, (void *)va, 0);
+		if (!(pte && (*pte & PTE_P) && (*pte & PTE_W))) {
+			spin_unlock(&vm_lock);
+			if ((err = vm_fault(mm, va, true)) < 0)
+				return err;
+			continue;
+		}
+		memcpy(KADDR(pte_pa(*pte, (void *)va)), src, n);
+		spin_unlock(&vm_lock);
+		src = (const uint8_t *)src + n;
+		va += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copy len bytes from or to user memory of the current task, which was
+ * faulted in before (see vm_prefault()), maybe before taking a lock.
+ * Another thread may have unmapped it since: then the copy stops with
+ * -STATUS_EFAULT instead of faulting in the kernel, see copy_user() in
+ * uaccess.S.
+ */
+int copy_user(void *dst, const void *src, size_t n);
+
+static bool
+user_range(const void *va, size_t len)
+{
+	uintptr_t end = (uintptr_t)va + len;
+
+	return end >= (uintptr_t)va && end <= UTOP;
+}
+
+int
+copyin(void *dst, const void *usrc, size_t len)
+{
+	if (!user_range(usrc, len) || copy_user(dst, usrc, len) < 0)
+		return -STATUS_EFAULT;
+	return 0;
+}
+
+int
+copyout(void *udst, const void *src, size_t len)
+{
+	if (!user_range(udst, len) || copy_user(udst, src, len) < 0)
+		return -STATUS_EFAULT;
+	return 0;
+}
+
+// Copy the string at user address src into dst, returns its length
+int
+vm_copyin_str(char *dst, const char *src, size_t max)
+{
+	size_t i;
+
+	for (i = 0; i < max; i++) {
+		if ((i == 0 || (uintptr_t)(src + i) % PGSIZE == 0) &&
+		    vm_prefault(src + i, 1, false) < 0)
+			return -STATUS_EFAULT;
+		if (copyin(&dst[i], src + i, 1) < 0)
+			return -STATUS_EFAULT;
+		if (dst[i] == '\0')
+			return i;
+	}
+	return -STATUS_EINVAL;
+}
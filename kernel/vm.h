@@ -0,0 +1,76 @@
+#ifndef VM_H
+#define VM_H
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <kernel/spinlock.h>
+
+#define NVMA	16	// Regions per task
+
+enum {
+	VMA_FREE = 0,
+	VMA_ANON,	// Zero filled on first touch
+	VMA_FILE,	// Read from the page cache on first touch
+	VMA_SHM,	// Pages of a shared memory segment, see shm.c
+};
+
+// Software PTE bit of pages shared read-only by a writable region,
+// the first write copies them
+#define PTE_COW		0x800
+
+struct pc_file;
+struct PageInfo;
+struct shm;
+
+// A region of a task's address space, see vm.c
+struct vma {
+	uintptr_t start;	// Page aligned
+	uintptr_t end;
+	int type;
+	int perm;		// PTE_U, maybe PTE_W
+	struct pc_file *file;	// VMA_FILE
+	uint32_t off;		// File or segment offset of start
+	uint32_t filesz;	// Bytes of the file from start on, zero after
+	struct shm *shm;	// VMA_SHM
+	bool huge;		// In 4MB pages, start and end aligned to it
+};
+
+// An address space, shared by the threads of a program
+struct mm {
+	pde_t *pgdir;
+	struct vma vmas[NVMA];
+	uintptr_t brk;		// End of the heap, see sbrk()
+	int ref;		// Tasks using it, 0 if free
+};
+
+// Protects the user page tables and regions of all tasks, the page
+// cache and the reference counts of the pages they map.  Taken after
+// tasks_lock, before page_lock, never held while taking fs_lock.
+extern struct spinlock vm_lock;
+
+void vm_init(void);
+struct mm *mm_alloc(void);
+void mm_get(struct mm *mm);
+void mm_put(struct mm *mm);
+int vm_map(struct mm *mm, uintptr_t va, size_t len, int type, int perm,
+	   struct pc_file *file, uint32_t off, uint32_t filesz);
+int vm_map_free(struct mm *mm, size_t len, int type, int perm, bool huge,
+		struct shm *shm, uintptr_t *vap);
+int vm_unmap(struct mm *mm, uintptr_t va, size_t len);
+int vm_sbrk(struct mm *mm, intptr_t incr, uintptr_t *oldp);
+int vm_share(struct mm *mm, uintptr_t va, struct PageInfo *pp);
+void vm_free(struct mm *mm);
+int vm_fork(struct mm *child, struct mm *parent);
+int vm_fault(struct mm *mm, uintptr_t va, bool write);
+int vm_prefault(const void *va, size_t len, bool write);
+int vm_prefault_array(void *buf, int n, size_t size);
+int vm_page_share(struct mm *mm, uintptr_t va, struct PageInfo **ppp);
+int vm_copyout(struct mm *mm, uintptr_t va, const void *src, size_t len);
+int vm_copyin_str(char *dst, const char *src, size_t max);
+int copyin(void *dst, const void *usrc, size_t len);
+int copyout(void *udst, const void *src, size_t len);
+int sys_exec(const char *path, char *const argv[]);
+int sys_spawn(const char *path, char *const argv[]);
+int sys_sbrk(intptr_t incr);
+int sys_mmap(void *addr, size_t len, int prot, int flags);
+int sys_munmap(void *addr, size_t len);
+#endif
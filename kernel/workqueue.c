@@ -0,0 +1,119 @@
+/*
+ * Work queues: a kernel thread per CPU, "kworker/N", runs the work
+ * items queued on its CPU one after the other.  The item is the
+ * caller's, usually embedded in the object it works on, and may be
+ * queued again as soon as its fn runs, even by fn itself.
+ *
+ * Not to be called with tasks_lock held, waking the worker needs it.
+ */
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/spinlock.h>
+#include <kernel/workqueue.h>
+
+struct worker {
+	struct spinlock lock;	// Protects the rest
+	struct work *head;
+	struct work *tail;
+	uint32_t queued;	// Items ever queued and done, for flushing
+	uint32_t done;
+	struct wait_queue wait;	// The worker waits for items
+	struct wait_queue idle;	// flush_workqueue() waits for the worker
+};
+
+static struct worker workers[NCPU];
+
+static void
+worker_main(void *arg)
+{
+	struct worker *wk = arg;
+	struct work *w;
+
+	spin_lock(&wk->lock);
+	for (;;) {
+		while ((w = wk->head) == NULL)
+			wq_sleep(&wk->wait, &wk->lock);
+		if ((wk->head = w->next) == NULL)
+			wk->tail = NULL;
+		spin_unlock(&wk->lock);
+		// Queueing it again from here on runs it again
+		xchg(&w->pending, 0);
+
+		w->fn(w);
+		// Nothing preempts the kernel, let the others run between
+		// the items if our slice is used up
+		sched_yield();
+
+		spin_lock(&wk->lock);
+		wk->done++;
+		// Flushers queue up with wk->lock held, the head is stable
+		if (wk->idle.head)
+			wq_wake_all(&wk->idle);
+	}
+}
+
+void
+workqueue_init(void)
+{
+	char name[16];
+	int c;
+
+	for (c = 0; c < ncpu; c++) {
+		spin_initlock(&workers[c].lock);
+		wq_init(&workers[c].wait);
+		wq_init(&workers[c].idle);
+		snprintf(name, sizeof(name), "kworker/%d", c);
+		if (kthread_create(worker_main, &workers[c], name, c) < 0)
+			panic("workqueue_init: no task for %s", name);
+	}
+}
+
+/*
+ * Run w->fn(w) on the worker of CPU cpu.  Returns false if w was still
+ * pending, it runs only once then.
+ */
+bool
+queue_work_on(int cpu, struct work *w)
+{
+	struct worker *wk = &workers[cpu];
+
+	assert(cpu >= 0 && cpu < ncpu);
+	// Queued on one CPU at a time
+	if (xchg(&w->pending, 1))
+		return false;
+	spin_lock(&wk->lock);
+	w->next = NULL;
+	if (wk->tail)
+		wk->tail->next = w;
+	else
+		wk->head = w;
+	wk->tail = w;
+	wk->queued++;
+	spin_unlock(&wk->lock);
+	wq_wake_one(&wk->wait);
+	return true;
+}
+
+// On the worker of this CPU
+bool
+queue_work(struct work *w)
+{
+	return queue_work_on(cpunum(), w);
+}
+
+// Wait until the items queued on CPU cpu so far are done
+void
+flush_workqueue(int cpu)
+{
+	struct worker *wk = &workers[cpu];
+	uint32_t target;
+
+	spin_lock(&wk->lock);
+	target = wk->queued;
+	while ((int32_t)(wk->done - target) < 0)
+		wq_sleep(&wk->idle, &wk->lock);
+	spin_unlock(&wk->lock);
+}
@@ -0,0 +1,24 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+#include <inc/types.h>
+
+// Deferred work, see workqueue.c
+struct work {
+	void (*fn)(struct work *);
+	struct work *next;
+	volatile uint32_t pending;	// Queued and not started yet
+};
+
+static inline void
+work_init(struct work *w, void (*fn)(struct work *))
+{
+	w->fn = fn;
+	w->next = NULL;
+	w->pending = 0;
+}
+
+void workqueue_init(void);
+bool queue_work(struct work *w);
+bool queue_work_on(int cpu, struct work *w);
+void flush_workqueue(int cpu);
+#endif
@@ -16,8 +16,7 @@ int
 getchar(void)
 {
 	int r;
-	// sys_cgetc does not block, but getchar should.
+	// getc blocks in the kernel until a key is pressed.
 	while ((r = getc()) == 0){};
-		//sys_yield();
 	return r;
 }
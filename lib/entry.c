@@ -0,0 +1,15 @@
+/*
+ * Entry point of the programs started by exec(), which leaves argc
+ * and argv on the stack like a call.  Not in libnctuos.a, the shell
+ * image has its own _start.
+ */
+#include <inc/syscall.h>
+
+int main(int argc, char **argv);
+
+void
+_start(int argc, char **argv)
+{
+	main(argc, argv);
+	kill(0);
+}
@@ -0,0 +1,185 @@
+// malloc() and friends, see inc/malloc.h.
+// Every block starts with a header, a free small block keeps the next
+// one of its free list right after it.
+
+#include <inc/malloc.h>
+#include <inc/string.h>
+#include <inc/sync.h>
+#include <inc/syscall.h>
+#include <inc/tls.h>
+
+#define MALLOC_MIN	16		// Smallest class, with the header
+#define MALLOC_MAX	(MALLOC_MIN << (MALLOC_CLASSES - 1))
+#define MALLOC_LARGE	MALLOC_CLASSES	// cls of an mmap()ed block
+#define MALLOC_CHUNK	(64 * 1024)	// Taken from sbrk() at a time
+#define MALLOC_BATCH	8192		// Bytes moved to or from a cache
+#define MALLOC_MAP	4096		// Granularity of mmap()
+
+struct mhdr {
+	uint32_t size;		// Bytes of the block, with the header
+	uint32_t cls;
+};
+
+struct mfree {
+	struct mhdr h;
+	struct mfree *next;
+};
+
+// The free lists all threads share, and the rest of the last chunk
+static struct mutex malloc_lock = MUTEX_INITIALIZER;
+static struct mfree *central[MALLOC_CLASSES];
+static char *chunk, *chunk_end;
+
+// The class of a block of n bytes with the header
+static int
+size_class(size_t n)
+{
+	int c = 0;
+
+	while ((MALLOC_MIN << c) < n)
+		c++;
+	return c;
+}
+
+// Blocks of class c moved between a cache and the free lists at once
+static int
+batch(int c)
+{
+	int n = MALLOC_BATCH / (MALLOC_MIN << c);
+
+	return n > 32 ? 32 : n;
+}
+
+/*
+ * Fill the cache with a batch of class c from the free lists, or from
+ * the heap if they run out.  Returns false if the heap is full.
+ */
+static bool
+refill(struct malloc_cache *mc, int c)
+{
+	uint32_t size = MALLOC_MIN << c;
+	struct mfree *b;
+	char *p;
+	int i;
+
+	mutex_lock(&malloc_lock);
+	for (i = 0; i < batch(c); i++) {
+		if ((b = central[c]) != NULL)
+			central[c] = b->next;
+		else {
+			if (chunk + size > chunk_end) {
+				// The rest of the old chunk stays unused
+				if ((int)(p = sbrk(MALLOC_CHUNK)) < 0)
+					break;
+				if (p != chunk_end)
+					chunk = p;
+				chunk_end = p + MALLOC_CHUNK;
+			}
+			b = (struct mfree *)chunk;
+			b->h.size = size;
+			b->h.cls = c;
+			chunk += size;
+		}
+		b->next = mc->free[c];
+		mc->free[c] = b;
+		mc->count[c]++;
+	}
+	mutex_unlock(&malloc_lock);
+	return mc->free[c] != NULL;
+}
+
+// Give a batch of class c back to the free lists
+static void
+drain(struct malloc_cache *mc, int c)
+{
+	struct mfree *b;
+	int i;
+
+	mutex_lock(&malloc_lock);
+	for (i = 0; i < batch(c); i++) {
+		b = mc->free[c];
+		mc->free[c] = b->next;
+		mc->count[c]--;
+		b->next = central[c];
+		central[c] = b;
+	}
+	mutex_unlock(&malloc_lock);
+}
+
+void *
+malloc(size_t size)
+{
+	struct malloc_cache *mc;
+	struct mhdr *h;
+	struct mfree *b;
+	uint32_t n;
+	int c;
+
+	if (size > MALLOC_MAX - sizeof(*h)) {
+		n = ROUNDUP(size + sizeof(*h), MALLOC_MAP);
+		if (n < size || (int)(h = mmap(NULL, n, PROT_READ | PROT_WRITE,
+					      MAP_ANON)) < 0)
+			return NULL;
+		h->size = n;
+		h->cls = MALLOC_LARGE;
+		return h + 1;
+	}
+	c = size_class(size + sizeof(*h));
+	mc = &tls_get()->mcache;
+	if (mc->free[c] == NULL && !refill(mc, c))
+		return NULL;
+	b = mc->free[c];
+	mc->free[c] = b->next;
+	mc->count[c]--;
+	return &b->next;
+}
+
+void
+free(void *p)
+{
+	struct malloc_cache *mc;
+	struct mhdr *h = (struct mhdr *)p - 1;
+	struct mfree *b = (struct mfree *)h;
+
+	if (p == NULL)
+		return;
+	if (h->cls == MALLOC_LARGE) {
+		munmap(h, h->size);
+		return;
+	}
+	mc = &tls_get()->mcache;
+	b->next = mc->free[h->cls];
+	mc->free[h->cls] = b;
+	// Other threads may need them more
+	if (++mc->count[h->cls] >= 2 * batch(h->cls))
+		drain(mc, h->cls);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	void *p;
+
+	if (size && n > (size_t)-1 / size)
+		return NULL;
+	if ((p = malloc(n * size)) != NULL)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	struct mhdr *h = (struct mhdr *)p - 1;
+	void *np;
+
+	if (p == NULL)
+		return malloc(size);
+	if (size <= h->size - sizeof(*h))
+		return p;
+	if ((np = malloc(size)) == NULL)
+		return NULL;
+	memcpy(np, p, h->size - sizeof(*h));
+	free(p);
+	return np;
+}
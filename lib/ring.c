@@ -0,0 +1,97 @@
+// A single producer, single consumer message queue, see inc/ring.h.
+// head and tail run freely, a message goes to slot head & mask.
+
+#include <inc/ring.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+
+struct ring *
+ring_init(void *mem, size_t memsize, size_t msgsize)
+{
+	struct ring *r = mem;
+	uint32_t slots = 1;
+
+	if (memsize < sizeof(*r) || msgsize == 0)
+		return NULL;
+	while (slots * 2 * msgsize <= memsize - sizeof(*r))
+		slots *= 2;
+	if (slots < 2)
+		return NULL;
+	memset(r, 0, sizeof(*r));
+	r->mask = slots - 1;
+	r->msgsize = msgsize;
+	return r;
+}
+
+/*
+ * Sleep while *word is val.  waiting is set first with a full barrier:
+ * either the other side moves word after that and sees it, or we see
+ * the moved word here.
+ */
+static void
+ring_wait(volatile uint32_t *waiting, volatile uint32_t *word, uint32_t val)
+{
+	xchg(waiting, 1);
+	if (*word == val)
+		futex_wait(word, val, 0);
+	*waiting = 0;
+}
+
+// Called after moving word, the only system call of the fast path
+static void
+ring_wake(volatile uint32_t *waiting, volatile uint32_t *word)
+{
+	if (*waiting && xchg(waiting, 0))
+		futex_wake(word, 1);
+}
+
+bool
+ring_trysend(struct ring *r, const void *msg)
+{
+	uint32_t head = r->head;
+
+	if (head - r->tail_cache > r->mask) {
+		r->tail_cache = r->tail;
+		if (head - r->tail_cache > r->mask)
+			return false;
+	}
+	memcpy(r->data + (head & r->mask) * r->msgsize, msg, r->msgsize);
+	// Also a barrier, the message is in before head says so and
+	// cons_waiting is read after
+	xchg(&r->head, head + 1);
+	ring_wake(&r->cons_waiting, &r->head);
+	return true;
+}
+
+void
+ring_send(struct ring *r, const void *msg)
+{
+	// Full while tail is one lap behind head
+	while (!ring_trysend(r, msg))
+		ring_wait(&r->prod_waiting, &r->tail, r->head - r->mask - 1);
+}
+
+bool
+ring_tryrecv(struct ring *r, void *msg)
+{
+	uint32_t tail = r->tail;
+
+	if (tail == r->head_cache) {
+		r->head_cache = r->head;
+		if (tail == r->head_cache)
+			return false;
+	}
+	memcpy(msg, r->data + (tail & r->mask) * r->msgsize, r->msgsize);
+	// The slot is copied out before the producer may reuse it
+	xchg(&r->tail, tail + 1);
+	ring_wake(&r->prod_waiting, &r->tail);
+	return true;
+}
+
+void
+ring_recv(struct ring *r, void *msg)
+{
+	while (!ring_tryrecv(r, msg))
+		ring_wait(&r->cons_waiting, &r->head, r->tail);
+}
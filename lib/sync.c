@@ -0,0 +1,135 @@
+// Mutexes, condition variables and semaphores on futexes, see inc/sync.h.
+// The mutex is the one of Drepper, "Futexes Are Tricky".
+
+#include <inc/stdio.h>
+#include <inc/sync.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+
+#define WAKE_ALL	0x7fffffff
+
+void
+mutex_init(struct mutex *m)
+{
+	m->val = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->val, 0, 1)) == 0)
+		return;
+	// Whoever unlocks it after us has to wake somebody up
+	if (c != 2)
+		c = xchg(&m->val, 2);
+	while (c != 0) {
+		futex_wait(&m->val, 2, 0);
+		c = xchg(&m->val, 2);
+	}
+}
+
+bool
+mutex_trylock(struct mutex *m)
+{
+	return cmpxchg(&m->val, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (xadd(&m->val, -1) != 1) {
+		m->val = 0;
+		futex_wake(&m->val, 1);
+	}
+}
+
+void
+cond_init(struct cond *c)
+{
+	c->seq = 0;
+}
+
+int
+cond_timedwait(struct cond *c, struct mutex *m, int32_t ticks)
+{
+	uint32_t seq = c->seq;
+	int err;
+
+	mutex_unlock(m);
+	// Returns at once if it was signalled since we read seq
+	err = futex_wait(&c->seq, seq, ticks);
+	// Others may have been woken up with us, take it as contended
+	while (xchg(&m->val, 2) != 0)
+		futex_wait(&m->val, 2, 0);
+	return err == -STATUS_ETIMEDOUT ? err : 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+void
+cond_signal(struct cond *c)
+{
+	xadd(&c->seq, 1);
+	futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	xadd(&c->seq, 1);
+	futex_wake(&c->seq, WAKE_ALL);
+}
+
+void
+sem_init(struct sem *s, uint32_t count)
+{
+	s->count = count;
+	s->waiters = 0;
+}
+
+bool
+sem_trywait(struct sem *s)
+{
+	uint32_t v;
+
+	while ((v = s->count) > 0)
+		if (cmpxchg(&s->count, v, v - 1) == v)
+			return true;
+	return false;
+}
+
+int
+sem_timedwait(struct sem *s, int32_t ticks)
+{
+	int err = 0;
+
+	while (!sem_trywait(s)) {
+		if (err == -STATUS_ETIMEDOUT)
+			return err;
+		xadd(&s->waiters, 1);
+		// Not asleep if sem_post() came first
+		err = futex_wait(&s->count, 0, ticks);
+		xadd(&s->waiters, -1);
+	}
+	return 0;
+}
+
+void
+sem_wait(struct sem *s)
+{
+	sem_timedwait(s, 0);
+}
+
+void
+sem_post(struct sem *s)
+{
+	xadd(&s->count, 1);
+	if (s->waiters)
+		futex_wake(&s->count, 1);
+}
@@ -1,4 +1,8 @@
 #include <inc/syscall.h>
+#include <inc/memlayout.h>
+#include <inc/tls.h>
+#include <inc/time.h>
+#include <inc/x86.h>
 
 #define T_SYSCALL	0x30
 
@@ -18,7 +22,7 @@ ret_t name(typ_arg1 a1, typ_arg2 a2, typ_arg3 a3, typ_arg4 a4) { return syscall(
 
 
 static inline int32_t
-syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+syscall_int(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
@@ -48,6 +52,75 @@ syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5
 	return ret;
 }
 
+static inline int32_t
+syscall_sysenter(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
+{
+	int32_t ret;
+
+	// Fast system call: same registers as syscall_int() except that
+	// SI carries the return address and BP the stack pointer for
+	// sysenter_entry (kernel/trap_entry.S), so only four parameters
+	// fit.  sysexit clobbers DX and CX.
+	asm volatile("pushl %%ebp\n\t"
+		"movl %%esp, %%ebp\n\t"
+		"leal 1f, %%esi\n\t"
+		"sysenter\n"
+		"1:\n\t"
+		"popl %%ebp\n"
+		: "=a" (ret),
+		  "+d" (a1),
+		  "+c" (a2)
+		: "0" (num),
+		  "b" (a3),
+		  "D" (a4)
+		: "esi", "cc", "memory");
+
+	return ret;
+}
+
+// 1 if we enter the kernel with sysenter, 0 for the int gate,
+// -1 until the first system call probes the CPU.
+static int sysenter_enabled = -1;
+
+static int
+sysenter_probe(void)
+{
+	uint32_t eax, edx;
+
+	cpuid(1, &eax, NULL, NULL, &edx);
+	if (!(edx & CPUID_FEAT_SEP))
+		return 0;
+	// The Pentium Pro reports SEP without supporting it
+	if (((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3 && (eax & 0xF) < 3)
+		return 0;
+	return 1;
+}
+
+int
+fast_syscall(int enable)
+{
+	int old;
+
+	if (sysenter_enabled < 0)
+		sysenter_enabled = sysenter_probe();
+	old = sysenter_enabled;
+	if (enable == 0)
+		sysenter_enabled = 0;
+	else if (enable > 0)
+		sysenter_enabled = sysenter_probe();
+	return old;
+}
+
+static inline int32_t
+syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	if (sysenter_enabled < 0)
+		sysenter_enabled = sysenter_probe();
+	if (sysenter_enabled && a5 == 0)
+		return syscall_sysenter(num, a1, a2, a3, a4);
+	return syscall_int(num, a1, a2, a3, a4, a5);
+}
+
 //***********Lab7 syscalls***********//
 SYSCALL_1ARG(close, int, int)
 SYSCALL_3ARG(open, int, const char *, int, int)
@@ -56,6 +129,10 @@ SYSCALL_3ARG(write, int, int, const void *, size_t)
 SYSCALL_3ARG(lseek, off_t, int, off_t, int)
 SYSCALL_1ARG(unlink, int, const char *)
 SYSCALL_1ARG(readdir, int, const char *)
+SYSCALL_1ARG(pipe, int, int *)
+SYSCALL_2ARG(dup2, int, int, int)
+SYSCALL_3ARG(splice, int, int, int, size_t)
+SYSCALL_3ARG(vmsplice, int, int, const void *, size_t)
 
 SYSCALL_NOARG(getc, int)
 
@@ -92,3 +169,113 @@ settextcolor(unsigned char forecolor, unsigned char backcolor)
 }
 
 SYSCALL_NOARG(cls, int32_t);
+
+SYSCALL_3ARG(lockstat, int, struct lockstat *, int, bool)
+SYSCALL_NOARG(yield, int32_t);
+SYSCALL_3ARG(prof, int, int, struct prof_sample *, int)
+SYSCALL_2ARG(perf_read, int, int, struct perf_counts *)
+SYSCALL_3ARG(ktrace, int, int, struct trace_event *, int)
+SYSCALL_2ARG(task_stat, int, struct task_stat *, int)
+SYSCALL_2ARG(cpu_stat, int, struct cpu_stat *, int)
+SYSCALL_3ARG(sched_setscheduler, int, int, int, int)
+SYSCALL_2ARG(exec, int, const char *, char *const *)
+SYSCALL_2ARG(spawn, int, const char *, char *const *)
+
+SYSCALL_3ARG(futex_wait, int, volatile uint32_t *, uint32_t, int32_t)
+SYSCALL_2ARG(futex_wake, int, volatile uint32_t *, int)
+
+SYSCALL_2ARG(shm_create, int, size_t, int)
+SYSCALL_1ARG(shm_remove, int, int)
+
+// Addresses of segments are below 2GB, errors stay negative
+void *
+shm_map(int id)
+{
+	return (void *)syscall(SYS_shm_map, id, 0, 0, 0, 0);
+}
+
+// The same for the heap and mmap()
+void *
+sbrk(intptr_t incr)
+{
+	return (void *)syscall(SYS_sbrk, incr, 0, 0, 0, 0);
+}
+
+void *
+mmap(void *addr, size_t len, int prot, int flags)
+{
+	return (void *)syscall(SYS_mmap, (uint32_t)addr, len, prot, flags, 0);
+}
+
+SYSCALL_2ARG(munmap, int, void *, size_t)
+
+// The thread starts on its own stack, where fn and arg wait for it,
+// with the registers of the int gate.  It never returns here.
+int
+clone(int (*fn)(void *), void *arg, void *stack, void *tls)
+{
+	uint32_t *sp = (uint32_t *)ROUNDDOWN((uint32_t)stack, 16);
+	int32_t ret;
+
+	*--sp = (uint32_t)arg;
+	*--sp = (uint32_t)fn;
+	if (tls)
+		((struct tls *)tls)->self = tls;
+	asm volatile("int %1\n\t"
+		"testl %%eax, %%eax\n\t"
+		"jnz 1f\n\t"
+		// The thread: fn(arg), then kill(0)
+		"popl %%eax\n\t"
+		"call *%%eax\n\t"
+		"movl %2, %%eax\n\t"
+		"xorl %%edx, %%edx\n\t"
+		"int %1\n"
+		"1:\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "i" (SYS_kill),
+		  "0" (SYS_clone),
+		  "d" (sp),
+		  "c" (tls)
+		: "cc", "memory");
+	return ret;
+}
+
+// The child of vfork() runs on our stack, its next call overwrites the
+// saved frame pointer and return address of this frame before the
+// parent gets to return.  Keep them in registers, which the int gate
+// preserves, and put them back.  Only caller saved ones, which aren't
+// saved in the frame.  Needs the frame pointer, see -O0 in
+// lib/Makefile.
+int32_t
+vfork(void)
+{
+	int32_t ret;
+
+	asm volatile("movl (%%ebp), %%ecx\n\t"
+		"movl 4(%%ebp), %%edx\n\t"
+		"int %1\n\t"
+		"movl %%ecx, (%%ebp)\n\t"
+		"movl %%edx, 4(%%ebp)\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_vfork)
+		: "ecx", "edx", "cc", "memory");
+	return ret;
+}
+
+// Reads the clock data at UVCLOCK, only traps into the kernel when the
+// TSC is not usable
+int
+clock_gettime(int clk, struct timespec *tp)
+{
+	const volatile struct vclock *vc = (const volatile struct vclock *)UVCLOCK;
+	uint64_t ns;
+
+	if (clk != CLOCK_MONOTONIC || vc->mult == 0)
+		return syscall(SYS_clock_gettime, clk, (uint32_t)tp, 0, 0, 0);
+	ns = vclock_read(vc);
+	tp->tv_sec = ns / NSEC_PER_SEC;
+	tp->tv_nsec = ns % NSEC_PER_SEC;
+	return 0;
+}
@@ -0,0 +1,653 @@
+/*
+ * Micro benchmark suite, "bench [name...]" in the shell.
+ *
+ * Every benchmark times single operations with rdtsc and prints
+ * min/median/p99 in cycles, which are much more stable run to run than
+ * averages.  The cost of rdtsc itself is subtracted.
+ */
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+#include <inc/time.h>
+#include <inc/ring.h>
+#include <inc/malloc.h>
+
+#define BENCH_SAMPLES	1000
+
+struct bench {
+	const char *name;
+	const char *desc;
+	void (*func)(void);
+};
+
+static uint32_t samples[BENCH_SAMPLES];
+static uint32_t tsc_overhead;
+
+void kill_self(void);
+
+static void
+sort_samples(uint32_t *s, int n)
+{
+	int gap, i, j;
+	uint32_t v;
+
+	// Shell sort, the sample sets are small
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			v = s[i];
+			for (j = i; j >= gap && s[j - gap] > v; j -= gap)
+				s[j] = s[j - gap];
+			s[j] = v;
+		}
+}
+
+static void
+report(const char *what, uint32_t *s, int n)
+{
+	if (n <= 0) {
+		cprintf("%-16s no samples\n", what);
+		return;
+	}
+	sort_samples(s, n);
+	cprintf("%-16s %6d %10u %10u %10u\n", what, n,
+		s[0], s[n / 2], s[(n * 99) / 100]);
+}
+
+// Cycles since start, minus the cost of reading the TSC
+static uint32_t
+elapsed(uint64_t start)
+{
+	uint32_t d = read_tsc() - start;
+
+	return d > tsc_overhead ? d - tsc_overhead : 0;
+}
+
+static void
+calibrate_tsc(void)
+{
+	uint64_t start;
+	int i;
+
+	tsc_overhead = 0;
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		samples[i] = elapsed(start);
+	}
+	sort_samples(samples, BENCH_SAMPLES);
+	tsc_overhead = samples[0];
+}
+
+static void
+bench_syscall_once(const char *what)
+{
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		getpid();
+		samples[i] = elapsed(start);
+	}
+	report(what, samples, BENCH_SAMPLES);
+}
+
+static void
+bench_syscall(void)
+{
+	int old = fast_syscall(0);
+
+	bench_syscall_once("syscall int");
+	fast_syscall(1);
+	if (fast_syscall(-1))
+		bench_syscall_once("syscall sysenter");
+	fast_syscall(old);
+}
+
+// clock_gettime() reads the shared clock page, compare with a trap
+static void
+bench_clock(void)
+{
+	struct timespec ts;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		samples[i] = elapsed(start);
+	}
+	report("clock_gettime", samples, BENCH_SAMPLES);
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		get_ticks();
+		samples[i] = elapsed(start);
+	}
+	report("get_ticks", samples, BENCH_SAMPLES);
+}
+
+// Time fork() in the parent, the child exits right away.  Sleep between
+// rounds so the children are reaped and the task table does not fill up.
+#define FORK_SAMPLES 50
+static void
+bench_fork(void)
+{
+	uint64_t start;
+	int i, n = 0, pid;
+
+	for (i = 0; i < FORK_SAMPLES; i++) {
+		start = read_tsc();
+		pid = fork();
+		if (pid == 0)
+			kill_self();
+		if (pid < 0)
+			break;
+		samples[n++] = elapsed(start);
+		sleep(1);
+	}
+	report("fork", samples, n);
+}
+
+// Time starting "true" from the disk, with spawn() and with vfork()
+// and exec().  The child of vfork() has exec()ed by the time the parent
+// runs again.  "make install" has to have copied it.
+static void
+bench_spawn(void)
+{
+	char *argv[] = { "true", NULL };
+	uint64_t start;
+	int i, n = 0, pid;
+
+	for (i = 0; i < FORK_SAMPLES; i++) {
+		start = read_tsc();
+		if ((pid = spawn(argv[0], argv)) < 0)
+			break;
+		samples[n++] = elapsed(start);
+		sleep(1);
+	}
+	report("spawn", samples, n);
+
+	for (i = n = 0; i < FORK_SAMPLES; i++) {
+		start = read_tsc();
+		pid = vfork();
+		if (pid == 0) {
+			exec(argv[0], argv);
+			kill_self();
+		}
+		if (pid < 0)
+			break;
+		samples[n++] = elapsed(start);
+		sleep(1);
+	}
+	report("vfork+exec", samples, n);
+}
+
+// clone() in the parent, the thread exits right away, then a futex
+// ping-pong between two threads of the program.  Every thread gets
+// its own stack, there is no way to wait for one to be gone.
+#define CLONE_STACK 256
+#define PONG_STACK 4096
+static uint8_t clone_stacks[FORK_SAMPLES][CLONE_STACK] __attribute__((aligned(16)));
+static uint8_t pong_stack[PONG_STACK] __attribute__((aligned(16)));
+static volatile uint32_t turn;
+
+static int
+thread_exit(void *arg)
+{
+	return 0;
+}
+
+static int
+pong(void *arg)
+{
+	int i;
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		while (turn != 1)
+			futex_wait(&turn, 0, 0);
+		turn = 0;
+		futex_wake(&turn, 1);
+	}
+	return 0;
+}
+
+static void
+bench_clone(void)
+{
+	uint64_t start;
+	int i, n = 0;
+
+	for (i = 0; i < FORK_SAMPLES; i++) {
+		start = read_tsc();
+		if (clone(thread_exit, NULL, clone_stacks[i + 1], NULL) < 0)
+			break;
+		samples[n++] = elapsed(start);
+		sleep(1);
+	}
+	report("clone", samples, n);
+
+	turn = 0;
+	if (clone(pong, NULL, pong_stack + PONG_STACK, NULL) < 0)
+		return;
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		turn = 1;
+		futex_wake(&turn, 1);
+		while (turn != 0)
+			futex_wait(&turn, 1, 0);
+		samples[i] = elapsed(start);
+	}
+	report("futex pingpong", samples, BENCH_SAMPLES);
+}
+
+// Pages through a pipe to a child which reads them: write() copies
+// each one in, vmsplice() hands it over.  The pages are not written
+// to while timing, or vmsplice() would cost a copy on write fault.
+// The shell image is small, the same few pages go round.
+#define PIPE_PAGES 8
+#define PIPE_SAMPLES 256
+#define PIPE_PAGE_SIZE 4096
+#define PIPE_WAIT_TASKS 32
+static char pipe_pages[PIPE_PAGES][PIPE_PAGE_SIZE] __attribute__((aligned(PIPE_PAGE_SIZE)));
+static char pipe_rbuf[PIPE_PAGE_SIZE];
+
+static void
+wait_gone(int pid)
+{
+	struct task_stat st[PIPE_WAIT_TASKS];
+	int i, n;
+
+	do {
+		sleep(1);
+		n = task_stat(st, PIPE_WAIT_TASKS);
+		for (i = 0; i < n; i++)
+			if (st[i].pid == pid)
+				break;
+	} while (i < n);
+}
+
+static void
+bench_pipe_once(const char *what, bool splice)
+{
+	uint64_t start;
+	char *page;
+	int fds[2], i, pid;
+
+	if (pipe(fds) < 0) {
+		cprintf("pipe failed\n");
+		return;
+	}
+	if ((pid = fork()) == 0) {
+		// Descriptors are global, the reader closes its end
+		while (read(fds[0], pipe_rbuf, sizeof(pipe_rbuf)) > 0)
+			;
+		close(fds[0]);
+		kill_self();
+	}
+	for (i = 0; i < PIPE_SAMPLES; i++) {
+		page = pipe_pages[i % PIPE_PAGES];
+		start = read_tsc();
+		if ((splice ? vmsplice(fds[1], page, PIPE_PAGE_SIZE) :
+		     write(fds[1], page, PIPE_PAGE_SIZE)) != PIPE_PAGE_SIZE)
+			break;
+		samples[i] = elapsed(start);
+	}
+	close(fds[1]);
+	if (pid > 0)
+		wait_gone(pid);
+	report(what, samples, i);
+}
+
+static void
+bench_pipe(void)
+{
+	memset(pipe_pages, 'x', sizeof(pipe_pages));
+	bench_pipe_once("pipe write", false);
+	bench_pipe_once("pipe vmsplice", true);
+}
+
+// Small messages to a child through a ring in shared memory, which
+// only makes system calls when one side waits for the other, and
+// through a pipe, where every one is a write().
+#define RING_MSG 64
+#define RING_SHM_SIZE (4 * PIPE_PAGE_SIZE)
+static void
+bench_ring(void)
+{
+	char msg[RING_MSG];
+	struct ring *r;
+	uint64_t start;
+	int fds[2], i, id, pid;
+	void *mem;
+
+	memset(msg, 'x', sizeof(msg));
+	if ((id = shm_create(RING_SHM_SIZE, 0)) < 0 ||
+	    (int)(mem = shm_map(id)) < 0) {
+		cprintf("shm failed\n");
+		return;
+	}
+	// Gone with the last mapping
+	shm_remove(id);
+	r = ring_init(mem, RING_SHM_SIZE, RING_MSG);
+	if ((pid = fork()) == 0) {
+		for (i = 0; i < BENCH_SAMPLES; i++)
+			ring_recv(r, msg);
+		kill_self();
+	}
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		ring_send(r, msg);
+		samples[i] = elapsed(start);
+	}
+	if (pid > 0)
+		wait_gone(pid);
+	report("ring send", samples, BENCH_SAMPLES);
+
+	if (pipe(fds) < 0) {
+		cprintf("pipe failed\n");
+		return;
+	}
+	if ((pid = fork()) == 0) {
+		while (read(fds[0], pipe_rbuf, sizeof(pipe_rbuf)) > 0)
+			;
+		close(fds[0]);
+		kill_self();
+	}
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		if (write(fds[1], msg, RING_MSG) != RING_MSG)
+			break;
+		samples[i] = elapsed(start);
+	}
+	close(fds[1]);
+	if (pid > 0)
+		wait_gone(pid);
+	report("pipe write 64", samples, i);
+}
+
+// The first write to each page of an anonymous mmap() region, which
+// faults in a zeroed page, and then to pages shared with a child after
+// fork(), which copies each one.  A write to a mapped page is the
+// baseline.  The child sleeps in read() until the parent is done, so
+// the pages stay shared.
+#define PGFAULT_PAGES 256
+static void
+bench_pgfault(void)
+{
+	size_t len = PGFAULT_PAGES * PIPE_PAGE_SIZE;
+	uint64_t start;
+	char *p;
+	int fds[2], i, pid;
+
+	if ((int)(p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON)) < 0) {
+		cprintf("mmap failed\n");
+		return;
+	}
+	for (i = 0; i < PGFAULT_PAGES; i++) {
+		start = read_tsc();
+		p[i * PIPE_PAGE_SIZE] = 1;
+		samples[i] = elapsed(start);
+	}
+	report("anon fault", samples, PGFAULT_PAGES);
+	for (i = 0; i < PGFAULT_PAGES; i++) {
+		start = read_tsc();
+		p[i * PIPE_PAGE_SIZE] = 2;
+		samples[i] = elapsed(start);
+	}
+	report("mapped write", samples, PGFAULT_PAGES);
+
+	if (pipe(fds) < 0) {
+		cprintf("pipe failed\n");
+		munmap(p, len);
+		return;
+	}
+	if ((pid = fork()) == 0) {
+		while (read(fds[0], pipe_rbuf, sizeof(pipe_rbuf)) > 0)
+			;
+		close(fds[0]);
+		kill_self();
+	}
+	for (i = 0; i < PGFAULT_PAGES && pid > 0; i++) {
+		start = read_tsc();
+		p[i * PIPE_PAGE_SIZE] = 3;
+		samples[i] = elapsed(start);
+	}
+	close(fds[1]);
+	if (pid > 0) {
+		wait_gone(pid);
+		report("cow fault", samples, i);
+	} else {
+		close(fds[0]);
+		cprintf("fork failed\n");
+	}
+	munmap(p, len);
+}
+
+// malloc() and free() of small blocks against a bump allocator, which
+// never frees, in memory of mmap().  Both write to every block, so both
+// pay for the first touch of its page.  Blocks too big for the size
+// classes cost a mmap() and a munmap() each.
+#define ALLOC_SMALL 32
+#define ALLOC_BIG (64 * 1024)
+#define ALLOC_BIG_SAMPLES 100
+static void *alloc_ptrs[BENCH_SAMPLES];
+static char *bump_next, *bump_end;
+
+static void *
+bump_alloc(size_t n)
+{
+	void *p = bump_next;
+
+	n = ROUNDUP(n, 8);
+	if (bump_next + n > bump_end)
+		return NULL;
+	bump_next += n;
+	return p;
+}
+
+static void
+bench_malloc(void)
+{
+	size_t len = BENCH_SAMPLES * ALLOC_SMALL;
+	uint64_t start;
+	uint32_t *p;
+	int i;
+
+	if ((int)(bump_next = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				   MAP_ANON)) < 0) {
+		cprintf("mmap failed\n");
+		return;
+	}
+	bump_end = bump_next + len;
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		p = bump_alloc(ALLOC_SMALL);
+		*p = i;
+		samples[i] = elapsed(start);
+	}
+	report("bump 32", samples, BENCH_SAMPLES);
+	munmap(bump_end - len, len);
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		p = alloc_ptrs[i] = malloc(ALLOC_SMALL);
+		*p = i;
+		samples[i] = elapsed(start);
+	}
+	report("malloc 32", samples, BENCH_SAMPLES);
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		free(alloc_ptrs[i]);
+		samples[i] = elapsed(start);
+	}
+	report("free 32", samples, BENCH_SAMPLES);
+	// From the cache of this thread
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		p = malloc(ALLOC_SMALL);
+		*p = i;
+		free(p);
+		samples[i] = elapsed(start);
+	}
+	report("malloc+free 32", samples, BENCH_SAMPLES);
+	for (i = 0; i < ALLOC_BIG_SAMPLES; i++) {
+		start = read_tsc();
+		p = malloc(ALLOC_BIG);
+		*p = i;
+		free(p);
+		samples[i] = elapsed(start);
+	}
+	report("malloc+free 64K", samples, ALLOC_BIG_SAMPLES);
+}
+
+// A read of every 4KB of 8MB, which misses the TLB at every page when
+// they are 4KB pages and twice in all with MAP_HUGE.  The first pass
+// takes the page faults, a sample is one of the passes after it.
+#define HUGE_LEN (8 * 1024 * 1024)
+#define HUGE_SAMPLES 20
+static void
+bench_huge_once(const char *what, int flags)
+{
+	volatile char *p;
+	uint64_t start;
+	int i, off;
+
+	if ((int)(p = mmap(NULL, HUGE_LEN, PROT_READ | PROT_WRITE,
+			   MAP_ANON | flags)) < 0) {
+		cprintf("mmap failed\n");
+		return;
+	}
+	start = read_tsc();
+	for (off = 0; off < HUGE_LEN; off += 4096)
+		p[off] = 1;
+	cprintf("%s first touch: %u cycles\n", what, elapsed(start));
+	for (i = 0; i < HUGE_SAMPLES; i++) {
+		start = read_tsc();
+		for (off = 0; off < HUGE_LEN; off += 4096)
+			(void)p[off];
+		samples[i] = elapsed(start);
+	}
+	report(what, samples, HUGE_SAMPLES);
+	munmap((void *)p, HUGE_LEN);
+}
+
+static void
+bench_huge(void)
+{
+	bench_huge_once("8M 4K pages", 0);
+	bench_huge_once("8M 4M pages", MAP_HUGE);
+}
+
+// Parent and child yield to each other, when both run on the same CPU
+// every yield is a switch between two address spaces.
+static void
+bench_yield(void)
+{
+	uint64_t start;
+	int i;
+
+	if (!fork()) {
+		for (i = 0; i < BENCH_SAMPLES; i++)
+			yield();
+		kill_self();
+	}
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		start = read_tsc();
+		yield();
+		samples[i] = elapsed(start);
+	}
+	report("yield", samples, BENCH_SAMPLES);
+}
+
+// sleep(1) wakes on the next timer tick, so this shows the tick
+// period plus the wake-up latency on top of it.
+#define SLEEP_SAMPLES 50
+static void
+bench_sleep(void)
+{
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < SLEEP_SAMPLES; i++) {
+		start = read_tsc();
+		sleep(1);
+		samples[i] = elapsed(start);
+	}
+	report("sleep(1)", samples, SLEEP_SAMPLES);
+}
+
+// Several tasks yield in a loop at the same time.  They are spread
+// over the CPUs by pid, so they mostly meet on the global tasks_lock
+// (see "lockstat").  Every task reports its own numbers.  The program
+// image is shared by all tasks, so the samples live on the stack.
+#define LOCK_TASKS 4
+#define LOCK_SAMPLES 250
+static void
+bench_lock(void)
+{
+	uint32_t s[LOCK_SAMPLES];
+	uint64_t start;
+	int i, t;
+	char what[20];
+
+	for (t = 0; t < LOCK_TASKS; t++) {
+		if (fork() == 0) {
+			// Let the others get forked
+			sleep(10);
+			for (i = 0; i < LOCK_SAMPLES; i++) {
+				start = read_tsc();
+				yield();
+				s[i] = elapsed(start);
+			}
+			snprintf(what, sizeof(what), "lock pid%d cpu%d",
+				 getpid(), getcid());
+			report(what, s, LOCK_SAMPLES);
+			kill_self();
+		}
+	}
+	// Keep the prompt out of the children's output
+	sleep(100);
+}
+
+static struct bench benches[] = {
+	{ "syscall", "null system call (getpid)", bench_syscall },
+	{ "clock", "clock_gettime without a trap vs get_ticks", bench_clock },
+	{ "fork", "fork in the parent", bench_fork },
+	{ "spawn", "spawn and vfork+exec of a program", bench_spawn },
+	{ "clone", "clone a thread, futex wake/wait between threads", bench_clone },
+	{ "pipe", "a page through a pipe with write() and vmsplice()", bench_pipe },
+	{ "ring", "messages through a shared memory ring vs a pipe", bench_ring },
+	{ "pgfault", "anonymous and copy on write page faults", bench_pgfault },
+	{ "malloc", "malloc and free vs a bump allocator", bench_malloc },
+	{ "huge", "page strided reads of 8MB, 4K vs 4M pages", bench_huge },
+	{ "yield", "yield ping-pong between two tasks", bench_yield },
+	{ "sleep", "sleep(1) and wake-up latency", bench_sleep },
+	{ "lock", "concurrent yield, contends for tasks_lock", bench_lock },
+};
+
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+int
+bench(int argc, char **argv)
+{
+	int i, j, found;
+
+	if (argc > 1 && strcmp(argv[1], "help") == 0) {
+		for (i = 0; i < NBENCHES; i++)
+			cprintf("%-8s %s\n", benches[i].name, benches[i].desc);
+		return 0;
+	}
+
+	calibrate_tsc();
+	cprintf("%-16s %6s %10s %10s %10s  (cycles, rdtsc %u)\n", "bench",
+		"n", "min", "median", "p99", tsc_overhead);
+	for (i = 0; i < NBENCHES; i++) {
+		found = (argc == 1);
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], benches[i].name) == 0)
+				found = 1;
+		if (found)
+			benches[i].func();
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * cat [file...]: copy the files, or the standard input, to the standard
+ * output.  A file goes into a pipe with splice(), without being copied
+ * through this program.
+ */
+#include <inc/stdio.h>
+#include <inc/syscall.h>
+
+static char buf[4096];
+
+// Copy fd to the standard output through buf
+static int
+copy(int fd)
+{
+	int n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		if (write(STDOUT_FILENO, buf, n) != n)
+			return -1;
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, fd, n;
+
+	if (argc < 2 && copy(STDIN_FILENO) < 0)
+		cprintf("cat: can not read the standard input\n");
+	for (i = 1; i < argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY, 0)) < 0) {
+			cprintf("cat: %s: error %d\n", argv[i], fd);
+			continue;
+		}
+		// Fails unless the standard output is a pipe
+		while ((n = splice(fd, STDOUT_FILENO, 1 << 30)) > 0)
+			;
+		if (n < 0)
+			copy(fd);
+		close(fd);
+	}
+	return 0;
+}
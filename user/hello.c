@@ -0,0 +1,18 @@
+/*
+ * Sample program for exec(), "make install" copies it to the disk and
+ * "hello [args...]" in the shell runs it.
+ */
+#include <inc/stdio.h>
+#include <inc/syscall.h>
+
+int
+main(int argc, char **argv)
+{
+	int i;
+
+	cprintf("Hello from pid %d, argc %d:", getpid(), argc);
+	for (i = 0; i < argc; i++)
+		cprintf(" '%s'", argv[i]);
+	cprintf("\n");
+	return 0;
+}
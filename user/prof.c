@@ -0,0 +1,227 @@
+/*
+ * "prof" shell command, front end of the kernel sampling profiler.
+ *
+ *   prof start [cycles] clear the buffers and start sampling, on every
+ *                       timer tick or every n cycles (needs a PMU)
+ *   prof stop           stop sampling
+ *   prof show [file]    drain the samples and print the hottest spots
+ *
+ * show resolves kernel addresses with a symbol file in "nm -n" format,
+ * by default "system.sym", e.g. after
+ *   mcopy -i lab7.img kernel/system.sym ::
+ * Without it the raw addresses are printed, look them up in
+ * kernel/system.sym or user/userprog.sym.
+ */
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <inc/memlayout.h>
+
+#define PROF_HIST	1024	// Distinct addresses, a power of two
+#define PROF_FUNCS	128	// Distinct functions
+#define PROF_TOP	20
+#define PROF_CHUNK	64
+#define PROF_NCPU	8
+
+struct prof_hist {
+	uint32_t eip;
+	uint32_t count;
+};
+
+struct prof_func {
+	char name[32];
+	uint32_t count;
+};
+
+static struct prof_hist hist[PROF_HIST];
+static int nhist;
+static struct prof_func funcs[PROF_FUNCS];
+static int nfuncs;
+
+static void
+hist_add(uint32_t eip)
+{
+	uint32_t h = (eip * 2654435761u) & (PROF_HIST - 1);
+
+	while (hist[h].count && hist[h].eip != eip)
+		h = (h + 1) & (PROF_HIST - 1);
+	if (hist[h].count == 0) {
+		// Keep one slot free so the probe always ends
+		if (nhist == PROF_HIST - 1)
+			return;
+		hist[h].eip = eip;
+		nhist++;
+	}
+	hist[h].count++;
+}
+
+// Squeeze the used slots to the front and sort them by eip, or by
+// count if by_count
+static void
+hist_sort(int by_count)
+{
+	struct prof_hist v;
+	int gap, i, j, n = 0;
+
+	for (i = 0; i < PROF_HIST; i++)
+		if (hist[i].count)
+			hist[n++] = hist[i];
+	for (i = n; i < PROF_HIST; i++)
+		hist[i].count = 0;
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			v = hist[i];
+			for (j = i; j >= gap && (by_count ?
+			     hist[j - gap].count < v.count :
+			     hist[j - gap].eip > v.eip); j -= gap)
+				hist[j] = hist[j - gap];
+			hist[j] = v;
+		}
+}
+
+static void
+func_add(const char *name, uint32_t count)
+{
+	int i;
+
+	for (i = 0; i < nfuncs; i++)
+		if (strcmp(funcs[i].name, name) == 0)
+			break;
+	if (i == nfuncs) {
+		if (nfuncs == PROF_FUNCS)
+			i = PROF_FUNCS - 1;	// Lump the rest together
+		else {
+			strncpy(funcs[i].name, name, sizeof(funcs[i].name) - 1);
+			funcs[i].count = 0;
+			nfuncs++;
+		}
+	}
+	funcs[i].count += count;
+}
+
+static uint32_t
+parse_hex(const char *s)
+{
+	uint32_t v = 0;
+
+	for (;; s++) {
+		if (*s >= '0' && *s <= '9')
+			v = v * 16 + *s - '0';
+		else if (*s >= 'a' && *s <= 'f')
+			v = v * 16 + *s - 'a' + 10;
+		else
+			return v;
+	}
+}
+
+/*
+ * Walk the symbol file, sorted by address, and the histogram, sorted
+ * by eip, side by side: an address belongs to the last text symbol at
+ * or below it.  Returns -1 if the file can not be read.
+ */
+static int
+resolve(const char *file)
+{
+	char buf[128], line[64], name[32] = "(unknown)";
+	int fd, len, pos, h = 0, n = 0;
+	uint32_t addr;
+
+	if ((fd = open(file, O_RDONLY, 0)) < 0)
+		return -1;
+	hist_sort(0);
+	// User addresses are not in the kernel symbols
+	while (hist[h].count && hist[h].eip < ULIM)
+		func_add("(user)", hist[h++].count);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos++) {
+			if (buf[pos] != '\n') {
+				if (n < (int)sizeof(line) - 1)
+					line[n++] = buf[pos];
+				continue;
+			}
+			line[n] = 0;
+			n = 0;
+			// "f0100000 T name"
+			if (strlen(line) < 12 || (line[9] != 'T' && line[9] != 't'))
+				continue;
+			addr = parse_hex(line);
+			while (hist[h].count && hist[h].eip < addr)
+				func_add(name, hist[h++].count);
+			strncpy(name, line + 11, sizeof(name) - 1);
+		}
+	}
+	close(fd);
+	while (hist[h].count)
+		func_add(name, hist[h++].count);
+	return 0;
+}
+
+static void
+prof_show(const char *file)
+{
+	struct prof_sample s[PROF_CHUNK];
+	struct prof_func v;
+	uint32_t percpu[PROF_NCPU] = { 0 };
+	uint32_t total = 0, user = 0, idle = 0;
+	int i, j, n;
+
+	memset(hist, 0, sizeof(hist));
+	nhist = nfuncs = 0;
+	while ((n = prof(PROF_DRAIN, s, PROF_CHUNK)) > 0)
+		for (i = 0; i < n; i++) {
+			total++;
+			if (s[i].cpu < PROF_NCPU)
+				percpu[s[i].cpu]++;
+			if (s[i].user)
+				user++;
+			else if (s[i].pid < 0)
+				idle++;
+			hist_add(s[i].eip);
+		}
+	if (total == 0) {
+		cprintf("No samples, run 'prof start' first\n");
+		return;
+	}
+	cprintf("%u samples (%u dropped): %u%% user, %u%% kernel idle, per cpu:",
+		total, prof(PROF_DROPPED, NULL, 0), user * 100 / total,
+		idle * 100 / total);
+	for (i = 0; i < PROF_NCPU; i++)
+		if (percpu[i])
+			cprintf(" %d:%u", i, percpu[i]);
+	cprintf("\n");
+
+	if (resolve(file) < 0) {
+		cprintf("No %s, raw addresses:\n", file);
+		hist_sort(1);
+		for (i = 0; i < PROF_TOP && hist[i].count; i++)
+			cprintf("  %08x %6u %3u%%\n", hist[i].eip,
+				hist[i].count, hist[i].count * 100 / total);
+		return;
+	}
+	for (i = 1; i < nfuncs; i++) {
+		v = funcs[i];
+		for (j = i; j > 0 && funcs[j - 1].count < v.count; j--)
+			funcs[j] = funcs[j - 1];
+		funcs[j] = v;
+	}
+	for (i = 0; i < PROF_TOP && i < nfuncs; i++)
+		cprintf("  %-32s %6u %3u%%\n", funcs[i].name, funcs[i].count,
+			funcs[i].count * 100 / total);
+}
+
+int
+prof_cmd(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "start") == 0) {
+		if (prof(PROF_START, NULL, argc > 2 ? strtol(argv[2], NULL, 10) : 0) < 0)
+			cprintf("No PMU overflow interrupt, try 'prof start'\n");
+	}
+	else if (argc > 1 && strcmp(argv[1], "stop") == 0)
+		prof(PROF_STOP, NULL, 0);
+	else if (argc > 1 && strcmp(argv[1], "show") == 0)
+		prof_show(argc > 2 ? argv[2] : "system.sym");
+	else
+		cprintf("Usage: prof start [cycles]|stop|show [symfile]\n");
+	return 0;
+}
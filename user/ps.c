@@ -0,0 +1,157 @@
+/*
+ * "ps", "top" and "chrt" shell commands, show the scheduler statistics
+ * and change the scheduling class of a task.
+ *
+ *   ps                      times and counters of every task since it
+ *                           was created
+ *   top [ticks] [rounds]    CPU usage of the tasks and CPUs over every
+ *                           interval of ticks (default 100, 3 rounds)
+ *   chrt pid normal|idle [nice]
+ *   chrt pid fifo prio
+ *
+ * Times are converted to milliseconds with the TSC frequency of the
+ * clock page, they are printed in cycles if it is unknown.
+ */
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <inc/memlayout.h>
+#include <inc/time.h>
+
+#define PS_TASKS	32
+#define PS_NCPU		8
+
+static const char *state_names[] = {
+	"free", "ready", "run", "sleep", "stop", "wait",
+};
+
+static const char *policy_names[] = {
+	[SCHED_NORMAL] = "normal",
+	[SCHED_FIFO] = "fifo",
+	[SCHED_IDLE] = "idle",
+};
+
+#define NPOLICIES (sizeof(policy_names) / sizeof(policy_names[0]))
+
+static struct task_stat before[PS_TASKS], after[PS_TASKS];
+static struct cpu_stat cpu_before[PS_NCPU], cpu_after[PS_NCPU];
+
+static const char *
+state_name(int state)
+{
+	if (state < 0 || state >= sizeof(state_names) / sizeof(state_names[0]))
+		return "?";
+	return state_names[state];
+}
+
+// Cycles in ms, or unchanged without a calibrated TSC
+static uint64_t
+to_ms(uint64_t cycles)
+{
+	const volatile struct vclock *vc = (const volatile struct vclock *)UVCLOCK;
+
+	return vc->tsc_khz ? cycles / vc->tsc_khz : cycles;
+}
+
+// Percentage of part in total, 0 if total is
+static uint32_t
+percent(uint64_t part, uint64_t total)
+{
+	return total ? part * 100 / total : 0;
+}
+
+int
+ps_cmd(int argc, char **argv)
+{
+	const volatile struct vclock *vc = (const volatile struct vclock *)UVCLOCK;
+	int i, n = task_stat(after, PS_TASKS);
+
+	cprintf("%4s %4s %-5s %3s %-6s %3s %10s %10s %10s %7s %7s %8s %5s %s (%s)\n",
+		"PID", "PPID", "STATE", "CPU", "CLASS", "PRI", "USER", "SYS",
+		"WAIT", "VCSW", "IVCSW", "SYSCALLS", "PGFLT", "NAME",
+		vc->tsc_khz ? "ms" : "cycles");
+	for (i = 0; i < n; i++)
+		cprintf("%4d %4d %-5s %3d %-6s %3d %10llu %10llu %10llu %7u %7u %8u %5u %s\n",
+			after[i].pid, after[i].ppid, state_name(after[i].state),
+			after[i].cpu, after[i].policy < NPOLICIES ?
+			policy_names[after[i].policy] : "?", after[i].prio,
+			to_ms(after[i].utime), to_ms(after[i].stime),
+			to_ms(after[i].wait), after[i].nvcsw, after[i].nivcsw,
+			after[i].nsyscalls, after[i].npgfaults, after[i].name);
+	return 0;
+}
+
+static void
+top_round(uint32_t ticks)
+{
+	int i, j, n, nb, ncpu;
+	uint64_t dt, busy;
+	struct task_stat *a, *b;
+
+	nb = task_stat(before, PS_TASKS);
+	ncpu = cpu_stat(cpu_before, PS_NCPU);
+	sleep(ticks);
+	n = task_stat(after, PS_TASKS);
+	cpu_stat(cpu_after, PS_NCPU);
+	dt = cpu_after[0].tsc - cpu_before[0].tsc;
+
+	cprintf("CPU idle:");
+	for (i = 0; i < ncpu; i++)
+		cprintf(" %d:%u%%", i,
+			percent(cpu_after[i].idle - cpu_before[i].idle, dt));
+	cprintf("\n%4s %-5s %3s %5s %5s %5s %7s %8s\n", "PID", "STATE", "CPU",
+		"%CPU", "%USR", "%WAIT", "CSW", "SYSCALLS");
+	for (i = 0; i < n; i++) {
+		a = &after[i];
+		// A task created during the interval starts from zero
+		for (j = 0; j < nb; j++)
+			if (before[j].pid == a->pid)
+				break;
+		b = j < nb ? &before[j] : NULL;
+		if (b && b->utime > a->utime)
+			b = NULL;	// The pid was reused
+		busy = a->utime + a->stime - (b ? b->utime + b->stime : 0);
+		cprintf("%4d %-5s %3d %5u %5u %5u %7u %8u\n", a->pid,
+			state_name(a->state), a->cpu, percent(busy, dt),
+			percent(a->utime - (b ? b->utime : 0), dt),
+			percent(a->wait - (b ? b->wait : 0), dt),
+			a->nvcsw + a->nivcsw - (b ? b->nvcsw + b->nivcsw : 0),
+			a->nsyscalls - (b ? b->nsyscalls : 0));
+	}
+}
+
+int
+top_cmd(int argc, char **argv)
+{
+	uint32_t ticks = argc > 1 ? strtol(argv[1], NULL, 10) : 100;
+	int rounds = argc > 2 ? strtol(argv[2], NULL, 10) : 3;
+
+	if (ticks == 0)
+		ticks = 1;
+	while (rounds-- > 0)
+		top_round(ticks);
+	return 0;
+}
+
+int
+chrt_cmd(int argc, char **argv)
+{
+	int policy;
+
+	if (argc < 3)
+		goto usage;
+	for (policy = 0; policy < NPOLICIES; policy++)
+		if (strcmp(argv[2], policy_names[policy]) == 0)
+			break;
+	if (policy == NPOLICIES || (policy == SCHED_FIFO && argc < 4))
+		goto usage;
+	if (sched_setscheduler(strtol(argv[1], NULL, 10), policy,
+			       argc > 3 ? strtol(argv[3], NULL, 10) : 0) < 0)
+		cprintf("chrt: no such task or bad priority\n");
+	return 0;
+usage:
+	cprintf("Usage: chrt pid normal|idle [nice (%d..%d)]\n"
+		"       chrt pid fifo prio (%d..%d)\n",
+		NICE_MIN, NICE_MAX, RT_PRIO_MIN, RT_PRIO_MAX);
+	return 0;
+}
@@ -3,6 +3,10 @@
 #include <inc/string.h>
 #include <inc/syscall.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/time.h>
+#include <inc/sync.h>
+#include <inc/malloc.h>
 
 char hist[SHELL_HIST_MAX][BUF_LEN];
 
@@ -26,9 +30,19 @@ int filetest3(int argc, char **argv);
 int filetest4(int argc, char **argv);
 int filetest5(int argc, char **argv);
 int spinlocktest(int argc, char **argv);
+int mutextest(int argc, char **argv);
+int lock_stat(int argc, char **argv);
+int bench(int argc, char **argv);
+int prof_cmd(int argc, char **argv);
+int perf_cmd(int argc, char **argv);
+int trace_cmd(int argc, char **argv);
+int ps_cmd(int argc, char **argv);
+int top_cmd(int argc, char **argv);
+int chrt_cmd(int argc, char **argv);
 int ls(int argc, char **argv);
 int rm(int argc, char **argv);
 int touch(int argc, char **argv);
+void kill_self(void);
 
 struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
@@ -38,12 +52,21 @@ struct Command commands[] = {
 	{ "forktest", "Test functionality of fork()", forktest },
 	{ "filetest", "Test create file", filetest },
 	{ "fs_seek_test", "Test seek file", fs_seek_test },
-	{ "fs_speed_test", "Test R/W speed", fs_speed_test},
+	{ "fs_speed_test", "Test R/W speed [bytes per call]", fs_speed_test},
 	{ "filetest2", "Open test", filetest2},
 	{ "filetest3", "Laqrge block test", filetest3},
 	{ "filetest4", "Error test", filetest4},
 	{ "filetest5", "unlink test", filetest5},
 	{ "spinlocktest", "Test spinlock", spinlocktest },
+	{ "mutextest", "Threads counting under a futex mutex: mutextest [threads]", mutextest },
+	{ "lockstat", "Show kernel spinlock statistics ('lockstat reset' clears them)", lock_stat },
+	{ "bench", "Run micro benchmarks ('bench help' lists them)", bench },
+	{ "prof", "Sample where the CPUs spend time: prof start [cycles]|stop|show [symfile]", prof_cmd },
+	{ "perf", "Count cycles, instructions and misses of a command: perf <command>", perf_cmd },
+	{ "trace", "Kernel event tracing: trace start [events]|stop|dump|stream [ticks]", trace_cmd },
+	{ "ps", "List the tasks with their CPU times and switch counts", ps_cmd },
+	{ "top", "CPU usage per task and CPU: top [ticks] [rounds]", top_cmd },
+	{ "chrt", "Set the scheduling class of a task: chrt pid normal|fifo|idle [prio]", chrt_cmd },
 	{ "ls", "list files in a directory", ls },
 	{ "rm", "remove a file", rm },
 	{ "touch", "create a file", touch }
@@ -88,15 +111,42 @@ int chgcolor(int argc, char **argv)
 
 #define WHITESPACE "\t\r\n "
 #define MAXARGS 16
+#define MAXPIPE 4
+#define WAIT_TASKS 32
 
-static int runcmd(char *buf)
+// Wait until task pid is gone
+static void wait_task(int pid)
 {
-	int argc;
-	char *argv[MAXARGS];
-	int i;
+	struct task_stat st[WAIT_TASKS];
+	int i, n;
+
+	do {
+		sleep(1);
+		n = task_stat(st, WAIT_TASKS);
+		for (i = 0; i < n; i++)
+			if (st[i].pid == pid)
+				break;
+	} while (i < n);
+}
+
+// Run a program from the disk in a new task and wait until it is gone
+static int runprog(int argc, char **argv)
+{
+	int pid;
+
+	if ((pid = spawn(argv[0], argv)) < 0) {
+		cprintf("Unknown command '%s'\n", argv[0]);
+		return 0;
+	}
+	wait_task(pid);
+	return 0;
+}
+
+// Parse buf into whitespace-separated arguments, returns argc or -1
+static int parseargs(char *buf, char **argv)
+{
+	int argc = 0;
 
-	// Parse the command buffer into whitespace-separated arguments
-	argc = 0;
 	argv[argc] = 0;
 	while (1) {
 		// gobble whitespace
@@ -108,26 +158,114 @@ static int runcmd(char *buf)
 		// save and scan past next arg
 		if (argc == MAXARGS-1) {
 			cprintf("Too many arguments (max %d)\n", MAXARGS);
-			return 0;
+			return -1;
 		}
 		argv[argc++] = buf;
 		while (*buf && !strchr(WHITESPACE, *buf))
 			buf++;
 	}
 	argv[argc] = 0;
+	return argc;
+}
 
-	// Lookup and invoke the command
-	if (argc == 0)
-		return 0;
-	for (i = 0; i < NCOMMANDS; i++) {
-		if (strcmp(argv[0], commands[i].name) == 0)
-			return commands[i].func(argc, argv);
-	}
+static int findcmd(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NCOMMANDS; i++)
+		if (strcmp(name, commands[i].name) == 0)
+			return i;
+	return -1;
+}
 
-	cprintf("Unknown command '%s'\n", argv[0]);
+/*
+ * Run "a | b | ...": every command in a vfork() child which reads the
+ * pipe of the one before and writes the next one, shell commands as
+ * well as programs.  Started from the last one, so a reader is there
+ * before its writer fills the pipe.
+ */
+static int runpipe(char **cmds, int ncmd)
+{
+	char *argv[MAXPIPE][MAXARGS];
+	int argc[MAXPIPE], fds[MAXPIPE - 1][2], pids[MAXPIPE];
+	int i, c, npipe;
+
+	for (i = 0; i < ncmd; i++)
+		if ((argc[i] = parseargs(cmds[i], argv[i])) <= 0) {
+			if (argc[i] == 0)
+				cprintf("Empty command in pipeline\n");
+			return 0;
+		}
+	for (npipe = 0; npipe < ncmd - 1; npipe++)
+		if (pipe(fds[npipe]) < 0) {
+			cprintf("pipe: no descriptors left\n");
+			goto out;
+		}
+
+	for (i = ncmd - 1; i >= 0; i--) {
+		if ((pids[i] = vfork()) < 0) {
+			cprintf("vfork failed\n");
+			continue;
+		}
+		if (pids[i] > 0)
+			continue;
+		// The child, which may not return from here
+		if (i > 0)
+			dup2(fds[i - 1][0], STDIN_FILENO);
+		if (i < ncmd - 1)
+			dup2(fds[i][1], STDOUT_FILENO);
+		if ((c = findcmd(argv[i][0])) >= 0)
+			commands[c].func(argc[i], argv[i]);
+		else if (exec(argv[i][0], argv[i]) < 0)
+			cprintf("Unknown command '%s'\n", argv[i][0]);
+		kill(0);
+	}
+out:
+	// The children hold the ends they use
+	for (i = 0; i < npipe; i++) {
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	if (npipe == ncmd - 1)
+		for (i = 0; i < ncmd; i++)
+			if (pids[i] > 0)
+				wait_task(pids[i]);
 	return 0;
 }
 
+static int runcmd(char *buf)
+{
+	int argc;
+	char *argv[MAXARGS];
+	char *cmds[MAXPIPE];
+	int i, ncmd = 1;
+
+	// Split a pipeline at the '|'s
+	cmds[0] = buf;
+	for (; *buf; buf++) {
+		if (*buf != '|')
+			continue;
+		if (ncmd == MAXPIPE) {
+			cprintf("Too many commands in pipeline (max %d)\n", MAXPIPE);
+			return 0;
+		}
+		*buf = 0;
+		cmds[ncmd++] = buf + 1;
+	}
+	if (ncmd > 1)
+		return runpipe(cmds, ncmd);
+
+	// Parse the command buffer into whitespace-separated arguments
+	if ((argc = parseargs(cmds[0], argv)) <= 0)
+		return 0;
+
+	// Lookup and invoke the command
+	if ((i = findcmd(argv[0])) >= 0)
+		return commands[i].func(argc, argv);
+
+	return runprog(argc, argv);
+}
+
 void kill_self(void)
 {
 	kill(0);
@@ -186,6 +324,114 @@ int spinlocktest(int argc, char **argv)
 	return 0;
 }
 
+/* Threads of the shell add to one counter, a contended mutex puts them
+ * to sleep in futex_wait() */
+#define MT_THREADS_MAX	8
+#define MT_LOOPS	10000
+#define MT_STACK	1024
+static struct mutex mt_lock;
+static struct sem mt_done;
+static uint32_t mt_count;
+static uint8_t mt_stacks[MT_THREADS_MAX][MT_STACK] __attribute__((aligned(16)));
+
+static int mt_worker(void *arg)
+{
+	int i;
+
+	for (i = 0; i < MT_LOOPS; i++) {
+		mutex_lock(&mt_lock);
+		mt_count++;
+		mutex_unlock(&mt_lock);
+	}
+	sem_post(&mt_done);
+	return 0;
+}
+
+int mutextest(int argc, char **argv)
+{
+	int i, n = 4, started;
+
+	if (argc > 1)
+		n = strtol(argv[1], NULL, 10);
+	if (n < 1 || n > MT_THREADS_MAX) {
+		cprintf("1 to %d threads\n", MT_THREADS_MAX);
+		return 0;
+	}
+	mutex_init(&mt_lock);
+	sem_init(&mt_done, 0);
+	mt_count = 0;
+	for (started = 0; started < n; started++)
+		if (clone(mt_worker, NULL, mt_stacks[started + 1], NULL) < 0)
+			break;
+	for (i = 0; i < started; i++)
+		sem_wait(&mt_done);
+	cprintf("%d threads, count %u, expected %u\n", started, mt_count,
+		started * MT_LOOPS);
+	return 0;
+}
+
+#define LOCKSTAT_MAX 32
+int lock_stat(int argc, char **argv)
+{
+	struct lockstat st[LOCKSTAT_MAX];
+	int reset = (argc > 1 && strcmp(argv[1], "reset") == 0);
+	int i, n;
+
+	n = lockstat(st, LOCKSTAT_MAX, reset);
+	if (n == 0) {
+		cprintf("No lock statistics, is SPINLOCK_STATS enabled?\n");
+		return 0;
+	}
+	cprintf("%-16s %10s %10s %14s %12s\n", "lock", "acquire", "contended",
+		"spin cycles", "max hold");
+	for (i = 0; i < n; i++)
+		cprintf("%-16s %10u %10u %14llu %12llu\n", st[i].name,
+			st[i].acquisitions, st[i].contended,
+			st[i].spin_cycles, st[i].max_hold);
+	return 0;
+}
+
+int perf_cmd(int argc, char **argv)
+{
+	static const char *names[PERF_NEVENTS] = {
+		"cycles", "instructions", "llc-misses", "dtlb-misses"
+	};
+	struct perf_counts before, after;
+	uint64_t d[PERF_NEVENTS];
+	uint32_t ipc;
+	int i;
+
+	if (argc < 2) {
+		cprintf("Usage: perf <command> [args...]\n");
+		return 0;
+	}
+	for (i = 0; i < NCOMMANDS; i++)
+		if (strcmp(argv[1], commands[i].name) == 0)
+			break;
+	if (i == NCOMMANDS) {
+		cprintf("Unknown command '%s'\n", argv[1]);
+		return 0;
+	}
+
+	// Only counts this task, not what the command forks
+	perf_read(0, &before);
+	commands[i].func(argc - 1, argv + 1);
+	perf_read(0, &after);
+
+	for (i = 0; i < PERF_NEVENTS; i++) {
+		d[i] = after.count[i] - before.count[i];
+		if (after.valid & (1 << i))
+			cprintf("%-14s %14llu\n", names[i], d[i]);
+		else
+			cprintf("%-14s %14s\n", names[i], "not counted");
+	}
+	if ((after.valid & (1 << PERF_INSTRUCTIONS)) && d[PERF_CYCLES]) {
+		ipc = d[PERF_INSTRUCTIONS] * 100 / d[PERF_CYCLES];
+		cprintf("%-14s %11u.%02u\n", "IPC", ipc / 100, ipc % 100);
+	}
+	return 0;
+}
+
 #define BUFSIZE 128
 int filetest(int argc, char **argv)
 {
@@ -439,19 +685,48 @@ int fs_seek_test(int argc, char **argv)
         cprintf("Open failed!\n");
 }
 #define fsrw_fn                   "/test.dat"
-#define fsrw_data_len             180              /* Less than 256 */
+#define fsrw_data_len             180              /* Default, see fs_speed_test */
 #define FS_TEST_TIMES       5000
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Bytes per second, a fast run may take less than a clock tick */
+static uint32_t speed(uint64_t bytes, uint64_t ns)
+{
+    if (ns == 0)
+        ns = 1;
+    return bytes * NSEC_PER_SEC / ns;
+}
+
 int fs_speed_test(int argc, char **argv)
 {
     int fd;
     int stop_flag = 0;
     int index,length;
     uint32_t round;
-    uint32_t tick_start,tick_end,read_speed,write_speed;
-
+    uint64_t ns_start;
+    uint32_t read_speed,write_speed;
+    uint32_t len = fsrw_data_len;
+    uint8_t *write_data, *read_data;
 
-    static uint8_t write_data[fsrw_data_len];
-    static uint8_t read_data[fsrw_data_len];
+    /* bytes per read and write */
+    if (argc > 1 && (len = strtol(argv[1], NULL, 10)) == 0)
+    {
+        cprintf("Usage: fs_speed_test [bytes]\n");
+        return 0;
+    }
+    write_data = malloc(len);
+    read_data = malloc(len);
+    if (write_data == NULL || read_data == NULL)
+    {
+        cprintf("fsrw out of memory\n");
+        goto out;
+    }
 
     round = 0;
 
@@ -463,29 +738,28 @@ int fs_speed_test(int argc, char **argv)
         if (fd < 0)
         {
             cprintf("fsrw open file for write failed\n");
-            return;
+            goto out;
         }
 
         /* plan write data */
-        for (index = 0; index < fsrw_data_len; index ++)
+        for (index = 0; index < len; index ++)
         {
             write_data[index] = index;
         }
 
         /* write N times */
-        tick_start = get_ticks();
+        ns_start = now_ns();
         for(index=0; index<FS_TEST_TIMES ; index++)
         {
-            length = write(fd, write_data, fsrw_data_len);
-            if (length != fsrw_data_len)
+            length = write(fd, write_data, len);
+            if (length != len)
             {
                 cprintf("fsrw write data failed\n");
                 close(fd);
-                return;
+                goto out;
             }
         }
-        tick_end = get_ticks();
-        write_speed = fsrw_data_len*FS_TEST_TIMES *100/(tick_end-tick_start);
+        write_speed = speed((uint64_t)len*FS_TEST_TIMES, now_ns() - ns_start);
 
         /* close file */
         close(fd);
@@ -495,34 +769,33 @@ int fs_speed_test(int argc, char **argv)
         if (fd < 0)
         {
             cprintf("fsrw open file for read failed\n");
-            return;
+            goto out;
         }
 
         /* verify data */
-        tick_start = get_ticks();
+        ns_start = now_ns();
         for(index=0; index<FS_TEST_TIMES ; index++)
         {
             uint32_t i;
 
-            length = read(fd, read_data, fsrw_data_len);
-            if (length != fsrw_data_len)
+            length = read(fd, read_data, len);
+            if (length != len)
             {
                 cprintf("fsrw read file failed\r\n");
                 close(fd);
-                return;
+                goto out;
             }
-            for(i=0; i<fsrw_data_len; i++)
+            for(i=0; i<len; i++)
             {
                 if( read_data[i] != write_data[i] )
                 {
                     cprintf("fsrw data error!\r\n");
                     close(fd);
-                    return;
+                    goto out;
                 }
             }
         }
-        tick_end = get_ticks();
-        read_speed = fsrw_data_len*FS_TEST_TIMES *100/(tick_end-tick_start);
+        read_speed = speed((uint64_t)len*FS_TEST_TIMES, now_ns() - ns_start);
 
         cprintf("thread fsrw round %d ",round++);
         cprintf("rd:%dbyte/s,wr:%dbyte/s\r\n",read_speed,write_speed);
@@ -530,6 +803,10 @@ int fs_speed_test(int argc, char **argv)
         /* close file */
         close(fd);
     }
+out:
+    free(write_data);
+    free(read_data);
+    return 0;
 }
 
 int ls(int argc, char **argv)
@@ -603,11 +880,11 @@ void shell()
 }
 
 void _start(void) {
+	// %gs stays on the thread local page, see inc/tls.h
 	asm volatile("movl %0,%%eax\n\t" \
 	"movw %%ax,%%ds\n\t" \
 	"movw %%ax,%%es\n\t" \
-	"movw %%ax,%%fs\n\t" \
-	"movw %%ax,%%gs" \
+	"movw %%ax,%%fs" \
 	:: "i" (0x20 | 0x03));
 
 	if (getcid())
@@ -0,0 +1,140 @@
+/*
+ * "trace" shell command, reads the kernel tracepoints.
+ *
+ *   trace start [event...]  clear the buffers and enable events: sched,
+ *                           wakeup, syscall, page, disk (default all)
+ *   trace stop              disable all events
+ *   trace dump              drain the buffers, print in time order
+ *   trace stream [ticks]    print events as they come for some ticks
+ */
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <inc/memlayout.h>
+#include <inc/time.h>
+
+#define TRACE_MAX	4096
+#define TRACE_CHUNK	64
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} trace_groups[] = {
+	{ "sched", 1 << EV_SCHED_SWITCH },
+	{ "wakeup", 1 << EV_WAKEUP },
+	{ "syscall", (1 << EV_SYSCALL_ENTER) | (1 << EV_SYSCALL_EXIT) },
+	{ "page", (1 << EV_PAGE_ALLOC) | (1 << EV_PAGE_FREE) },
+	{ "disk", (1 << EV_DISK_ISSUE) | (1 << EV_DISK_DONE) },
+	{ "all", (1 << EV_NR) - 1 },
+};
+
+#define NGROUPS (sizeof(trace_groups) / sizeof(trace_groups[0]))
+
+static const char *ev_names[EV_NR] = {
+	[EV_SCHED_SWITCH]	= "switch",
+	[EV_WAKEUP]		= "wakeup",
+	[EV_SYSCALL_ENTER]	= "sys_enter",
+	[EV_SYSCALL_EXIT]	= "sys_exit",
+	[EV_PAGE_ALLOC]		= "page_alloc",
+	[EV_PAGE_FREE]		= "page_free",
+	[EV_DISK_ISSUE]		= "disk_issue",
+	[EV_DISK_DONE]		= "disk_done",
+};
+
+static struct trace_event events[TRACE_MAX];
+static uint64_t trace_t0;
+
+static void
+print_event(struct trace_event *e)
+{
+	const volatile struct vclock *vc = (const volatile struct vclock *)UVCLOCK;
+	uint64_t d = e->tsc - trace_t0;
+
+	if (e->tsc < trace_t0)
+		d = 0;
+	if (vc->tsc_khz)
+		cprintf("%8llu.%03lluus", d * 1000 / vc->tsc_khz / 1000,
+			d * 1000 / vc->tsc_khz % 1000);
+	else
+		cprintf("%12llucy", d);
+	cprintf(" cpu%d pid%3d %-10s %08x %08x\n", e->cpu, e->pid,
+		e->ev < EV_NR ? ev_names[e->ev] : "?", e->a0, e->a1);
+}
+
+static void
+sort_events(struct trace_event *ev, int n)
+{
+	struct trace_event v;
+	int gap, i, j;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			v = ev[i];
+			for (j = i; j >= gap && ev[j - gap].tsc > v.tsc; j -= gap)
+				ev[j] = ev[j - gap];
+			ev[j] = v;
+		}
+}
+
+static void
+trace_dump(void)
+{
+	int i, n = 0, got;
+
+	while (n < TRACE_MAX &&
+	       (got = ktrace(TRACE_DRAIN, events + n, TRACE_MAX - n)) > 0)
+		n += got;
+	sort_events(events, n);
+	if (n)
+		trace_t0 = events[0].tsc;
+	for (i = 0; i < n; i++)
+		print_event(&events[i]);
+	cprintf("%d events, %d dropped\n", n, ktrace(TRACE_DROPPED, NULL, 0));
+}
+
+static void
+trace_stream(uint32_t ticks)
+{
+	uint32_t end = get_ticks() + ticks;
+	int i, n;
+
+	trace_t0 = read_tsc();
+	while ((int32_t)(get_ticks() - end) < 0) {
+		n = ktrace(TRACE_DRAIN, events, TRACE_CHUNK);
+		// Each CPU is in order, the chunk as a whole is not
+		sort_events(events, n);
+		for (i = 0; i < n; i++)
+			print_event(&events[i]);
+		if (n == 0)
+			sleep(1);
+	}
+	cprintf("%d dropped\n", ktrace(TRACE_DROPPED, NULL, 0));
+}
+
+int
+trace_cmd(int argc, char **argv)
+{
+	uint32_t mask = 0;
+	int i, j;
+
+	if (argc > 1 && strcmp(argv[1], "start") == 0) {
+		for (i = 2; i < argc; i++) {
+			for (j = 0; j < NGROUPS; j++)
+				if (strcmp(argv[i], trace_groups[j].name) == 0)
+					break;
+			if (j == NGROUPS)
+				cprintf("Unknown event '%s'\n", argv[i]);
+			else
+				mask |= trace_groups[j].mask;
+		}
+		ktrace(TRACE_START, NULL, argc > 2 ? mask : (1 << EV_NR) - 1);
+	} else if (argc > 1 && strcmp(argv[1], "stop") == 0)
+		ktrace(TRACE_STOP, NULL, 0);
+	else if (argc > 1 && strcmp(argv[1], "dump") == 0)
+		trace_dump();
+	else if (argc > 1 && strcmp(argv[1], "stream") == 0)
+		trace_stream(argc > 2 ? strtol(argv[2], NULL, 10) : 500);
+	else
+		cprintf("Usage: trace start [sched|wakeup|syscall|page|disk|all...]|stop|dump|stream [ticks]\n");
+	return 0;
+}
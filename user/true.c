@@ -0,0 +1,8 @@
+/*
+ * Exits right away, the program "bench spawn" and "bench vfork" start.
+ */
+int
+main(int argc, char **argv)
+{
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * wc [file...]: count the lines, words and bytes of the files, or of
+ * the standard input, e.g. at the end of a pipe.
+ */
+#include <inc/stdio.h>
+#include <inc/syscall.h>
+
+static char buf[4096];
+
+static void
+count(int fd, const char *name)
+{
+	uint32_t lines = 0, words = 0, bytes = 0;
+	bool inword = false;
+	int i, n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		bytes += n;
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\n')
+				lines++;
+			if (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\n' ||
+			    buf[i] == '\r')
+				inword = false;
+			else if (!inword) {
+				inword = true;
+				words++;
+			}
+		}
+	}
+	if (n < 0)
+		cprintf("wc: %s: error %d\n", name, n);
+	else
+		cprintf("%8u %8u %8u %s\n", lines, words, bytes, name);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, fd;
+
+	if (argc < 2)
+		count(STDIN_FILENO, "");
+	for (i = 1; i < argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY, 0)) < 0) {
+			cprintf("wc: %s: error %d\n", argv[i], fd);
+			continue;
+		}
+		count(fd, argv[i]);
+		close(fd);
+	}
+	return 0;
+}